@@ -16,7 +16,7 @@ void zhe_bitset_set(uint8_t *s, unsigned idx)
 
 void zhe_bitset_clear(uint8_t *s, unsigned idx)
 {
-    s[idx / 8] &= (uint8_t)~1 << (idx % 8);
+    s[idx / 8] &= (uint8_t)~(1 << (idx % 8));
 }
 
 int zhe_bitset_test(const uint8_t *s, unsigned idx)
@@ -48,3 +48,41 @@ int zhe_bitset_findfirst(const uint8_t *s, unsigned size)
     }
     return -1;
 }
+
+static unsigned ctz8(uint8_t x)
+{
+    /* x must be non-zero */
+    unsigned n = 0;
+    if ((x & 0x0f) == 0) {
+        n += 4;
+        x >>= 4;
+    }
+    if ((x & 0x03) == 0) {
+        n += 2;
+        x >>= 2;
+    }
+    if ((x & 0x01) == 0) {
+        n += 1;
+    }
+    return n;
+}
+
+int zhe_bitset_findnext(const uint8_t *s, unsigned size, unsigned from)
+{
+    /* Skips all-zero bytes, so finding the set bits of a sparse set costs little more than a pass
+       over the bytes */
+    unsigned i = from / 8;
+    uint8_t x;
+    if (from >= size) {
+        return -1;
+    }
+    x = (uint8_t)(s[i] & (0xff << (from % 8)));
+    while (x == 0) {
+        if (++i == (size + 7) / 8) {
+            return -1;
+        }
+        x = s[i];
+    }
+    const unsigned idx = 8 * i + ctz8(x);
+    return (idx < size) ? (int)idx : -1;
+}
@@ -3,7 +3,7 @@
 
 #include <stdint.h>
 
-#define DECL_BITSET(name_, size_) uint8_t name_[(size_)+7/8]
+#define DECL_BITSET(name_, size_) uint8_t name_[((size_)+7)/8]
 
 unsigned zhe_popcnt8(uint8_t x);
 void zhe_bitset_set(uint8_t *s, unsigned idx);
@@ -11,5 +11,6 @@ void zhe_bitset_clear(uint8_t *s, unsigned idx);
 int zhe_bitset_test(const uint8_t *s, unsigned idx);
 unsigned zhe_bitset_count(const uint8_t *s, unsigned size);
 int zhe_bitset_findfirst(const uint8_t *s, unsigned size);
+int zhe_bitset_findnext(const uint8_t *s, unsigned size, unsigned from);
 
 #endif /* BITSET_H */
@@ -39,11 +39,70 @@
 #  warning "scout interval should be shorter than lease duration"
 #endif
 
+/* Configurations predating the back-off get a fixed scout interval */
+#ifndef SCOUT_INTERVAL_MIN
+#define SCOUT_INTERVAL_MIN SCOUT_INTERVAL
+#endif
+
+#if SCOUT_INTERVAL_MIN <= 0 || SCOUT_INTERVAL_MIN > SCOUT_INTERVAL
+#  error "SCOUT_INTERVAL_MIN must be positive and at most SCOUT_INTERVAL"
+#endif
+
 /* Limiting number of scouts sent can make sense in a peer-to-peer setting, but it doesn't make sense for a client: the client only scouts when it is looking for a broker, and it may not ever find one if it doesn't keep looking */
 #if MAX_PEERS == 0 && SCOUT_COUNT > 0
 #  error "max scout count must be 0 in client mode"
 #endif
 
+#if XMITW_SAMPLE_LIFESPAN && ! XMITW_SAMPLE_INDEX
+#  error "XMITW_SAMPLE_LIFESPAN requires XMITW_SAMPLE_INDEX"
+#endif
+
+#if ENABLE_LOANS && TRANSPORT_MODE != TRANSPORT_PACKET
+#  error "ENABLE_LOANS requires TRANSPORT_PACKET"
+#endif
+
+#if ZHE_MAX_DELIVERY_QUEUES > 254
+#  error "ZHE_MAX_DELIVERY_QUEUES must be at most 254"
+#endif
+
+#if ZHE_MAX_URIPATTERN_NODES > 65535
+#  error "ZHE_MAX_URIPATTERN_NODES must be at most 65535"
+#endif
+
+#if ZHE_MAX_URIHANDLES > 0 && ZHE_MAX_URISPACE == 0
+#  error "ZHE_MAX_URIHANDLES requires storing URIs"
+#endif
+
+#if ZHE_MAX_URIBINDINGS > 0 && (ZHE_MAX_URISPACE == 0 || ZHE_MAX_URIBINDINGS > ZHE_MAX_RESOURCES)
+#  error "ZHE_MAX_URIBINDINGS requires storing URIs and must be at most ZHE_MAX_RESOURCES"
+#endif
+
+#if ZHE_MAX_URIBINDINGS > 0 && (ZHE_URIBIND_RIDS == 0 || ZHE_URIBIND_RIDS >= ZHE_MAX_RID || ZHE_URIBIND_THRESHOLD > 65535)
+#  error "ZHE_URIBIND_RIDS must be in [1,ZHE_MAX_RID) and ZHE_URIBIND_THRESHOLD at most 65535"
+#endif
+
+#if (ZHE_MAX_SELECTIONS > 0 || ZHE_MAX_RSELECTIONS > 0) && ZHE_MAX_URISPACE == 0
+#  error "selections require storing URIs"
+#endif
+
+#if ZHE_MAX_SELECTIONS > 255 || (ZHE_MAX_SELECTIONS > 0 && ZHE_MAX_SELECTIONS + (ZHE_MAX_URIBINDINGS > 0 ? ZHE_URIBIND_RIDS : 0) >= ZHE_MAX_RID)
+#  error "ZHE_MAX_SELECTIONS must be at most 255 and leave room for ordinary resource ids"
+#endif
+
+#if (ZHE_MAX_SELECTIONS > 0 || ZHE_MAX_RSELECTIONS > 0) && (ZHE_MAX_PREDICATE_CODE < 7 || ZHE_MAX_PREDICATE_CODE > 65535)
+#  error "ZHE_MAX_PREDICATE_CODE must be in [7,65535]"
+#endif
+
+#if FEC_GROUP_SIZE > 0
+#  if FEC_GROUP_SIZE > 32 || (FEC_GROUP_SIZE & (FEC_GROUP_SIZE - 1)) != 0
+#    error "FEC_GROUP_SIZE must be a power of 2 no larger than 32"
+#  endif
+/* parity message overhead is at most 16 bytes, and it must fit in a single packet */
+#  if FEC_MAX_MSGSIZE < 1 || FEC_MAX_MSGSIZE > TRANSPORT_MTU - 16
+#    error "FEC_MAX_MSGSIZE must be in 1 .. TRANSPORT_MTU - 16"
+#  endif
+#endif
+
 #if MAX_PEERS < 255
 typedef uint8_t peeridx_t;
 #else
@@ -0,0 +1,178 @@
+/* -*- mode: c; c-basic-offset: 4; fill-column: 95; -*- */
+#include <string.h>
+
+#include "zhe-assert.h"
+#include "zhe-int.h"
+#include "zhe-msg.h"
+#include "zhe-unpack.h"
+#include "zhe-fec.h"
+
+#if FEC_GROUP_SIZE > 0
+
+/* Parity is the XOR of the messages in the group, each padded with 0s to the size of the
+   largest one, together with the XOR of their sizes.  Given the parity and all but one of the
+   messages, the missing one follows by XOR'ing the others into the parity.  */
+
+void zhe_fec_enc_start(struct fec_enc *e)
+{
+    e->len = 0;
+    e->lenxor = 0;
+    e->ok = 1;
+    memset(e->parity, 0, sizeof(e->parity));
+}
+
+bool zhe_fec_enc_msg(struct fec_enc *e, zhe_msgsize_t len)
+{
+    if (len > FEC_MAX_MSGSIZE) {
+        e->ok = 0;
+    } else if (e->ok) {
+        e->lenxor ^= len;
+        if (len > e->len) {
+            e->len = len;
+        }
+    }
+    return e->ok;
+}
+
+void zhe_fec_enc_add(struct fec_enc *e, zhe_msgsize_t off, zhe_msgsize_t n, const uint8_t *data)
+{
+    zhe_assert(e->ok && off + n <= e->len);
+    for (zhe_msgsize_t i = 0; i < n; i++) {
+        e->parity[off + i] ^= data[i];
+    }
+}
+
+void zhe_fec_dec_reset(struct fec_dec *d)
+{
+    d->base = 0;
+    d->have = 0;
+    d->active = 0;
+    d->parity = 0;
+}
+
+static void fec_dec_setbase(struct fec_dec *d, seq_t base)
+{
+    d->base = base;
+    d->have = 0;
+    d->parity = 0;
+}
+
+void zhe_fec_dec_store(struct fec_dec *d, seq_t seq, const uint8_t *msg, zhe_msgsize_t len)
+{
+    const seq_t base = FEC_GROUP_BASE(seq);
+    const unsigned slot = FEC_GROUP_SLOT(seq);
+    if (len > FEC_MAX_MSGSIZE) {
+        return;
+    } else if (base != d->base) {
+        if (zhe_seq_lt(base, d->base)) {
+            return;
+        }
+        fec_dec_setbase(d, base);
+    }
+    if (!(d->have & (1u << slot))) {
+        /* S flag is only relevant on receipt of the original message, and a recovered message
+           can't have it because the parity covers it without */
+        memcpy(d->buf[slot], msg, len);
+        d->buf[slot][0] &= (uint8_t)~MSFLAG;
+        d->len[slot] = len;
+        d->have |= 1u << slot;
+    }
+}
+
+const uint8_t *zhe_fec_dec_get(const struct fec_dec *d, seq_t seq, zhe_msgsize_t *len)
+{
+    const unsigned slot = FEC_GROUP_SLOT(seq);
+    if (FEC_GROUP_BASE(seq) != d->base || !(d->have & (1u << slot))) {
+        return NULL;
+    }
+    *len = d->len[slot];
+    return d->buf[slot];
+}
+
+static unsigned fec_missing(uint32_t have, unsigned upto)
+{
+    /* number of slots 0 .. UPTO - 1 not present in HAVE */
+    unsigned n = 0;
+    for (unsigned i = 0; i < upto; i++) {
+        n += !(have & (1u << i));
+    }
+    return n;
+}
+
+bool zhe_fec_dec_may_recover(const struct fec_dec *d, seq_t seq)
+{
+    /* Missing message SEQ can still be recovered if the parity for its group is yet to arrive
+       and no other message of the group has been seen to be missing.  Messages following the
+       last one received haven't necessarily been lost, they may simply not have arrived yet. */
+    if (!d->active || d->parity || FEC_GROUP_BASE(seq) != d->base) {
+        return false;
+    } else {
+        unsigned upto = FEC_GROUP_SLOT(seq) + 1;
+        for (unsigned i = upto; i < FEC_GROUP_SIZE; i++) {
+            if (d->have & (1u << i)) {
+                upto = i + 1;
+            }
+        }
+        return fec_missing(d->have, upto) == 1;
+    }
+}
+
+bool zhe_fec_dec_recover(struct fec_dec *d, seq_t base, zhe_msgsize_t lenxor, zhe_paysize_t plen, const uint8_t *parity)
+{
+    uint8_t *msg;
+    zhe_msgsize_t len = lenxor;
+    unsigned slot;
+    if (base != d->base) {
+        if (zhe_seq_lt(base, d->base)) {
+            return false;
+        }
+        fec_dec_setbase(d, base);
+    }
+    d->active = 1;
+    if (d->parity || fec_missing(d->have, FEC_GROUP_SIZE) != 1) {
+        d->parity = 1;
+        return false;
+    }
+    d->parity = 1;
+    slot = 0;
+    while (d->have & (1u << slot)) {
+        slot++;
+    }
+    for (unsigned i = 0; i < FEC_GROUP_SIZE; i++) {
+        if (i != slot) {
+            len ^= d->len[i];
+        }
+    }
+    if (len == 0 || len > plen) {
+        return false;
+    }
+    msg = d->buf[slot];
+    memcpy(msg, parity, len);
+    for (unsigned i = 0; i < FEC_GROUP_SIZE; i++) {
+        if (i != slot) {
+            const zhe_msgsize_t n = d->len[i] < len ? d->len[i] : len;
+            for (zhe_msgsize_t j = 0; j < n; j++) {
+                msg[j] ^= d->buf[i][j];
+            }
+        }
+    }
+
+    /* Only reliable messages are covered, and the sequence number in the reconstructed message
+       must match its position in the group; anything else means the parity doesn't match the
+       messages we received, and then it is better to fall back to retransmission */
+    {
+        const uint8_t kind = msg[0] & MKIND;
+        const uint8_t *p = msg + 1;
+        seq_t seq;
+        if ((kind != MDECLARE && !((kind == MSDATA || kind == MWDATA) && (msg[0] & MRFLAG))) || (msg[0] & MSFLAG)) {
+            return false;
+        } else if (zhe_unpack_seq(msg + len, &p, &seq) != ZUR_OK || seq != base + (seq_t)(slot << SEQNUM_SHIFT)) {
+            return false;
+        }
+    }
+    d->len[slot] = len;
+    d->have |= 1u << slot;
+    return true;
+}
+
+#endif
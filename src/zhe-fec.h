@@ -0,0 +1,43 @@
+#ifndef ZHE_FEC_H
+#define ZHE_FEC_H
+
+#include <stdbool.h>
+#include "zhe-config-deriv.h"
+
+#if FEC_GROUP_SIZE > 0
+
+/* Groups are aligned on sequence numbers, so which group a message belongs to and where in that
+   group it sits follow from its sequence number alone, without any further state or signalling */
+#define FEC_GROUP_MASK ((seq_t)(FEC_GROUP_SIZE * SEQNUM_UNIT - 1))
+#define FEC_GROUP_BASE(seq_) ((seq_t)((seq_) & (seq_t)~FEC_GROUP_MASK))
+#define FEC_GROUP_SLOT(seq_) ((unsigned)(((seq_) & FEC_GROUP_MASK) >> SEQNUM_SHIFT))
+
+struct fec_enc {
+    zhe_msgsize_t len;            /* size of longest message in group so far = size of parity */
+    zhe_msgsize_t lenxor;         /* XOR of the sizes of the messages in the group */
+    uint8_t ok;                   /* whether all messages in the group so far fit in FEC_MAX_MSGSIZE */
+    uint8_t parity[FEC_MAX_MSGSIZE];
+};
+
+struct fec_dec {
+    seq_t base;                   /* first sequence number of the group being collected */
+    uint32_t have;                /* bit i set iff message base + i is buffered */
+    uint8_t active: 1;            /* whether the sender is known to send parity on this conduit */
+    uint8_t parity: 1;            /* whether the parity for this group has been processed */
+    zhe_msgsize_t len[FEC_GROUP_SIZE];
+    uint8_t buf[FEC_GROUP_SIZE][FEC_MAX_MSGSIZE];
+};
+
+void zhe_fec_enc_start(struct fec_enc *e);
+bool zhe_fec_enc_msg(struct fec_enc *e, zhe_msgsize_t len);
+void zhe_fec_enc_add(struct fec_enc *e, zhe_msgsize_t off, zhe_msgsize_t n, const uint8_t *data);
+
+void zhe_fec_dec_reset(struct fec_dec *d);
+void zhe_fec_dec_store(struct fec_dec *d, seq_t seq, const uint8_t *msg, zhe_msgsize_t len);
+const uint8_t *zhe_fec_dec_get(const struct fec_dec *d, seq_t seq, zhe_msgsize_t *len);
+bool zhe_fec_dec_may_recover(const struct fec_dec *d, seq_t seq);
+bool zhe_fec_dec_recover(struct fec_dec *d, seq_t base, zhe_msgsize_t lenxor, zhe_paysize_t plen, const uint8_t *parity);
+
+#endif
+
+#endif
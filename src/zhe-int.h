@@ -20,15 +20,24 @@ struct peerid {
 };
 
 int zhe_xmitw_hasspace(const struct out_conduit *c, zhe_paysize_t sz);
+zhe_paysize_t zhe_xmitw_maxmsgsize(const struct out_conduit *c);
 void zhe_pack_reserve(zhe_address_t *dst, struct out_conduit *oc, zhe_paysize_t cnt, zhe_time_t tnow);
 void zhe_pack1(uint8_t x);
 void zhe_pack2(uint8_t x, uint8_t y);
 void zhe_pack_vec(zhe_paysize_t n, const void *buf);
+void zhe_pack_bytes(zhe_paysize_t n, const void *buf);
 uint16_t zhe_pack_locs_calcsize(void);
 void zhe_pack_locs(void);
 void zhe_oc_hit_full_window(struct out_conduit *c, zhe_time_t tnow);
 int zhe_oc_am_draining_window(const struct out_conduit *c);
+void zhe_oc_request_ack(struct out_conduit *c, zhe_time_t tnow);
 cid_t zhe_oc_get_cid(struct out_conduit *c);
+seq_t zhe_oc_get_nextseq(const struct out_conduit *c);
+void zhe_oc_note_declare(struct out_conduit *c);
+bool zhe_oc_supersede(struct out_conduit *c, seq_t seq, zhe_rid_t rid);
+#if XMITW_SAMPLE_LIFESPAN
+void zhe_oc_set_expiry(struct out_conduit *c, seq_t seq, zhe_time_t texp);
+#endif
 bool zhe_out_conduit_is_connected(peeridx_t peeridx, cid_t cid);
 int zhe_ocm_have_peers(const struct out_mconduit *mc); /* FIXME: do I need to keep this? */
 void zhe_pack_msend(void);
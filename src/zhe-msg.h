@@ -27,6 +27,7 @@
 #define MSDDATA            21 /* FIXME: NIY */
 #define MBDDATA            22 /* FIXME: NIY */
 #define MWDDATA            23 /* FIXME: NIY */
+#define MFEC               24 /* zhe extension: parity over a group of reliable messages */
 
 #define MKIND            0x1f
 
@@ -251,6 +251,16 @@ void zhe_pack_msynch(zhe_address_t *dst, uint8_t sflag, cid_t cid, seq_t seqbase
     zhe_synch_sent++;
 }
 
+void zhe_pack_mfec(seq_t base, uint8_t k, zhe_msgsize_t lenxor, zhe_msgsize_t len, const uint8_t *parity)
+{
+    /* caller is responsible for reserving space */
+    zhe_pack1(MFEC);
+    zhe_pack_seq(base);
+    zhe_pack1(k);
+    zhe_pack_vle16(lenxor);
+    zhe_pack_vec(len, parity);
+}
+
 void zhe_pack_macknack(zhe_address_t *dst, cid_t cid, seq_t seq, uint32_t mask, zhe_time_t tnow)
 {
     zhe_pack_reserve_mconduit(dst, NULL, cid, 1 + zhe_pack_seqreq(seq) + (mask ? zhe_pack_vle32req(mask) : 0), tnow);
@@ -346,6 +356,30 @@ int zhe_oc_pack_mwdata(struct out_conduit *c, int relflag, zhe_paysize_t urisz,
     return 1;
 }
 
+int zhe_oc_pack_mwdata_enc(struct out_conduit *c, int relflag, zhe_paysize_t enclen, const uint8_t *enc, zhe_paysize_t payloadlen, zhe_time_t tnow)
+{
+    /* Same as zhe_oc_pack_mwdata, but with the URI already encoded (length included) */
+    const zhe_paysize_t sz = 1 + WORST_CASE_SEQ_SIZE + enclen + zhe_pack_vle16req(payloadlen) + payloadlen;
+    const uint8_t hdr = MWDATA | (relflag ? MRFLAG : 0);
+    zhe_msgsize_t from;
+    seq_t s;
+
+    if (relflag && !zhe_xmitw_hasspace(c, sz)) {
+        zhe_oc_hit_full_window(c, tnow);
+        return 0;
+    }
+
+    from = zhe_oc_pack_payload_msgprep(&s, c, relflag, sz, tnow);
+    zhe_pack1(hdr);
+    zhe_pack_seq(s);
+    zhe_pack_bytes(enclen, enc);
+    zhe_pack_vle16(payloadlen);
+    if (relflag) {
+        zhe_oc_pack_copyrel(c, from);
+    }
+    return 1;
+}
+
 void zhe_oc_pack_mwdata_payload(struct out_conduit *c, int relflag, zhe_paysize_t sz, const void *vdata)
 {
     zhe_oc_pack_msdata_payload(c, relflag, sz, vdata);
@@ -356,11 +390,23 @@ void zhe_oc_pack_mwdata_done(struct out_conduit *c, int relflag, zhe_time_t tnow
     zhe_oc_pack_msdata_done(c, relflag, tnow);
 }
 
+zhe_paysize_t zhe_oc_mdeclare_maxdecllen(const struct out_conduit *c)
+{
+    /* Largest size of the declarations in a DECLARE that zhe_oc_pack_mdeclare currently accepts
+       and that still fits in a packet along with a conduit id */
+    const zhe_paysize_t hdrsz = 1 + WORST_CASE_SEQ_SIZE + zhe_pack_vle16req(MAX_DECLS_PER_DECLARE);
+    zhe_paysize_t maxsz = zhe_xmitw_maxmsgsize(c);
+    if (maxsz > TRANSPORT_MTU - 2) {
+        maxsz = TRANSPORT_MTU - 2;
+    }
+    return (maxsz > hdrsz) ? (zhe_paysize_t)(maxsz - hdrsz) : 0;
+}
+
 int zhe_oc_pack_mdeclare(struct out_conduit *c, bool committed, uint8_t ndecls, zhe_paysize_t decllen, zhe_msgsize_t *from, zhe_time_t tnow)
 {
     const zhe_paysize_t sz = 1 + WORST_CASE_SEQ_SIZE + zhe_pack_vle16req(ndecls) + decllen;
     seq_t s;
-    zhe_assert(ndecls <= 127);
+    zhe_assert(ndecls <= MAX_DECLS_PER_DECLARE);
     if (!zhe_xmitw_hasspace(c, sz)) {
         return 0;
     }
@@ -375,6 +421,7 @@ void zhe_oc_pack_mdeclare_done(struct out_conduit *c, zhe_msgsize_t from, zhe_ti
 {
     zhe_oc_pack_copyrel(c, from);
     zhe_oc_pack_payload_done(c, 1, tnow);
+    zhe_oc_note_declare(c);
 }
 
 void zhe_pack_dresource(zhe_rid_t rid, zhe_paysize_t urisz, const uint8_t *res)
@@ -384,6 +431,21 @@ void zhe_pack_dresource(zhe_rid_t rid, zhe_paysize_t urisz, const uint8_t *res)
     zhe_pack_vec(urisz, res);
 }
 
+void zhe_pack_dbindid(zhe_rid_t oldrid, zhe_rid_t newrid)
+{
+    zhe_pack1(DBINDID);
+    zhe_pack_rid(oldrid);
+    zhe_pack_rid(newrid);
+}
+
+void zhe_pack_dselection(zhe_rid_t sid, zhe_paysize_t enclen, const uint8_t *enc)
+{
+    /* enc is the query already encoded as a vector */
+    zhe_pack1(DSELECTION);
+    zhe_pack_rid(sid);
+    zhe_pack_bytes(enclen, enc);
+}
+
 void zhe_pack_dpub(zhe_rid_t rid)
 {
     zhe_pack1(DPUB);
@@ -397,6 +459,24 @@ void zhe_pack_dsub(zhe_rid_t rid)
     zhe_pack1(SUBMODE_PUSH); /* FIXME: should be a parameter */
 }
 
+void zhe_pack_dfpub(zhe_rid_t rid)
+{
+    zhe_pack1(DFPUB);
+    zhe_pack_rid(rid);
+}
+
+void zhe_pack_dfsub(zhe_rid_t rid)
+{
+    zhe_pack1(DFSUB);
+    zhe_pack_rid(rid);
+}
+
+void zhe_pack_dfselection(zhe_rid_t sid)
+{
+    zhe_pack1(DFSELECTION);
+    zhe_pack_rid(sid);
+}
+
 void zhe_pack_dcommit(uint8_t commitid)
 {
     zhe_pack2(DCOMMIT, commitid);
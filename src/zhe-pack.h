@@ -26,6 +26,7 @@ void zhe_pack_maccept(zhe_address_t *dst, const struct peerid *ownid, const stru
 void zhe_pack_mclose(zhe_address_t *dst, uint8_t reason, const struct peerid *ownid, zhe_time_t tnow);
 void zhe_pack_reserve_mconduit(zhe_address_t *dst, struct out_conduit *oc, cid_t cid, zhe_paysize_t cnt, zhe_time_t tnow);
 void zhe_pack_msynch(zhe_address_t *dst, uint8_t sflag, cid_t cid, seq_t seqbase, seq_t cnt, zhe_time_t tnow);
+void zhe_pack_mfec(seq_t base, uint8_t k, zhe_msgsize_t lenxor, zhe_msgsize_t len, const uint8_t *parity);
 void zhe_pack_macknack(zhe_address_t *dst, cid_t cid, seq_t seq, uint32_t mask, zhe_time_t tnow);
 void zhe_pack_mping(zhe_address_t *dst, uint16_t hash, zhe_time_t tnow);
 void zhe_pack_mpong(zhe_address_t *dst, uint16_t hash, zhe_time_t tnow);
@@ -34,13 +35,22 @@ int zhe_oc_pack_msdata(struct out_conduit *c, int relflag, zhe_rid_t rid, zhe_pa
 void zhe_oc_pack_msdata_payload(struct out_conduit *c, int relflag, zhe_paysize_t sz, const void *vdata);
 void zhe_oc_pack_msdata_done(struct out_conduit *c, int relflag, zhe_time_t tnow);
 int zhe_oc_pack_mwdata(struct out_conduit *c, int relflag, zhe_paysize_t urisz, const void *uri, zhe_paysize_t payloadlen, zhe_time_t tnow);
+int zhe_oc_pack_mwdata_enc(struct out_conduit *c, int relflag, zhe_paysize_t enclen, const uint8_t *enc, zhe_paysize_t payloadlen, zhe_time_t tnow);
 void zhe_oc_pack_mwdata_payload(struct out_conduit *c, int relflag, zhe_paysize_t sz, const void *vdata);
 void zhe_oc_pack_mwdata_done(struct out_conduit *c, int relflag, zhe_time_t tnow);
+/* A DECLARE carries at most MAX_DECLS_PER_DECLARE declarations, so that the count fits in a byte */
+#define MAX_DECLS_PER_DECLARE 127
+zhe_paysize_t zhe_oc_mdeclare_maxdecllen(const struct out_conduit *c);
 int zhe_oc_pack_mdeclare(struct out_conduit *c, bool committed, uint8_t ndecls, zhe_paysize_t decllen, zhe_msgsize_t *from, zhe_time_t tnow);
 void zhe_oc_pack_mdeclare_done(struct out_conduit *c, zhe_msgsize_t from, zhe_time_t tnow);
 void zhe_pack_dresource(zhe_rid_t rid, zhe_paysize_t urisz, const uint8_t *uri);
+void zhe_pack_dbindid(zhe_rid_t oldrid, zhe_rid_t newrid);
 void zhe_pack_dpub(zhe_rid_t rid);
 void zhe_pack_dsub(zhe_rid_t rid);
+void zhe_pack_dselection(zhe_rid_t sid, zhe_paysize_t enclen, const uint8_t *enc);
+void zhe_pack_dfpub(zhe_rid_t rid);
+void zhe_pack_dfsub(zhe_rid_t rid);
+void zhe_pack_dfselection(zhe_rid_t sid);
 void zhe_pack_dcommit(uint8_t commitid);
 void zhe_pack_dresult(uint8_t commitid, uint8_t status, zhe_rid_t rid);
 
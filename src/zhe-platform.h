@@ -17,6 +17,10 @@ struct zhe_platform;
 /* Return 0 if a and b are different addresses, 1 if they are the same */
 int zhe_platform_addr_eq(const struct zhe_address *a, const struct zhe_address *b);
 
+/* Return a hash of address a, such that addresses for which zhe_platform_addr_eq returns 1 have
+ the same hash; used for looking up the peer corresponding to the source address of a packet. */
+unsigned zhe_platform_addr_hash(const struct zhe_address *a);
+
 /* Convert the address in ADDR to a standard string representation, and write the result into str.
  No more than size bytes shall be written to str, and str shall be null-terminated. Size must
  consequently be > 0. Number of characters written into str shall be returned. Failure is not an
@@ -31,4 +35,12 @@ int zhe_platform_send(struct zhe_platform *pf, const void * restrict buf, size_t
 
 void zhe_platform_trace(struct zhe_platform *pf, const char *fmt, ...);
 
+#if ENABLE_LOANS
+/* Increment resp. decrement the reference count of the receive buffer identified by loan (as
+ passed to zhe_input_batch in struct zhe_inpkt); the platform may reuse the buffer for receiving
+ only while the count is 0. */
+void zhe_platform_loan_retain(void *loan);
+void zhe_platform_loan_release(void *loan);
+#endif
+
 #endif
@@ -0,0 +1,254 @@
+/* -*- mode: c; c-basic-offset: 4; fill-column: 95; -*- */
+#include <string.h>
+
+#include "zhe-assert.h"
+#include "zhe-predicate.h"
+
+#if ZHE_MAX_SELECTIONS > 0 || (MAX_PEERS > 0 && ZHE_MAX_RSELECTIONS > 0)
+
+/* Code: a comparison is a byte (type << 3 | operator), followed by the offset (2 bytes) and the
+   constant (4 bytes), both little-endian, and pushes the result on a stack of booleans; the
+   logical operators pop their operands and push the result. The stack is a bit mask, and hence
+   the nesting depth of the predicate is limited to 32. */
+#define PC_AND 0x40
+#define PC_OR  0x41
+#define PC_NOT 0x42
+#define PC_CMP_SIZE 7
+#define MAX_DEPTH 32
+
+enum pred_type { PT_U8, PT_U16, PT_U32, PT_I8, PT_I16, PT_I32 };
+enum pred_op { PO_EQ, PO_NE, PO_LT, PO_LE, PO_GT, PO_GE };
+
+static const uint8_t pred_type_size[] = { 1, 2, 4, 1, 2, 4 };
+
+struct pred_compiler {
+    const uint8_t *src, *end;
+    uint8_t *code;
+    zhe_paysize_t n;
+    unsigned depth, maxdepth;
+    unsigned nest;                /* recursion depth of pc_unary, bounded for untrusted input */
+    bool ok;
+};
+
+static void pc_skipws(struct pred_compiler *pc)
+{
+    while (pc->src < pc->end && (*pc->src == ' ' || *pc->src == '\t')) {
+        pc->src++;
+    }
+}
+
+static bool pc_lit(struct pred_compiler *pc, const char *lit)
+{
+    const size_t n = strlen(lit);
+    pc_skipws(pc);
+    if ((size_t)(pc->end - pc->src) >= n && memcmp(pc->src, lit, n) == 0) {
+        pc->src += n;
+        return true;
+    }
+    return false;
+}
+
+static void pc_emit(struct pred_compiler *pc, uint8_t x)
+{
+    if (pc->n == ZHE_MAX_PREDICATE_CODE) {
+        pc->ok = false;
+    } else {
+        pc->code[pc->n++] = x;
+    }
+}
+
+static void pc_push(struct pred_compiler *pc)
+{
+    if (++pc->depth > pc->maxdepth) {
+        pc->maxdepth = pc->depth;
+    }
+}
+
+static bool pc_number(struct pred_compiler *pc, uint32_t *x)
+{
+    bool neg = false, any = false;
+    uint32_t v = 0, base = 10;
+    pc_skipws(pc);
+    if (pc->src < pc->end && *pc->src == '-') {
+        neg = true;
+        pc->src++;
+    }
+    if (pc->end - pc->src > 2 && pc->src[0] == '0' && (pc->src[1] == 'x' || pc->src[1] == 'X')) {
+        base = 16;
+        pc->src += 2;
+    }
+    while (pc->src < pc->end) {
+        const uint8_t c = *pc->src;
+        uint32_t d;
+        if (c >= '0' && c <= '9') {
+            d = (uint32_t)(c - '0');
+        } else if (base == 16 && c >= 'a' && c <= 'f') {
+            d = (uint32_t)(c - 'a' + 10);
+        } else if (base == 16 && c >= 'A' && c <= 'F') {
+            d = (uint32_t)(c - 'A' + 10);
+        } else {
+            break;
+        }
+        if (v > (UINT32_MAX - d) / base) {
+            return false;
+        }
+        v = v * base + d;
+        any = true;
+        pc->src++;
+    }
+    *x = neg ? (uint32_t)-v : v;
+    return any;
+}
+
+static void pc_disj(struct pred_compiler *pc);
+
+static void pc_cmp(struct pred_compiler *pc)
+{
+    static const char *types[] = { "u8", "u16", "u32", "i8", "i16", "i32" };
+    /* two-character operators first, so that "<=" isn't taken for "<" */
+    static const struct { const char *lit; enum pred_op op; } ops[] = {
+        { "==", PO_EQ }, { "!=", PO_NE }, { "<=", PO_LE }, { ">=", PO_GE }, { "<", PO_LT }, { ">", PO_GT }
+    };
+    unsigned t, o;
+    uint32_t off, k;
+    for (t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+        if (pc_lit(pc, types[t])) {
+            break;
+        }
+    }
+    if (t == sizeof(types) / sizeof(types[0]) || !pc_lit(pc, "@") || !pc_number(pc, &off) || off > UINT16_MAX) {
+        pc->ok = false;
+        return;
+    }
+    for (o = 0; o < sizeof(ops) / sizeof(ops[0]); o++) {
+        if (pc_lit(pc, ops[o].lit)) {
+            break;
+        }
+    }
+    if (o == sizeof(ops) / sizeof(ops[0]) || !pc_number(pc, &k)) {
+        pc->ok = false;
+        return;
+    }
+    pc_emit(pc, (uint8_t)((t << 3) | (unsigned)ops[o].op));
+    pc_emit(pc, (uint8_t)off);
+    pc_emit(pc, (uint8_t)(off >> 8));
+    for (unsigned i = 0; i < 4; i++) {
+        pc_emit(pc, (uint8_t)(k >> (8 * i)));
+    }
+    pc_push(pc);
+}
+
+static void pc_unary(struct pred_compiler *pc)
+{
+    /* Deeper nesting than the stack allows is rejected anyway, so give up before it costs stack */
+    if (++pc->nest > MAX_DEPTH) {
+        pc->ok = false;
+        pc->nest--;
+        return;
+    }
+    if (pc_lit(pc, "!")) {
+        pc_unary(pc);
+        pc_emit(pc, PC_NOT);
+    } else if (pc_lit(pc, "(")) {
+        pc_disj(pc);
+        if (!pc_lit(pc, ")")) {
+            pc->ok = false;
+        }
+    } else {
+        pc_cmp(pc);
+    }
+    pc->nest--;
+}
+
+static void pc_conj(struct pred_compiler *pc)
+{
+    pc_unary(pc);
+    while (pc->ok && pc_lit(pc, "&&")) {
+        pc_unary(pc);
+        pc_emit(pc, PC_AND);
+        pc->depth--;
+    }
+}
+
+static void pc_disj(struct pred_compiler *pc)
+{
+    pc_conj(pc);
+    while (pc->ok && pc_lit(pc, "||")) {
+        pc_conj(pc);
+        pc_emit(pc, PC_OR);
+        pc->depth--;
+    }
+}
+
+zhe_paysize_t zhe_predicate_compile(const uint8_t *src, size_t srclen, uint8_t *code)
+{
+    struct pred_compiler pc = { .src = src, .end = src + srclen, .code = code, .n = 0, .depth = 0, .maxdepth = 0, .nest = 0, .ok = true };
+    pc_skipws(&pc);
+    if (pc.src == pc.end) {
+        return 0;
+    }
+    pc_disj(&pc);
+    pc_skipws(&pc);
+    if (!pc.ok || pc.src != pc.end || pc.maxdepth > MAX_DEPTH) {
+        return 0;
+    }
+    return pc.n;
+}
+
+static bool pred_cmp(const uint8_t *c, const uint8_t *pay, zhe_paysize_t sz)
+{
+    const enum pred_type t = (enum pred_type)(c[0] >> 3);
+    const enum pred_op op = (enum pred_op)(c[0] & 7);
+    const unsigned off = (unsigned)c[1] | ((unsigned)c[2] << 8);
+    const uint32_t k = (uint32_t)c[3] | ((uint32_t)c[4] << 8) | ((uint32_t)c[5] << 16) | ((uint32_t)c[6] << 24);
+    const unsigned n = pred_type_size[t];
+    uint32_t v = 0;
+    int cmp;
+    if (off + n > sz) {
+        return false;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        v |= (uint32_t)pay[off + i] << (8 * i);
+    }
+    if (t >= PT_I8) {
+        /* sign-extend, then compare as signed */
+        const uint32_t m = (uint32_t)1 << (8 * n - 1);
+        const int32_t sv = (int32_t)((v ^ m) - m);
+        const int32_t sk = (int32_t)k;
+        cmp = (sv < sk) ? -1 : (sv > sk);
+    } else {
+        cmp = (v < k) ? -1 : (v > k);
+    }
+    switch (op) {
+        case PO_EQ: return cmp == 0;
+        case PO_NE: return cmp != 0;
+        case PO_LT: return cmp < 0;
+        case PO_LE: return cmp <= 0;
+        case PO_GT: return cmp > 0;
+        case PO_GE: return cmp >= 0;
+    }
+    return false;
+}
+
+bool zhe_predicate_eval(const uint8_t *code, zhe_paysize_t codelen, const void *payload, zhe_paysize_t sz)
+{
+    uint32_t stk = 0;
+    zhe_paysize_t i = 0;
+    if (codelen == 0) {
+        return true;
+    }
+    while (i < codelen) {
+        switch (code[i]) {
+            case PC_AND: stk = (stk >> 1) & (stk | ~(uint32_t)1); i++; break;
+            case PC_OR:  stk = (stk >> 1) | (stk & 1); i++; break;
+            case PC_NOT: stk ^= 1; i++; break;
+            default:
+                stk = (stk << 1) | pred_cmp(&code[i], payload, sz);
+                i += PC_CMP_SIZE;
+                break;
+        }
+    }
+    return stk & 1;
+}
+
+#endif
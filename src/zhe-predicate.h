@@ -0,0 +1,23 @@
+#ifndef ZHE_PREDICATE_H
+#define ZHE_PREDICATE_H
+
+#include <stdbool.h>
+#include "zhe-config-deriv.h"
+
+#if ZHE_MAX_SELECTIONS > 0 || (MAX_PEERS > 0 && ZHE_MAX_RSELECTIONS > 0)
+
+/* Predicates on the contents of samples, for selections: comparisons of little-endian integers at
+   fixed offsets in the payload with constants, combined using "&&", "||", "!" and parentheses, for
+   example "u16@4>1000&&(u8@0==3||!i32@8<0)". The types are u8, u16, u32, i8, i16 and i32, the
+   offsets are in bytes, and the constants decimal or hexadecimal (0x...). A comparison involving a
+   field beyond the end of the payload is false.
+
+   A predicate is compiled into a postfix code of at most ZHE_MAX_PREDICATE_CODE bytes, for which
+   the compiler returns the length, or 0 if the predicate is invalid or doesn't fit. An empty
+   predicate compiles to an empty code, which is always true. */
+zhe_paysize_t zhe_predicate_compile(const uint8_t *src, size_t srclen, uint8_t *code);
+bool zhe_predicate_eval(const uint8_t *code, zhe_paysize_t codelen, const void *payload, zhe_paysize_t sz);
+
+#endif
+
+#endif
@@ -10,13 +10,90 @@
 #include "zhe-pubsub.h"
 #include "zhe-bitset.h"
 #include "zhe-uristore.h"
+#include "zhe-predicate.h"
 
-/* Start using a RID-to-subscription mapping if ZHE_MAX_SUBSCRIPTIONS is over this threshold */
+/* Start using a RID-to-subscription (RID-to-publication) mapping if ZHE_MAX_SUBSCRIPTIONS
+   (ZHE_MAX_PUBLICATIONS) is over this threshold */
 #define RID_TABLE_THRESHOLD 32
 
+#define MAX3(a,b,c) ((a) > (b) ? ((a) > (c) ? (a) : (c)) : ((b) > (c)) ? (b) : (c))
+#define MAX_DECLITEM MAX3(ZHE_MAX_RESOURCES, ZHE_MAX_PUBLICATIONS, ZHE_MAX_SUBSCRIPTIONS)
+#if MAX_DECLITEM <= UINT8_MAX-1
+typedef uint8_t declitem_idx_t;
+#define DECLITEM_IDX_INVALID UINT8_MAX
+#elif MAX_DECLITEM <= UINT16_MAX-1
+typedef uint16_t declitem_idx_t;
+#define DECLITEM_IDX_INVALID UINT16_MAX
+#elif MAX_DECLITEM <= UINT32_MAX-1
+typedef uint32_t declitem_idx_t;
+#define DECLITEM_IDX_INVALID UINT32_MAX
+#else
+#error "MAX_DECLITEM way larger than expected"
+#endif
+
+/* Publications and subscriptions in use are kept in a list in order of creation, which the
+   declaration cursors follow, and unused ones in a free list, with the links in an array alongside
+   the table; entries from "hwm" on have never been used. Links are index + 1, so that 0 ends a
+   list and a zero-initialised list is empty. */
+struct slotlist {
+    declitem_idx_t head, tail, free, hwm;
+};
+
+static declitem_idx_t slotlist_alloc(struct slotlist *l, declitem_idx_t *next, declitem_idx_t size)
+{
+    declitem_idx_t idx;
+    if (l->free != 0) {
+        idx = (declitem_idx_t)(l->free - 1);
+        l->free = next[idx];
+    } else if (l->hwm < size) {
+        idx = l->hwm++;
+    } else {
+        return DECLITEM_IDX_INVALID;
+    }
+    next[idx] = 0;
+    if (l->tail == 0) {
+        l->head = (declitem_idx_t)(idx + 1);
+    } else {
+        next[l->tail - 1] = (declitem_idx_t)(idx + 1);
+    }
+    l->tail = (declitem_idx_t)(idx + 1);
+    return idx;
+}
+
+static void slotlist_free(struct slotlist *l, declitem_idx_t *next, declitem_idx_t idx)
+{
+    /* Unlinking requires finding the predecessor, but only deleting pays for that */
+    declitem_idx_t *p = &l->head, prev = 0;
+    while (*p != idx + 1) {
+        zhe_assert(*p != 0);
+        prev = *p;
+        p = &next[*p - 1];
+    }
+    *p = next[idx];
+    if (l->tail == idx + 1) {
+        l->tail = prev;
+    }
+    next[idx] = l->free;
+    l->free = (declitem_idx_t)(idx + 1);
+}
+
+/* First entry in use, DECLITEM_IDX_INVALID if there is none */
+static declitem_idx_t slotlist_first(const struct slotlist *l)
+{
+    return (l->head == 0) ? DECLITEM_IDX_INVALID : (declitem_idx_t)(l->head - 1);
+}
+
+/* Entry in use following idx, DECLITEM_IDX_INVALID if there is none */
+static declitem_idx_t slotlist_next(const declitem_idx_t *next, declitem_idx_t idx)
+{
+    return (next[idx] == 0) ? DECLITEM_IDX_INVALID : (declitem_idx_t)(next[idx] - 1);
+}
+
 struct subtable {
     /* ID of the resource subscribed to (could also be a SID, actually) */
     zhe_rid_t rid;
+    /* Next subscription to the same RID, SUBIDX_NONE at the end of the list; the first subscription
+       to a RID is the head of the list, later ones are inserted after it */
     zhe_subidx_t next;
 
     /* Minimum number of bytes that must be available in transmit window in the given conduit
@@ -28,21 +105,198 @@ struct subtable {
     /* */
     void *arg;
     zhe_subhandler_t handler;
+
+    /* Combined xmitneed per conduit of all subscriptions to this RID, maintained in the head of
+       the list only, so that delivery requires no walking of the list to check available space */
+    zhe_paysize_t ridneed[N_OUT_CONDUITS];
+#if ZHE_MAX_DELIVERY_QUEUES > 0
+    /* Delivery queue index + 1, 0 if the handler is invoked directly; and, in the head of the list,
+       whether any subscription to this RID has a queue with policy ZHE_QUEUE_BLOCK */
+    uint8_t delivq;
+    uint8_t ridblock;
+#endif
+#if ZHE_MAX_SELECTIONS > 0
+    /* Selection index + 1, 0 if all samples are of interest; and whether the subscription has
+       been declared to a peer, after which adding a selection would only filter locally */
+    uint8_t sel;
+    uint8_t declared;
+#endif
 };
 static struct subtable subs[ZHE_MAX_SUBSCRIPTIONS];
-/* FIXME: should support deleting pubs, subs, &c., and then a we need a linked list instead of a simple maximum */
-static zhe_subidx_t max_subidx;
+#define SUBIDX_NONE ZHE_MAX_SUBSCRIPTIONS
+static struct slotlist sublist;
+static declitem_idx_t subs_lnext[ZHE_MAX_SUBSCRIPTIONS];
+
+#if ZHE_MAX_SUBSCRIPTIONS > RID_TABLE_THRESHOLD || ZHE_MAX_PUBLICATIONS > RID_TABLE_THRESHOLD || MAX_PEERS > 0
+static unsigned rid_hash(zhe_rid_t rid)
+{
+#if ZHE_RID_SIZE > 32
+    uint32_t h = (uint32_t)(rid ^ (rid >> 32));
+#else
+    uint32_t h = (uint32_t)rid;
+#endif
+    h *= 0x9e3779b1u;
+    return (unsigned)(h ^ (h >> 16));
+}
+#endif
+
 #if ZHE_MAX_SUBSCRIPTIONS > RID_TABLE_THRESHOLD
-static zhe_subidx_t rid2sub[ZHE_MAX_RID+1];
+/* Open-addressing hash table with linear probing, mapping a RID to the first subscription in the
+   list of subscriptions to that RID, with RID 0 marking an empty slot. Each RID occurs at most
+   once and is removed along with its last subscription, so twice the number of subscriptions
+   guarantees an empty slot to terminate probing, regardless of the range of RIDs. */
+#define RID2SUB_SIZE (2 * ZHE_MAX_SUBSCRIPTIONS)
+struct rid2sub {
+    zhe_rid_t rid;
+    zhe_subidx_t subidx;
+};
+static struct rid2sub rid2sub[RID2SUB_SIZE];
+
+static struct rid2sub *rid2sub_lookup(zhe_rid_t rid)
+{
+    /* Returns the slot for rid if present, else the empty slot where it should be inserted */
+    unsigned pos = rid_hash(rid) % RID2SUB_SIZE;
+    while (rid2sub[pos].rid != 0 && rid2sub[pos].rid != rid) {
+        pos = (pos + 1) % RID2SUB_SIZE;
+    }
+    return &rid2sub[pos];
+}
+
+static void rid2sub_delete(struct rid2sub *r)
+{
+    /* Backward-shift deletion, as for the peer tables in zhe.c */
+    unsigned i = (unsigned)(r - rid2sub), j = i;
+    while (1) {
+        j = (j + 1) % RID2SUB_SIZE;
+        if (rid2sub[j].rid == 0) {
+            break;
+        }
+        const unsigned k = rid_hash(rid2sub[j].rid) % RID2SUB_SIZE;
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        rid2sub[i] = rid2sub[j];
+        i = j;
+    }
+    rid2sub[i].rid = 0;
+}
 #endif
 
 struct pubtable {
     struct out_conduit *oc;
     zhe_rid_t rid;
+    seq_t lastseq;                /* sequence number of latest reliable sample, for keep-last */
+    bool lastseq_valid;           /* whether lastseq is set, i.e., a sample has been written */
+#if XMITW_SAMPLE_LIFESPAN
+    zhe_timediff_t lifespan;      /* time after which reliable samples may be dropped, 0 for never */
+#endif
 };
 static struct pubtable pubs[ZHE_MAX_PUBLICATIONS];
-/* FIXME: should support deleting pubs, subs, &c., and then a we need a linked list instead of a simple maximum */
-static zhe_pubidx_t max_pubidx;
+static struct slotlist publist;
+static declitem_idx_t pubs_lnext[ZHE_MAX_PUBLICATIONS];
+/* Publications of the same RID form a list in order of index, linked through pubs_rnext and
+   ending in DECLITEM_IDX_INVALID, so that a (remote) subscription affects all of them */
+static declitem_idx_t pubs_rnext[ZHE_MAX_PUBLICATIONS];
+
+#if ZHE_MAX_PUBLICATIONS > RID_TABLE_THRESHOLD
+/* Open-addressing hash table mapping a RID to the first publication of that RID, like rid2sub */
+#define RID2PUB_SIZE (2 * ZHE_MAX_PUBLICATIONS)
+struct rid2pub {
+    zhe_rid_t rid;
+    declitem_idx_t pubidx;
+};
+static struct rid2pub rid2pub[RID2PUB_SIZE];
+
+static struct rid2pub *rid2pub_lookup(zhe_rid_t rid)
+{
+    /* Returns the slot for rid if present, else the empty slot where it should be inserted */
+    unsigned pos = rid_hash(rid) % RID2PUB_SIZE;
+    while (rid2pub[pos].rid != 0 && rid2pub[pos].rid != rid) {
+        pos = (pos + 1) % RID2PUB_SIZE;
+    }
+    return &rid2pub[pos];
+}
+
+static void rid2pub_delete(struct rid2pub *r)
+{
+    /* Backward-shift deletion, as for the peer tables in zhe.c */
+    unsigned i = (unsigned)(r - rid2pub), j = i;
+    while (1) {
+        j = (j + 1) % RID2PUB_SIZE;
+        if (rid2pub[j].rid == 0) {
+            break;
+        }
+        const unsigned k = rid_hash(rid2pub[j].rid) % RID2PUB_SIZE;
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        rid2pub[i] = rid2pub[j];
+        i = j;
+    }
+    rid2pub[i].rid = 0;
+}
+#endif
+
+/* Returns the first publication of rid, DECLITEM_IDX_INVALID if there is none */
+static declitem_idx_t pub_first(zhe_rid_t rid)
+{
+#if ZHE_MAX_PUBLICATIONS > RID_TABLE_THRESHOLD
+    const struct rid2pub * const r = rid2pub_lookup(rid);
+    if (r->rid == 0) {
+        return DECLITEM_IDX_INVALID;
+    }
+    zhe_assert(pubs[r->pubidx].rid == rid);
+    return r->pubidx;
+#else
+    for (declitem_idx_t idx = 0; idx < ZHE_MAX_PUBLICATIONS; idx++) {
+        if (pubs[idx].rid == rid) {
+            return idx;
+        }
+    }
+    return DECLITEM_IDX_INVALID;
+#endif
+}
+
+static void pub_link(declitem_idx_t idx, zhe_rid_t rid)
+{
+    const declitem_idx_t head = pub_first(rid);
+    if (head == DECLITEM_IDX_INVALID || idx < head) {
+        pubs_rnext[idx] = head;
+#if ZHE_MAX_PUBLICATIONS > RID_TABLE_THRESHOLD
+        struct rid2pub * const r = rid2pub_lookup(rid);
+        r->rid = rid;
+        r->pubidx = idx;
+#endif
+    } else {
+        declitem_idx_t t = head;
+        while (pubs_rnext[t] != DECLITEM_IDX_INVALID && pubs_rnext[t] < idx) {
+            t = pubs_rnext[t];
+        }
+        pubs_rnext[idx] = pubs_rnext[t];
+        pubs_rnext[t] = idx;
+    }
+}
+
+static void pub_unlink(declitem_idx_t idx, zhe_rid_t rid)
+{
+    const declitem_idx_t head = pub_first(rid);
+    if (head == idx) {
+#if ZHE_MAX_PUBLICATIONS > RID_TABLE_THRESHOLD
+        struct rid2pub * const r = rid2pub_lookup(rid);
+        if (pubs_rnext[idx] == DECLITEM_IDX_INVALID) {
+            rid2pub_delete(r);
+        } else {
+            r->pubidx = pubs_rnext[idx];
+        }
+#endif
+    } else {
+        declitem_idx_t t = head;
+        while (pubs_rnext[t] != idx) {
+            t = pubs_rnext[t];
+        }
+        pubs_rnext[t] = pubs_rnext[idx];
+    }
+}
 
 /* FIXME: should switch from publisher determines reliability to subscriber determines
  reliability, i.e., publisher reliability bit gets set to
@@ -50,22 +304,386 @@ static zhe_pubidx_t max_pubidx;
  separate from pubs has the advantage of saving quite a few bytes. */
 static DECL_BITSET(pubs_isrel, ZHE_MAX_PUBLICATIONS);
 static DECL_BITSET(pubs_rsubs, ZHE_MAX_PUBLICATIONS);
+/* Reliable publications for which only the latest sample matters: a new sample supersedes the
+ previous one if that one hasn't been acknowledged yet */
+static DECL_BITSET(pubs_keeplast, ZHE_MAX_PUBLICATIONS);
+
+#if MAX_PEERS > 0
+/* Marks all publications of rid as having remote subscribers or not */
+static void pubs_rsubs_set(zhe_rid_t rid, bool x)
+{
+    for (declitem_idx_t idx = pub_first(rid); idx != DECLITEM_IDX_INVALID; idx = pubs_rnext[idx]) {
+        if (x == !zhe_bitset_test(pubs_rsubs, idx)) {
+            ZT(PUBSUB, "pub %u rid %ju: %s remote subs", (unsigned)idx, (uintmax_t)rid, x ? "now have" : "no more");
+        }
+        if (x) {
+            zhe_bitset_set(pubs_rsubs, idx);
+        } else {
+            zhe_bitset_clear(pubs_rsubs, idx);
+        }
+    }
+}
+#endif
 
 struct precommit {
 #if MAX_PEERS == 0
     DECL_BITSET(rsubs, ZHE_MAX_PUBLICATIONS);
-#else
-    DECL_BITSET(rsubs, ZHE_MAX_RID+1);
 #endif
     uint8_t result;
     zhe_rid_t invalid_rid;
 };
 
 #if MAX_PEERS > 0
-struct peer_rsubs {
-    DECL_BITSET(rsubs, ZHE_MAX_RID+1);
+/* Remote subscriptions in peer mode: open-addressing hash table with linear probing, mapping a
+   RID to the peers subscribed to it ("peers"), the peers for which a subscription awaits a commit
+   ("precommit") and whether the DECLARE message being processed subscribes to it ("curpkt"), with
+   RID 0 marking an empty slot. There is an entry for at most ZHE_MAX_RSUBS RIDs at any one time,
+   twice that guarantees an empty slot to terminate probing; entries are removed once empty. The
+   sizes of "peers" and "precommit" are kept in "npeers" and "nprecommit", and for each peer the
+   number of entries in which it occurs in either in rsubs_npeer, so that neither publishing nor
+   resetting a peer requires counting bits or visiting entries of other peers. */
+#define RSUBHASH_SIZE (2 * ZHE_MAX_RSUBS)
+struct rsubtable {
+    zhe_rid_t rid;
+    uint8_t curpkt;
+    peeridx_t npeers;             /* counts of peers: peeridx_t is wide enough for MAX_PEERS_1 */
+    peeridx_t nprecommit;
+    DECL_BITSET(peers, MAX_PEERS_1);
+    DECL_BITSET(precommit, MAX_PEERS_1);
+#if ZHE_MAX_RSELECTIONS > 0
+    /* Peers subscribed to the RID itself rather than to a selection on it */
+    DECL_BITSET(plain, MAX_PEERS_1);
+#endif
 };
-static struct peer_rsubs peers_rsubs[MAX_PEERS];
+static struct rsubtable rsubs[RSUBHASH_SIZE];
+static unsigned rsubs_count;
+static bool rsubs_curpkt;
+/* Slots of entries with "curpkt" or "precommit" set, so that processing a DECLARE and committing
+   only visits the entries it affects rather than the entire table */
+static DECL_BITSET(rsubs_pending, RSUBHASH_SIZE);
+static uint16_t rsubs_npeer[MAX_PEERS_1];
+
+static unsigned rsubhash_pos(zhe_rid_t rid)
+{
+    /* Returns the slot for rid if present, else the empty slot where it should be inserted */
+    unsigned pos = rid_hash(rid) % RSUBHASH_SIZE;
+    while (rsubs[pos].rid != 0 && rsubs[pos].rid != rid) {
+        pos = (pos + 1) % RSUBHASH_SIZE;
+    }
+    return pos;
+}
+
+static bool rsub_isempty(const struct rsubtable *r)
+{
+    return !r->curpkt && r->npeers == 0 && r->nprecommit == 0;
+}
+
+static bool rsub_has_peer(const struct rsubtable *r, peeridx_t peeridx)
+{
+    return zhe_bitset_test(r->peers, peeridx) || zhe_bitset_test(r->precommit, peeridx);
+}
+
+/* Sets whether peeridx is in the "peers" and "precommit" sets of r, maintaining the counts; a peer
+   in neither no longer has a plain subscription either */
+static void rsub_set_peer(struct rsubtable *r, peeridx_t peeridx, bool peer, bool precommit)
+{
+    const bool had = rsub_has_peer(r, peeridx);
+    if (peer != zhe_bitset_test(r->peers, peeridx)) {
+        if (peer) {
+            zhe_bitset_set(r->peers, peeridx);
+            r->npeers++;
+        } else {
+            zhe_bitset_clear(r->peers, peeridx);
+            r->npeers--;
+        }
+    }
+    if (precommit != zhe_bitset_test(r->precommit, peeridx)) {
+        if (precommit) {
+            zhe_bitset_set(r->precommit, peeridx);
+            r->nprecommit++;
+        } else {
+            zhe_bitset_clear(r->precommit, peeridx);
+            r->nprecommit--;
+        }
+    }
+    if (had != (peer || precommit)) {
+        if (had) {
+            rsubs_npeer[peeridx]--;
+        } else {
+            rsubs_npeer[peeridx]++;
+        }
+    }
+#if ZHE_MAX_RSELECTIONS > 0
+    if (!peer && !precommit) {
+        zhe_bitset_clear(r->plain, peeridx);
+    }
+#endif
+}
+
+static void rsub_update_pending(unsigned pos)
+{
+    if (rsubs[pos].curpkt || rsubs[pos].nprecommit != 0) {
+        zhe_bitset_set(rsubs_pending, pos);
+    } else {
+        zhe_bitset_clear(rsubs_pending, pos);
+    }
+}
+
+static void rsubhash_delete(unsigned pos)
+{
+    /* Backward-shift deletion, as for the peer tables in zhe.c */
+    unsigned i = pos, j = pos;
+    while (1) {
+        j = (j + 1) % RSUBHASH_SIZE;
+        if (rsubs[j].rid == 0) {
+            break;
+        }
+        const unsigned k = rid_hash(rsubs[j].rid) % RSUBHASH_SIZE;
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        rsubs[i] = rsubs[j];
+        rsub_update_pending(i);
+        i = j;
+    }
+    memset(&rsubs[i], 0, sizeof(rsubs[i]));
+    zhe_bitset_clear(rsubs_pending, i);
+    rsubs_count--;
+}
+
+/* Applies f to the entries in rsubs_pending, removing those it leaves empty. A removal may move
+   an entry into the slot just visited, which is therefore revisited; with wrap-around an entry may
+   be moved to a slot not yet visited, and so f must be idempotent. */
+static void rsubhash_update(void (*f)(struct rsubtable *r, peeridx_t peeridx), peeridx_t peeridx)
+{
+    unsigned pos = 0;
+    while (pos < RSUBHASH_SIZE) {
+        const int next = zhe_bitset_findnext(rsubs_pending, RSUBHASH_SIZE, pos);
+        if (next < 0) {
+            break;
+        }
+        pos = (unsigned)next;
+        if (rsubs[pos].rid != 0) {
+            f(&rsubs[pos], peeridx);
+            if (rsub_isempty(&rsubs[pos])) {
+                rsubhash_delete(pos);
+                continue;
+            }
+            rsub_update_pending(pos);
+        }
+        pos++;
+    }
+}
+
+static bool rsub_has_peers(zhe_rid_t rid)
+{
+    const struct rsubtable * const r = &rsubs[rsubhash_pos(rid)];
+    return r->rid != 0 && r->npeers != 0;
+}
+
+static void rsub_curpkt_abort1(struct rsubtable *r, peeridx_t peeridx)
+{
+    if (r->curpkt) {
+        /* drops a plain subscription registered in the aborted packet */
+        rsub_set_peer(r, peeridx, zhe_bitset_test(r->peers, peeridx), zhe_bitset_test(r->precommit, peeridx));
+        r->curpkt = 0;
+    }
+}
+
+static void rsub_curpkt_done1(struct rsubtable *r, peeridx_t peeridx)
+{
+    if (r->curpkt) {
+        rsub_set_peer(r, peeridx, zhe_bitset_test(r->peers, peeridx), true);
+        r->curpkt = 0;
+    }
+}
+
+static void rsub_drop_precommit1(struct rsubtable *r, peeridx_t peeridx)
+{
+    rsub_set_peer(r, peeridx, zhe_bitset_test(r->peers, peeridx), false);
+}
+
+static void rsub_commit1(struct rsubtable *r, peeridx_t peeridx)
+{
+    if (zhe_bitset_test(r->precommit, peeridx)) {
+        rsub_set_peer(r, peeridx, true, false);
+        pubs_rsubs_set(r->rid, true);
+    }
+}
+
+static void rsub_clear1(struct rsubtable *r, peeridx_t peeridx)
+{
+    rsub_set_peer(r, peeridx, false, false);
+    if (r->npeers == 0) {
+        pubs_rsubs_set(r->rid, false);
+    }
+}
+
+#if ZHE_MAX_RSELECTIONS > 0
+/* Selections declared by peers: a peer subscribing to selection id "sid" is interested in the
+   samples of resource "rid" satisfying the predicate. The query of a selection is the URI of the
+   resource followed by the predicate in "?{...}", and the URI must be that of a resource declared
+   by the same peer. A predicate that can't be compiled here is treated as true: the subscriber
+   then filters the samples itself. */
+struct rselection {
+    zhe_rid_t sid;
+    zhe_rid_t rid;
+    peeridx_t peeridx;
+    uint8_t subscribed;           /* whether the peer subscribes to sid */
+    zhe_paysize_t codelen;
+    uint8_t code[ZHE_MAX_PREDICATE_CODE];
+};
+static struct rselection rsels[ZHE_MAX_RSELECTIONS];
+static unsigned n_rsels;
+
+static struct rselection *rsel_find(peeridx_t peeridx, zhe_rid_t sid)
+{
+    for (unsigned i = 0; i < n_rsels; i++) {
+        if (rsels[i].sid == sid && rsels[i].peeridx == peeridx) {
+            return &rsels[i];
+        }
+    }
+    return NULL;
+}
+
+#endif
+
+#if ZHE_MAX_URISPACE > 0
+/* A selection is only an optimisation, so one that doesn't fit in rsels (or that can't be stored
+   at all for lack of such a table) is ignored: the subscription to its selection id, which follows
+   in the same DECLARE, is then a plain subscription to the resource, and the subscriber filters
+   the samples itself. The withdrawal of that subscription can't be mapped to the resource anymore,
+   so it lasts until the session with the peer ends. */
+static struct {
+    zhe_rid_t sid;                /* 0 if none */
+    zhe_rid_t rid;
+} rsel_curpkt_unstored;
+
+bool zhe_rsel_register(peeridx_t peeridx, zhe_rid_t sid, const uint8_t *query, zhe_paysize_t querylen)
+{
+    zhe_paysize_t urilen = querylen, predpos = querylen;
+    zhe_rid_t rid;
+    /* Our own queries are limited to ZHE_MAX_URILENGTH, and so are a peer's */
+    if (querylen > ZHE_MAX_URILENGTH) {
+        ZT(PUBSUB, "rsel_register: peeridx %u sid %ju: query too long", peeridx, (uintmax_t)sid);
+        return false;
+    }
+    if (querylen >= 3 && query[querylen - 1] == '}') {
+        for (zhe_paysize_t i = querylen - 2; i-- > 0;) {
+            if (query[i] == '?' && query[i + 1] == '{') {
+                urilen = i;
+                predpos = i + 2;
+                break;
+            }
+        }
+    }
+    if (!zhe_uristore_lookup_uri(peeridx, query, urilen, &rid)) {
+        ZT(PUBSUB, "rsel_register: peeridx %u sid %ju: unknown resource", peeridx, (uintmax_t)sid);
+        return false;
+    }
+#if ZHE_MAX_RSELECTIONS > 0
+    struct rselection *sel = rsel_find(peeridx, sid);
+    if (sel == NULL && n_rsels < ZHE_MAX_RSELECTIONS) {
+        sel = &rsels[n_rsels++];
+        sel->subscribed = 0;
+    }
+    if (sel != NULL) {
+        sel->sid = sid;
+        sel->rid = rid;
+        sel->peeridx = peeridx;
+        sel->codelen = (predpos == querylen) ? 0 : zhe_predicate_compile(query + predpos, (size_t)(querylen - 1 - predpos), sel->code);
+        if (predpos != querylen && sel->codelen == 0) {
+            /* Compiled code is never empty, so this is a predicate we can't evaluate: matching
+               everything is safe, because the subscriber filters the samples itself */
+            ZT(PUBSUB, "rsel_register: peeridx %u sid %ju rid %ju: invalid predicate, taking it as plain", peeridx, (uintmax_t)sid, (uintmax_t)rid);
+        } else {
+            ZT(PUBSUB, "rsel_register: peeridx %u sid %ju rid %ju codelen %u", peeridx, (uintmax_t)sid, (uintmax_t)rid, (unsigned)sel->codelen);
+        }
+        return true;
+    }
+#else
+    (void)predpos;
+#endif
+    ZT(PUBSUB, "rsel_register: peeridx %u sid %ju rid %ju: no space, taking it as plain", peeridx, (uintmax_t)sid, (uintmax_t)rid);
+    rsel_curpkt_unstored.sid = sid;
+    rsel_curpkt_unstored.rid = rid;
+    return true;
+}
+#endif
+
+#if ZHE_MAX_RSELECTIONS > 0
+static void rsel_clear(peeridx_t peeridx)
+{
+    unsigned i = 0;
+    while (i < n_rsels) {
+        if (rsels[i].peeridx == peeridx) {
+            rsels[i] = rsels[--n_rsels];
+        } else {
+            i++;
+        }
+    }
+}
+
+/* Whether any peer subscribed to rid wants a sample with the given contents */
+static bool rsel_wanted(zhe_rid_t rid, const void *data, zhe_paysize_t sz)
+{
+    const struct rsubtable * const r = &rsubs[rsubhash_pos(rid)];
+    for (size_t i = 0; i < sizeof(r->peers); i++) {
+        if (r->peers[i] & r->plain[i]) {
+            return true;
+        }
+    }
+    for (unsigned i = 0; i < n_rsels; i++) {
+        const struct rselection * const sel = &rsels[i];
+        if (sel->rid == rid && sel->subscribed && zhe_bitset_test(r->peers, sel->peeridx) && zhe_predicate_eval(sel->code, sel->codelen, data, sz)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Whether peeridx subscribes to a selection on rid */
+static bool rsel_subscribed(peeridx_t peeridx, zhe_rid_t rid)
+{
+    for (unsigned i = 0; i < n_rsels; i++) {
+        if (rsels[i].rid == rid && rsels[i].peeridx == peeridx && rsels[i].subscribed) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+/* Removes a subscription of peeridx to rid, "plain" if to rid itself rather than to a selection;
+   the peer remains subscribed to rid for as long as it has another subscription to it */
+static void rsub_forget(peeridx_t peeridx, zhe_rid_t rid, bool plain)
+{
+    const unsigned pos = (rid == 0) ? 0 : rsubhash_pos(rid);
+    struct rsubtable * const r = &rsubs[pos];
+    if (rid == 0 || r->rid != rid) {
+        return;
+    }
+#if ZHE_MAX_RSELECTIONS > 0
+    if (plain) {
+        zhe_bitset_clear(r->plain, peeridx);
+    }
+    if (zhe_bitset_test(r->plain, peeridx) || rsel_subscribed(peeridx, rid)) {
+        return;
+    }
+#else
+    (void)plain;
+#endif
+    ZT(PUBSUB, "rsub_forget: peeridx %u rid %ju", peeridx, (uintmax_t)rid);
+    rsub_set_peer(r, peeridx, false, false);
+    if (r->npeers == 0) {
+        pubs_rsubs_set(rid, false);
+    }
+    if (rsub_isempty(r)) {
+        rsubhash_delete(pos);
+    } else {
+        rsub_update_pending(pos);
+    }
+}
 #endif
 
 static struct precommit precommit[MAX_PEERS_1];
@@ -83,38 +701,72 @@ void zhe_decl_note_error_curpkt(uint8_t bitmask, zhe_rid_t rid)
 void zhe_rsub_register(peeridx_t peeridx, zhe_rid_t rid, uint8_t submode)
 {
 #if MAX_PEERS == 0
-    zhe_pubidx_t pubidx;
     zhe_assert(rid != 0);
-    for (pubidx.idx = 0; pubidx.idx < ZHE_MAX_PUBLICATIONS; pubidx.idx++) {
-        if (pubs[pubidx.idx].rid == rid) {
-            break;
+    const declitem_idx_t first = pub_first(rid);
+    if (submode == SUBMODE_PUSH && first != DECLITEM_IDX_INVALID) {
+        for (declitem_idx_t idx = first; idx != DECLITEM_IDX_INVALID; idx = pubs_rnext[idx]) {
+            zhe_bitset_set(precommit_curpkt.rsubs, idx);
         }
-    }
-    if (submode == SUBMODE_PUSH && pubidx.idx < ZHE_MAX_PUBLICATIONS) {
-        zhe_bitset_set(precommit_curpkt.rsubs, pubidx.idx);
     } else {
-        zhe_decl_note_error_curpkt(((submode != SUBMODE_PUSH) ? 1 : 0) | ((pubidx.idx >= ZHE_MAX_PUBLICATIONS) ? 2 : 0), rid);
+        zhe_decl_note_error_curpkt(((submode != SUBMODE_PUSH) ? DECLERR_SUBMODE : 0) | ((first == DECLITEM_IDX_INVALID) ? DECLERR_RSUB : 0), rid);
     }
 #else
-    if (submode == SUBMODE_PUSH && rid <= ZHE_MAX_RID) {
-        zhe_bitset_set(precommit_curpkt.rsubs, rid);
+#if ZHE_MAX_RSELECTIONS > 0
+    /* A subscription to a selection id is a subscription to the resource of the selection */
+    struct rselection * const sel = rsel_find(peeridx, rid);
+    if (sel != NULL) {
+        sel->subscribed = 1;
+        rid = sel->rid;
+    }
+#endif
+#if ZHE_MAX_URISPACE > 0
+    if (rid != 0 && rid == rsel_curpkt_unstored.sid) {
+        rid = rsel_curpkt_unstored.rid;
+    }
+#endif
+    /* RID 0 can't be stored in the table, but it isn't a valid RID anyway */
+    const unsigned pos = (rid == 0) ? 0 : rsubhash_pos(rid);
+    const bool space = (rid != 0) && (rsubs[pos].rid == rid || rsubs_count < ZHE_MAX_RSUBS);
+    if (submode == SUBMODE_PUSH && space) {
+        if (rsubs[pos].rid == 0) {
+            rsubs[pos].rid = rid;
+            rsubs_count++;
+        }
+        rsubs[pos].curpkt = 1;
+        rsubs_curpkt = true;
+        zhe_bitset_set(rsubs_pending, pos);
+#if ZHE_MAX_RSELECTIONS > 0
+        if (sel == NULL) {
+            zhe_bitset_set(rsubs[pos].plain, peeridx);
+        }
+#endif
     } else {
-        zhe_decl_note_error_curpkt(((submode != SUBMODE_PUSH) ? 1 : 0) | ((rid > ZHE_MAX_RID) ? 2 : 0), rid);
+        zhe_decl_note_error_curpkt(((submode != SUBMODE_PUSH) ? DECLERR_SUBMODE : 0) | (!space ? DECLERR_RSUB : 0), rid);
     }
 #endif
 }
 
-uint8_t zhe_rsub_precommit(peeridx_t peeridx, zhe_rid_t *err_rid)
+/* Returns 0 if the pending declarations of peeridx can be committed, which they can if none of
+   the errors noted for them is in failmask: the declarations those errors concern weren't stored,
+   and the others can still be committed. Otherwise, returns the errors and drops them all. */
+uint8_t zhe_rsub_precommit(peeridx_t peeridx, uint8_t failmask, zhe_rid_t *err_rid)
 {
     zhe_assert (precommit_curpkt.result == 0);
     if (precommit[peeridx].result == 0) {
         ZT(PUBSUB, "rsub_precommit peeridx %u ok", peeridx);
         return 0;
+    } else if ((precommit[peeridx].result & failmask) == 0) {
+        ZT(PUBSUB, "rsub_precommit peeridx %u ok, ignoring result %u rid %ju", peeridx, precommit[peeridx].result, (uintmax_t)precommit[peeridx].invalid_rid);
+        precommit[peeridx].result = 0;
+        return 0;
     } else {
         uint8_t result = precommit[peeridx].result;
         ZT(PUBSUB, "rsub_precommit peeridx %u result %u", peeridx, result);
         *err_rid = precommit[peeridx].invalid_rid;
         memset(&precommit[peeridx], 0, sizeof(precommit[peeridx]));
+#if MAX_PEERS > 0
+        rsubhash_update(rsub_drop_precommit1, peeridx);
+#endif
         return result;
     }
 }
@@ -128,163 +780,376 @@ void zhe_rsub_commit(peeridx_t peeridx)
         pubs_rsubs[i] |= precommit[peeridx].rsubs[i];
     }
 #else
-    for (size_t i = 0; i < sizeof(peers_rsubs[peeridx].rsubs); i++) {
-        peers_rsubs[peeridx].rsubs[i] |= precommit[peeridx].rsubs[i];
-        for (size_t j = 0; j < CHAR_BIT * sizeof(precommit[peeridx].rsubs[i]); j++) {
-            if (i+j <= ZHE_MAX_RID && zhe_bitset_test(precommit[peeridx].rsubs, (unsigned)(i+j))) {
-                zhe_rid_t rid = (zhe_rid_t)(i+j);
-                zhe_pubidx_t pubidx;
-                for (pubidx.idx = 0; pubidx.idx < ZHE_MAX_PUBLICATIONS; pubidx.idx++) {
-                    if (pubs[pubidx.idx].rid == rid) {
-#if ENABLE_TRACING
-                        if (!zhe_bitset_test(pubs_rsubs, pubidx.idx)) {
-                            ZT(PUBSUB, "pub %u rid %ju: now have remote subs", (unsigned)pubidx.idx, (uintmax_t)rid);
-                        }
-#endif
-                        zhe_bitset_set(pubs_rsubs, pubidx.idx);
-                        break;
-                    }
-                }
+    rsubhash_update(rsub_commit1, peeridx);
+#endif
+    memset(&precommit[peeridx], 0, sizeof(precommit[peeridx]));
+}
+
+void zhe_rsub_precommit_curpkt_abort(peeridx_t peeridx)
+{
+#if MAX_PEERS > 0
+    if (rsubs_curpkt) {
+        rsubhash_update(rsub_curpkt_abort1, peeridx);
+        rsubs_curpkt = false;
+    }
+#if ZHE_MAX_URISPACE > 0
+    rsel_curpkt_unstored.sid = 0;
+#endif
+#endif
+    memset(&precommit_curpkt, 0, sizeof(precommit_curpkt));
+}
+
+void zhe_rsub_precommit_curpkt_done(peeridx_t peeridx)
+{
+#if MAX_PEERS == 0
+    for (size_t i = 0; i < sizeof(precommit[peeridx].rsubs); i++) {
+        precommit[peeridx].rsubs[i] |= precommit_curpkt.rsubs[i];
+    }
+#else
+    if (rsubs_curpkt) {
+        rsubhash_update(rsub_curpkt_done1, peeridx);
+        rsubs_curpkt = false;
+    }
+#endif
+    if (precommit[peeridx].invalid_rid == 0) {
+        precommit[peeridx].invalid_rid = precommit_curpkt.invalid_rid;
+    }
+    precommit[peeridx].result |= precommit_curpkt.result;
+    zhe_rsub_precommit_curpkt_abort(peeridx);
+}
+
+void zhe_rsub_unregister(peeridx_t peeridx, zhe_rid_t rid)
+{
+    /* In client mode, the broker only ever adds subscriptions */
+#if MAX_PEERS > 0
+#if ZHE_MAX_RSELECTIONS > 0
+    struct rselection * const sel = rsel_find(peeridx, rid);
+    if (sel != NULL) {
+        sel->subscribed = 0;
+        rsub_forget(peeridx, sel->rid, false);
+        return;
+    }
+#endif
+    rsub_forget(peeridx, rid, true);
+#endif
+}
+
+#if MAX_PEERS > 0 && ZHE_MAX_RSELECTIONS > 0
+void zhe_rsel_unregister(peeridx_t peeridx, zhe_rid_t sid)
+{
+    struct rselection * const sel = rsel_find(peeridx, sid);
+    if (sel != NULL) {
+        const zhe_rid_t rid = sel->rid;
+        ZT(PUBSUB, "rsel_unregister: peeridx %u sid %ju", peeridx, (uintmax_t)sid);
+        *sel = rsels[--n_rsels];
+        rsub_forget(peeridx, rid, false);
+    }
+}
+#endif
+
+void zhe_rsub_clear(peeridx_t peeridx)
+{
+    zhe_rsub_precommit_curpkt_abort(peeridx);
+#if MAX_PEERS == 0
+    memset(&pubs_rsubs, 0, sizeof(pubs_rsubs));
+#else
+    /* Only the entries the peer occurs in need changing, and the scan stops once it has seen all
+       of them; removing an entry only moves entries not yet visited (or, with wrap-around, ones
+       already cleared) into the slot, which is therefore revisited */
+    unsigned pos = 0;
+    while (rsubs_npeer[peeridx] > 0) {
+        zhe_assert(pos < RSUBHASH_SIZE);
+        struct rsubtable * const r = &rsubs[pos];
+        if (r->rid != 0 && rsub_has_peer(r, peeridx)) {
+            rsub_clear1(r, peeridx);
+            if (rsub_isempty(r)) {
+                rsubhash_delete(pos);
+                continue;
             }
+            rsub_update_pending(pos);
+        }
+        pos++;
+    }
+#if ZHE_MAX_RSELECTIONS > 0
+    rsel_clear(peeridx);
+#endif
+#endif
+    memset(&precommit[peeridx], 0, sizeof(precommit[peeridx]));
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+/* Returns the head of the list of subscriptions to rid, NULL if there are none */
+static struct subtable *find_subhead(zhe_rid_t rid)
+{
+#if ZHE_MAX_SUBSCRIPTIONS > RID_TABLE_THRESHOLD
+    const struct rid2sub * const r = rid2sub_lookup(rid);
+    if (r->rid == 0) {
+        return NULL;
+    }
+    zhe_assert(r->subidx.idx < ZHE_MAX_SUBSCRIPTIONS);
+    zhe_assert(subs[r->subidx.idx].rid == rid);
+    return &subs[r->subidx.idx];
+#else
+    zhe_subidx_t k;
+    for (k.idx = 0; k.idx < ZHE_MAX_SUBSCRIPTIONS; k.idx++) {
+        if (subs[k.idx].rid == rid) {
+            return &subs[k.idx];
+        }
+    }
+    return NULL;
+#endif
+}
+
+#if ZHE_MAX_DELIVERY_QUEUES > 0
+/* Delivery queues decouple subscription handlers from the processing of input: samples for a
+   subscription with a queue are copied into a ring buffer provided by the application, and the
+   handler is invoked for them by zhe_dispatch. A sample is stored contiguously, preceded by its
+   size; one that doesn't fit in the space remaining at the end of the buffer is stored at the
+   start instead, leaving a DELIVQ_WRAP marker at the end if there is room for it. */
+#define DELIVQ_WRAP ((zhe_paysize_t)-1)
+#define DELIVQ_HDRSIZE sizeof(zhe_paysize_t)
+#define DELIVQ_NOSPACE SIZE_MAX
+
+struct delivq {
+    uint8_t *buf;                 /* NULL for a free queue */
+    size_t size;
+    size_t rd, wr;                /* positions of oldest sample and of first free byte, 0 if empty */
+    unsigned n;                   /* number of samples in the queue */
+    zhe_subidx_t subidx;
+    uint8_t policy;
+};
+static struct delivq delivqs[ZHE_MAX_DELIVERY_QUEUES];
+static uint8_t n_delivqs;
+static uint8_t delivq_next;       /* queue at which zhe_dispatch continues, for fairness */
+static struct delivq *delivq_dispatching; /* queue whose oldest sample is being handled, NULL if freed meanwhile */
+unsigned zhe_queue_dropped;
+
+/* Returns the position at which a sample of paysz bytes can be stored, DELIVQ_NOSPACE if none */
+static size_t delivq_findspace(const struct delivq *q, zhe_paysize_t paysz)
+{
+    const size_t need = DELIVQ_HDRSIZE + paysz;
+    if (paysz == DELIVQ_WRAP) {
+        return DELIVQ_NOSPACE;
+    } else if (q->n == 0) {
+        return (need <= q->size) ? 0 : DELIVQ_NOSPACE;
+    } else if (q->rd < q->wr) {
+        if (need <= q->size - q->wr) {
+            return q->wr;
+        } else {
+            return (need <= q->rd) ? 0 : DELIVQ_NOSPACE;
+        }
+    } else {
+        return (need <= q->rd - q->wr) ? q->wr : DELIVQ_NOSPACE;
+    }
+}
+
+static void delivq_put(struct delivq *q, size_t pos, zhe_paysize_t paysz, const void *pay)
+{
+    if (pos != q->wr && q->size - q->wr >= DELIVQ_HDRSIZE) {
+        const zhe_paysize_t wrap = DELIVQ_WRAP;
+        memcpy(q->buf + q->wr, &wrap, DELIVQ_HDRSIZE);
+    }
+    memcpy(q->buf + pos, &paysz, DELIVQ_HDRSIZE);
+    memcpy(q->buf + pos + DELIVQ_HDRSIZE, pay, paysz);
+    q->wr = pos + DELIVQ_HDRSIZE + paysz;
+    q->n++;
+}
+
+/* Returns the oldest sample in the (non-empty) queue, setting *paysz to its size */
+static const uint8_t *delivq_peek(struct delivq *q, zhe_paysize_t *paysz)
+{
+    zhe_assert(q->n > 0);
+    if (q->size - q->rd >= DELIVQ_HDRSIZE) {
+        memcpy(paysz, q->buf + q->rd, DELIVQ_HDRSIZE);
+        if (*paysz != DELIVQ_WRAP) {
+            return q->buf + q->rd + DELIVQ_HDRSIZE;
         }
     }
-#endif
-    memset(&precommit[peeridx], 0, sizeof(precommit[peeridx]));
+    q->rd = 0;
+    memcpy(paysz, q->buf, DELIVQ_HDRSIZE);
+    return q->buf + DELIVQ_HDRSIZE;
 }
 
-void zhe_rsub_precommit_curpkt_abort(peeridx_t peeridx)
+static void delivq_pop(struct delivq *q, zhe_paysize_t paysz)
 {
-    memset(&precommit_curpkt, 0, sizeof(precommit_curpkt));
+    q->rd += DELIVQ_HDRSIZE + paysz;
+    if (--q->n == 0) {
+        q->rd = q->wr = 0;
+    }
 }
 
-void zhe_rsub_precommit_curpkt_done(peeridx_t peeridx)
+/* Whether a sample of paysz bytes fits in the queue at all, i.e., when it is empty */
+static bool delivq_fits(const struct delivq *q, zhe_paysize_t paysz)
 {
-    for (size_t i = 0; i < sizeof(precommit[peeridx].rsubs); i++) {
-        precommit[peeridx].rsubs[i] |= precommit_curpkt.rsubs[i];
+    return paysz != DELIVQ_WRAP && DELIVQ_HDRSIZE + (size_t)paysz <= q->size;
+}
+
+static void delivq_enqueue(struct delivq *q, zhe_paysize_t paysz, const void *pay)
+{
+    size_t pos;
+    if (!delivq_fits(q, paysz)) {
+        /* evicting queued samples wouldn't make room for it, whatever the policy */
+        zhe_queue_dropped++;
+        return;
     }
-    if (precommit[peeridx].invalid_rid == 0) {
-        precommit[peeridx].invalid_rid = precommit_curpkt.invalid_rid;
+    while ((pos = delivq_findspace(q, paysz)) == DELIVQ_NOSPACE && q->policy == ZHE_QUEUE_DROP_OLDEST && q->n > 0) {
+        zhe_paysize_t sz;
+        (void)delivq_peek(q, &sz);
+        delivq_pop(q, sz);
+        zhe_queue_dropped++;
+    }
+    if (pos == DELIVQ_NOSPACE) {
+        /* ZHE_QUEUE_BLOCK has been checked already, so this is dropping the newest sample */
+        zhe_queue_dropped++;
+    } else {
+        delivq_put(q, pos, paysz, pay);
     }
-    precommit[peeridx].result |= precommit_curpkt.result;
-    zhe_rsub_precommit_curpkt_abort(peeridx);
 }
+#endif
 
-void zhe_rsub_clear(peeridx_t peeridx)
-{
-#if MAX_PEERS == 0
-    memset(&pubs_rsubs, 0, sizeof(pubs_rsubs));
+#if ZHE_MAX_SELECTIONS > 0
+/* Selections: subscriptions that only want the samples satisfying a predicate (see zhe-predicate.h).
+   Each has its own selection id, reserved just below the ids reserved for URI bindings, for
+   declaring it to peers; the query is kept in the URI store, encoded as in the declaration. */
+#if ZHE_MAX_URIBINDINGS > 0
+#define SELECTION_SID(selidx_) (ZHE_MAX_RID - ZHE_URIBIND_RIDS - (zhe_rid_t)(selidx_))
 #else
-    memset(&peers_rsubs[peeridx], 0, sizeof(peers_rsubs[peeridx]));
-    zhe_pubidx_t pubidx;
-    for (pubidx.idx = 0; pubidx.idx < ZHE_MAX_PUBLICATIONS; pubidx.idx++) {
-        const zhe_rid_t rid = pubs[pubidx.idx].rid;
-        zhe_assert(rid <= ZHE_MAX_RID);
-        if (rid != 0 && zhe_bitset_test(pubs_rsubs, pubidx.idx)) {
-            peeridx_t i;
-            for (i = 0; i < MAX_PEERS_1; i++) {
-                if (zhe_bitset_test(peers_rsubs[i].rsubs, rid)) {
-                    break;
+#define SELECTION_SID(selidx_) (ZHE_MAX_RID - (zhe_rid_t)(selidx_))
+#endif
+
+struct selection {
+    zhe_paysize_t codelen;        /* 0 for a free entry */
+    uint8_t code[ZHE_MAX_PREDICATE_CODE];
+};
+static struct selection sels[ZHE_MAX_SELECTIONS];
+#endif
+
+/* Whether subscription s wants a sample with the given contents */
+static bool subs_selects(const struct subtable *s, zhe_paysize_t paysz, const void *pay)
+{
+#if ZHE_MAX_SELECTIONS > 0
+    if (s->sel != 0) {
+        const struct selection * const sel = &sels[s->sel - 1];
+        return zhe_predicate_eval(sel->code, sel->codelen, pay, paysz);
+    }
+#endif
+    return true;
+}
+
+/* Whether the queue of a subscription to the RID of head s with policy ZHE_QUEUE_BLOCK lacks the
+   space for a sample of paysz bytes */
+static bool subs_blocked(const struct subtable *s, zhe_paysize_t paysz)
+{
+#if ZHE_MAX_DELIVERY_QUEUES > 0
+    if (s->ridblock) {
+        const struct subtable *t = s;
+        while (1) {
+            if (t->delivq != 0) {
+                const struct delivq * const q = &delivqs[t->delivq - 1];
+                /* a sample that can never fit is dropped rather than refused forever */
+                if (q->policy == ZHE_QUEUE_BLOCK && delivq_fits(q, paysz) && delivq_findspace(q, paysz) == DELIVQ_NOSPACE) {
+                    return true;
                 }
             }
-            if (i == MAX_PEERS_1) {
-                ZT(PUBSUB, "pub %u rid %ju: no more remote subs", (unsigned)pubidx.idx, (uintmax_t)rid);
-                zhe_bitset_clear(pubs_rsubs, pubidx.idx);
+            if (t->next.idx == SUBIDX_NONE) {
+                break;
             }
+            t = &subs[t->next.idx];
         }
     }
 #endif
-    memset(&precommit[peeridx], 0, sizeof(precommit[peeridx]));
-    zhe_rsub_precommit_curpkt_abort(peeridx);
+    return false;
 }
 
-/////////////////////////////////////////////////////////////////////////////
-
-int zhe_handle_msdata_deliver(zhe_rid_t prid, zhe_paysize_t paysz, const void *pay)
+/* Delivers a sample to all subscriptions to the RID of head s, passing rid to the handlers */
+static void subs_deliver(const struct subtable *s, zhe_rid_t rid, zhe_paysize_t paysz, const void *pay)
 {
-#if ZHE_MAX_SUBSCRIPTIONS > RID_TABLE_THRESHOLD
-    if (prid > ZHE_MAX_RID || (rid2sub[prid].idx == 0 && subs[0].rid != prid)) {
-        /* not subscribed */
-        return 1;
-    }
-    zhe_assert(rid2sub[prid].idx < ZHE_MAX_SUBSCRIPTIONS);
-    zhe_assert(subs[rid2sub[prid].idx].rid == prid);
-    const struct subtable * const s = &subs[rid2sub[prid].idx];
+    const struct subtable *t = s;
+    while (1) {
+        if (!subs_selects(t, paysz, pay)) {
+            /* not of interest to this subscription */
+        }
+#if ZHE_MAX_DELIVERY_QUEUES > 0
+        else if (t->delivq != 0) {
+            delivq_enqueue(&delivqs[t->delivq - 1], paysz, pay);
+        } else {
+            t->handler(rid, pay, paysz, t->arg);
+        }
 #else
-    zhe_subidx_t k;
-    for (k.idx = 0; k.idx < ZHE_MAX_SUBSCRIPTIONS; k.idx++) {
-        if (subs[k.idx].rid == prid) {
-            break;
+        else {
+            t->handler(rid, pay, paysz, t->arg);
+        }
+#endif
+        if (t->next.idx == SUBIDX_NONE) {
+            return;
         }
+        t = &subs[t->next.idx];
     }
-    if (k.idx == ZHE_MAX_SUBSCRIPTIONS) {
-        return 1;
+}
+
+int zhe_handle_msdata_deliver(peeridx_t peeridx, zhe_rid_t prid, zhe_paysize_t paysz, const void *pay)
+{
+#if ZHE_MAX_URISPACE > 0 && ZHE_MAX_RBINDINGS > 0
+    /* Data published on an id the peer bound to a URI (see zhe_write_uri) is a WriteData in disguise */
+    zhe_paysize_t urisz;
+    const uint8_t *uri;
+    if (zhe_uristore_getbound(peeridx, prid, &urisz, &uri)) {
+        return zhe_handle_mwdata_deliver(urisz, uri, paysz, pay);
     }
-    const struct subtable * const s = &subs[k.idx];
 #endif
+    const struct subtable * const s = find_subhead(prid);
+    if (s == NULL) {
+        /* not subscribed */
+        return 1;
+    }
 
-    if (s->next.idx == 0) {
-        if (s->xmitneed == 0 || zhe_xmitw_hasspace(s->oc, s->xmitneed)) {
-            /* Do note that "xmitneed" had better include overhead! */
-            s->handler(prid, pay, paysz, s->arg);
-            return 1;
-        } else {
+    /* Deliver to all subscriptions or to none: do note that "xmitneed" had better include overhead!
+       FIXME: this doesn't work for unicast conduits */
+    for (cid_t cid = 0; cid < N_OUT_CONDUITS; cid++) {
+        if (s->ridneed[cid] > 0 && !zhe_xmitw_hasspace(zhe_out_conduit_from_cid(0, cid), s->ridneed[cid])) {
             return 0;
         }
-    } else {
-        /* FIXME: this doesn't work for unicast conduits */
-        zhe_paysize_t xmitneed[N_OUT_CONDUITS];
-        memset(xmitneed, 0, sizeof(xmitneed));
-        for (const struct subtable *t = s; t != &subs[0]; t = &subs[t->next.idx]) {
-            if (t->xmitneed > 0) {
-                xmitneed[zhe_oc_get_cid(t->oc)] += t->xmitneed;
-            }
-        }
-        for (cid_t cid = 0; cid < N_OUT_CONDUITS; cid++) {
-            if (xmitneed[cid] > 0 && !zhe_xmitw_hasspace(zhe_out_conduit_from_cid(0, cid), xmitneed[cid])) {
-                return 0;
-            }
-        }
-
-        s->handler(prid, pay, paysz, s->arg);
-        return 1;
     }
+    if (subs_blocked(s, paysz)) {
+        return 0;
+    }
+    subs_deliver(s, prid, paysz, pay);
+    return 1;
 }
 
 #if ZHE_MAX_URISPACE > 0
-static bool zhe_urimatch(zhe_paysize_t asz, const uint8_t *a, zhe_paysize_t bsz, const uint8_t *b)
+/* A WriteData should be delivered to all matching subscriptions or to none (and then retried later) -- delivering to some but not all seems like a really bad idea! -- but that means we first need to check the the available space in transmit windows. The URI store gives the resources whose URI matches that of the WriteData, patterns included (see zhe_uristore_foreach_uri), and the subscriptions to those are found via their RIDs. */
+struct mwdata_matches {
+    zhe_subidx_t n;
+    const struct subtable *heads[ZHE_MAX_SUBSCRIPTIONS];
+};
+
+static void mwdata_match(zhe_rid_t rid, void *varg)
 {
-    /* FIXME: figure out URI matching ... */
-    return (asz == bsz && memcmp(a, b, asz) == 0);
+    struct mwdata_matches * const m = varg;
+    const struct subtable * const s = find_subhead(rid);
+    if (s != NULL) {
+        /* a RID has a single resource, and the heads of the lists have different RIDs */
+        zhe_assert(m->n.idx < ZHE_MAX_SUBSCRIPTIONS);
+        m->heads[m->n.idx++] = s;
+    }
 }
 
-/* A WriteData should be delivered to all matching subscriptions or to none (and then retried later) -- delivering to some but not all seems like a really bad idea! -- but that means we first need to check the the available space in transmit windows.  Obviously doing the URI matching more often than strictly necessary is not a good idea -- indeed it is bad enough with caching ... perhaps so bad that it would be best to handle this as part of housekeeping, bit by bit ...  FIXME: for now, let's just cache. */
-static zhe_subidx_t zhe_handle_mwdata_matches[ZHE_MAX_SUBSCRIPTIONS];
-
 int zhe_handle_mwdata_deliver(zhe_paysize_t urisz, const uint8_t *uri, zhe_paysize_t paysz, const void *pay)
 {
-    zhe_subidx_t nm = { 0 };
-    for (zhe_subidx_t k = { 0 }; k.idx < ZHE_MAX_SUBSCRIPTIONS; k.idx++) {
-        const struct subtable * const s = &subs[k.idx];
-        zhe_residx_t uidx;
-        zhe_rid_t rid;
-        zhe_paysize_t suburisz;
-        const uint8_t *suburi;
-        /* FIXME: should keep resource index in subs table, this is embarrasingly expensive ... (and perhaps should also scan resources rather than subscriptions -- or do both in parallel, or cache the results or ...) */
-        for (uidx = 0; uidx < ZHE_MAX_RESOURCES; uidx++) {
-            if (zhe_uristore_geturi(uidx, &rid, &suburisz, &suburi) && rid == s->rid) {
-                if (zhe_urimatch(urisz, uri, suburisz, suburi)) {
-                    zhe_handle_mwdata_matches[nm.idx++] = k;
-                }
-            }
-        }
-    }
-    /* FIXME: this doesn't work for unicast conduits; perhaps should speed things up in the trivial cases */
+    static struct mwdata_matches m;
+    m.n.idx = 0;
+    zhe_uristore_foreach_uri(uri, urisz, mwdata_match, &m);
+    /* FIXME: this doesn't work for unicast conduits */
     zhe_paysize_t xmitneed[N_OUT_CONDUITS];
     memset(xmitneed, 0, sizeof(xmitneed));
-    for (zhe_subidx_t k = { 0 }; k.idx < nm.idx; k.idx++) {
-        const struct subtable *s = &subs[k.idx];
-        if (s->xmitneed > 0) {
-            xmitneed[zhe_oc_get_cid(s->oc)] += s->xmitneed;
+    for (zhe_subidx_t k = { 0 }; k.idx < m.n.idx; k.idx++) {
+        if (subs_blocked(m.heads[k.idx], paysz)) {
+            return 0;
+        }
+        for (cid_t cid = 0; cid < N_OUT_CONDUITS; cid++) {
+            xmitneed[cid] += m.heads[k.idx]->ridneed[cid];
         }
     }
     for (cid_t cid = 0; cid < N_OUT_CONDUITS; cid++) {
@@ -292,10 +1157,9 @@ int zhe_handle_mwdata_deliver(zhe_paysize_t urisz, const uint8_t *uri, zhe_paysi
             return 0;
         }
     }
-    for (zhe_subidx_t k = { 0 }; k.idx < nm.idx; k.idx++) {
-        const struct subtable *s = &subs[k.idx];
+    for (zhe_subidx_t k = { 0 }; k.idx < m.n.idx; k.idx++) {
         /* FIXME: which resource id should we pass to the handler? 0 is not a valid one, so that's kinda reasonable */
-        s->handler(0, pay, paysz, s->arg);
+        subs_deliver(m.heads[k.idx], 0, paysz, pay);
     }
     return 1;
 }
@@ -304,25 +1168,20 @@ int zhe_handle_mwdata_deliver(zhe_paysize_t urisz, const uint8_t *uri, zhe_paysi
 /////////////////////////////////////////////////////////////////////////////////////
 
 static uint8_t gcommitid;
-
-#define MAX3(a,b,c) ((a) > (b) ? ((a) > (c) ? (a) : (c)) : ((b) > (c)) ? (b) : (c))
-#define MAX_DECLITEM MAX3(ZHE_MAX_RESOURCES, ZHE_MAX_PUBLICATIONS, ZHE_MAX_SUBSCRIPTIONS)
-#if MAX_DECLITEM <= UINT8_MAX-1
-typedef uint8_t declitem_idx_t;
-#define DECLITEM_IDX_INVALID UINT8_MAX
-#elif MAX_DECLITEM <= UINT16_MAX-1
-typedef uint16_t declitem_idx_t;
-#define DECLITEM_IDX_INVALID UINT16_MAX
-#elif MAX_DECLITEM <= UINT32_MAX-1
-typedef uint32_t declitem_idx_t;
-#define DECLITEM_IDX_INVALID UINT32_MAX
-#else
-#error "MAX_DECLITEM way larger than expected"
+#if MAX_PEERS == 0
+/* The latest COMMIT sent to the broker, and whether its RESULT is still outstanding */
+static struct {
+    uint8_t commitid;
+    bool awaited;
+} lastcommit;
 #endif
 
 enum declitem_kind {
 #if ZHE_MAX_URISPACE > 0
     DIK_RESOURCE,
+#endif
+#if ZHE_MAX_URIBINDINGS > 0
+    DIK_URIBINDING,
 #endif
     DIK_PUBLICATION,
     DIK_SUBSCRIPTION
@@ -344,6 +1203,7 @@ struct pending_decls {
     cursoridx_t pos;
     cursoridx_t peers[MULTICAST_CURSORIDX + 1];
     declitem_idx_t cursor[MULTICAST_CURSORIDX + 1][N_DECLITEM_KINDS];
+    bool uncommitted[MULTICAST_CURSORIDX + 1]; /* whether a DECLARE without C flag has been sent */
 };
 
 static struct pending_decls pending_decls;
@@ -362,13 +1222,55 @@ void zhe_accept_peer_sched_hist_decls(peeridx_t peeridx)
     if (pending_decls.cnt == 0) {
         pending_decls.peers[pending_decls.cnt++] = cursoridx;
     } else {
-        zhe_assert(pending_decls.cnt == 1 && pending_decls.peers[pending_decls.cnt] == cursoridx);
+        zhe_assert(pending_decls.cnt == 1 && pending_decls.peers[0] == cursoridx);
     }
 #endif
     enum declitem_kind kind = DECLITEM_KIND_FIRST;
     do {
         pending_decls.cursor[cursoridx][kind] = 0;
     } while(kind++ != DECLITEM_KIND_LAST);
+    pending_decls.cursor[cursoridx][DIK_PUBLICATION] = slotlist_first(&publist);
+    pending_decls.uncommitted[cursoridx] = false;
+    pending_decls.cursor[cursoridx][DIK_SUBSCRIPTION] = slotlist_first(&sublist);
+}
+
+/* Schedules the declaration of a new entry to the peers already known, using the multicast
+   cursor; if that cursor is active and not yet done with the kind, it reaches the entry anyway
+   because new entries go at the end of the list */
+static void sched_decl(enum declitem_kind kind, declitem_idx_t idx)
+{
+    cursoridx_t i;
+    if (!zhe_out_conduit_is_connected(0, 0)) {
+        /* peers discovered later get it along with all other declarations */
+        return;
+    }
+    for (i = 0; i < pending_decls.cnt; i++) {
+        if (pending_decls.peers[i] == MULTICAST_CURSORIDX) {
+            break;
+        }
+    }
+    if (i == pending_decls.cnt) {
+        zhe_assert(pending_decls.cnt < sizeof(pending_decls.cursor) / sizeof(pending_decls.cursor[0]));
+        pending_decls.peers[pending_decls.cnt++] = MULTICAST_CURSORIDX;
+        enum declitem_kind k = DECLITEM_KIND_FIRST;
+        do {
+            pending_decls.cursor[MULTICAST_CURSORIDX][k] = DECLITEM_IDX_INVALID;
+        } while (k++ != DECLITEM_KIND_LAST);
+        pending_decls.uncommitted[MULTICAST_CURSORIDX] = false;
+    }
+    if (pending_decls.cursor[MULTICAST_CURSORIDX][kind] == DECLITEM_IDX_INVALID) {
+        pending_decls.cursor[MULTICAST_CURSORIDX][kind] = idx;
+    }
+}
+
+/* Moves the cursors positioned at an entry that is about to be deleted to the next one */
+static void cursors_skip(enum declitem_kind kind, declitem_idx_t idx, declitem_idx_t next)
+{
+    for (cursoridx_t cursoridx = 0; cursoridx <= MULTICAST_CURSORIDX; cursoridx++) {
+        if (pending_decls.cursor[cursoridx][kind] == idx) {
+            pending_decls.cursor[cursoridx][kind] = next;
+        }
+    }
 }
 
 void zhe_reset_peer_unsched_hist_decls(peeridx_t peeridx)
@@ -379,93 +1281,418 @@ void zhe_reset_peer_unsched_hist_decls(peeridx_t peeridx)
         if (pending_decls.peers[idx] != cursoridx) {
             continue;
         }
-
-        pending_decls.peers[idx] = pending_decls.peers[--pending_decls.cnt];
-        if (pending_decls.pos == pending_decls.cnt) {
-            pending_decls.pos = 0;
+
+        pending_decls.peers[idx] = pending_decls.peers[--pending_decls.cnt];
+        if (pending_decls.pos == pending_decls.cnt) {
+            pending_decls.pos = 0;
+        }
+        return;
+    }
+#elif MAX_PEERS == 0
+    /* the broker is gone, and with it the RESULT of the latest COMMIT */
+    lastcommit.awaited = false;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+#if ZHE_MAX_URISPACE > 0
+static uint8_t declare_resource_size(declitem_idx_t res, zhe_paysize_t *declsz)
+{
+    zhe_paysize_t urisz;
+    const uint8_t *uri;
+    zhe_rid_t rid;
+    if (zhe_uristore_foreign_binding((unsigned)res) || !zhe_uristore_geturi((unsigned)res, &rid, &urisz, &uri)) {
+        return 0;
+    }
+    *declsz = 1 + zhe_pack_ridreq(rid) + zhe_pack_vle16req(urisz) + urisz;
+    return 1;
+}
+
+static void pack_declare_resource(declitem_idx_t res)
+{
+    zhe_paysize_t urisz;
+    const uint8_t *uri;
+    zhe_rid_t rid;
+    (void)zhe_uristore_geturi((unsigned)res, &rid, &urisz, &uri);
+    ZT(PUBSUB, "sending dres %d rid %ju %*.*s", res, (uintmax_t)rid, (int)urisz, (int)urisz, (char*)uri);
+    zhe_pack_dresource(rid, urisz, uri);
+}
+#endif
+
+#if ZHE_MAX_URIBINDINGS > 0
+/* Automatic binding of URIs to ids for zhe_write_uri: writes are counted per URI (by hash, so a
+   collision at worst results in binding a bit early) and once a URI has been written
+   ZHE_URIBIND_THRESHOLD times, it is declared as a resource with an id from the top
+   ZHE_URIBIND_RIDS ids, followed by a binding of that id to that resource. The declarations go out
+   on the same reliable conduit as the data, so they always precede its first use; receivers then
+   deliver data published on the id as if it had been written to the URI. */
+struct uribinding {
+    uint32_t urihash;
+    uint16_t count;               /* number of writes while not yet bound, 0 for a free entry */
+    zhe_rid_t rid;                /* bound id, 0 while not (yet) bound */
+};
+static struct uribinding uribinds[ZHE_MAX_URIBINDINGS];
+
+static zhe_paysize_t uribinding_size(zhe_rid_t rid, zhe_paysize_t urisz)
+{
+    return 1 + zhe_pack_ridreq(rid) + zhe_pack_vle16req(urisz) + urisz + 1 + 2 * zhe_pack_ridreq(rid);
+}
+
+static void pack_uribinding_decls(zhe_rid_t rid, zhe_paysize_t urisz, const uint8_t *uri)
+{
+    /* The resource is declared along with the binding, so that for a peer discovered later the
+       binding doesn't depend on the order in which the declarations are sent */
+    zhe_pack_dresource(rid, urisz, uri);
+    zhe_pack_dbindid(rid, rid);
+}
+
+static int pack_uribinding(struct out_conduit *oc, zhe_rid_t rid, zhe_paysize_t urisz, const uint8_t *uri, zhe_time_t tnow)
+{
+    zhe_msgsize_t from;
+    if (!zhe_oc_pack_mdeclare(oc, false, 2, uribinding_size(rid, urisz), &from, tnow)) {
+        return 0;
+    }
+    pack_uribinding_decls(rid, urisz, uri);
+    zhe_oc_pack_mdeclare_done(oc, from, tnow);
+    return 1;
+}
+
+static uint8_t declare_uribinding_size(declitem_idx_t b, zhe_paysize_t *declsz)
+{
+    zhe_paysize_t urisz;
+    const uint8_t *uri;
+    if (uribinds[b].rid == 0 || !zhe_uristore_find(uribinds[b].rid, &urisz, &uri)) {
+        return 0;
+    }
+    *declsz = uribinding_size(uribinds[b].rid, urisz);
+    return 2;
+}
+
+static void pack_declare_uribinding(declitem_idx_t b)
+{
+    zhe_paysize_t urisz;
+    const uint8_t *uri;
+    (void)zhe_uristore_find(uribinds[b].rid, &urisz, &uri);
+    ZT(PUBSUB, "sending uribinding %d rid %ju", b, (uintmax_t)uribinds[b].rid);
+    pack_uribinding_decls(uribinds[b].rid, urisz, uri);
+}
+
+static zhe_rid_t uribind_bind(struct uribinding *b, const uint8_t *uri, zhe_paysize_t urisz, struct out_conduit *oc, zhe_time_t tnow)
+{
+    /* The id is derived from the hash, so that different publishers usually pick the same id for
+       the same URI; on a conflict with a different URI bound here, try the next one (receivers
+       keep the ids bound by different nodes apart, see the URI store) */
+    for (zhe_rid_t k = 0; k < ZHE_URIBIND_RIDS; k++) {
+        const zhe_rid_t rid = ZHE_MAX_RID - (zhe_rid_t)((b->urihash + k) % ZHE_URIBIND_RIDS);
+        switch (zhe_uristore_store(URISTORE_PEERIDX_SELF, rid, uri, urisz)) {
+            case USR_OK:
+                if (!pack_uribinding(oc, rid, urisz, uri, tnow)) {
+                    /* retry on the next write, the resource simply remains declared */
+                    return 0;
+                }
+                ZT(PUBSUB, "uribind: %ju %*.*s", (uintmax_t)rid, (int)urisz, (int)urisz, (const char *)uri);
+                b->rid = rid;
+                return rid;
+            case USR_MISMATCH:
+                break;
+            case USR_AGAIN:
+            case USR_NOSPACE:
+            case USR_OVERSIZE:
+                return 0;
+        }
+    }
+    return 0;
+}
+
+/* Returns the id bound to uri, binding it if it has been written often enough, or 0 if it is not
+   bound */
+static zhe_rid_t uribind_lookup(uint32_t h, const uint8_t *uri, zhe_paysize_t urisz, struct out_conduit *oc, zhe_time_t tnow)
+{
+    struct uribinding *victim = NULL;
+    for (unsigned i = 0; i < ZHE_MAX_URIBINDINGS; i++) {
+        struct uribinding * const b = &uribinds[i];
+        if (b->rid != 0) {
+            zhe_paysize_t sz;
+            const uint8_t *u;
+            if (b->urihash == h && zhe_uristore_find(b->rid, &sz, &u) && sz == urisz && memcmp(u, uri, urisz) == 0) {
+                return b->rid;
+            }
+        } else if (b->count > 0 && b->urihash == h) {
+            if (b->count < ZHE_URIBIND_THRESHOLD) {
+                b->count++;
+            }
+            return (b->count < ZHE_URIBIND_THRESHOLD) ? 0 : uribind_bind(b, uri, urisz, oc, tnow);
+        } else if (victim == NULL || b->count < victim->count) {
+            victim = b;
+        }
+    }
+    /* Not seen recently: replace the entry with the fewest writes, unless all are bound */
+    if (victim != NULL) {
+        victim->urihash = h;
+        victim->count = 1;
+        if (ZHE_URIBIND_THRESHOLD <= 1) {
+            return uribind_bind(victim, uri, urisz, oc, tnow);
+        }
+    }
+    return 0;
+}
+#endif
+
+static uint8_t declare_pub_size(declitem_idx_t pub, zhe_paysize_t *declsz)
+{
+    /* Currently not pushing publication declarations in peer mode */
+    if (MAX_PEERS > 0 || pubs[pub].rid == 0) {
+        return 0;
+    }
+    *declsz = WC_DPUB_SIZE;
+    return 1;
+}
+
+static void pack_declare_pub(declitem_idx_t pub)
+{
+    ZT(PUBSUB, "sending dpub %d rid %ju", pub, (uintmax_t)pubs[pub].rid);
+    zhe_pack_dpub(pubs[pub].rid);
+}
+
+#if ZHE_MAX_SELECTIONS > 0 && MAX_PEERS > 0
+/* The selection goes out along with the resource it is on and the subscription to its id, so that
+   the receiver can interpret it regardless of what else it has received; only peers understand
+   selections, a broker simply gets the subscription */
+static bool sub_has_selection(declitem_idx_t sub, zhe_paysize_t *urisz, const uint8_t **uri)
+{
+    return subs[sub].sel != 0 && zhe_uristore_find(subs[sub].rid, urisz, uri);
+}
+#endif
+
+static uint8_t declare_sub_size(declitem_idx_t sub, zhe_paysize_t *declsz)
+{
+    if (subs[sub].rid == 0) {
+        return 0;
+    }
+#if ZHE_MAX_SELECTIONS > 0 && MAX_PEERS > 0
+    zhe_paysize_t urisz;
+    const uint8_t *uri;
+    if (sub_has_selection(sub, &urisz, &uri)) {
+        const zhe_rid_t rid = subs[sub].rid, sid = SELECTION_SID(subs[sub].sel - 1u);
+        zhe_paysize_t enclen;
+        (void)zhe_uristore_get_enc(ZHE_MAX_URIHANDLES + subs[sub].sel - 1u, &enclen);
+        *declsz = 1 + zhe_pack_ridreq(rid) + zhe_pack_vle16req(urisz) + urisz + 1 + zhe_pack_ridreq(sid) + enclen + 2 + zhe_pack_ridreq(sid);
+        return 3;
+    }
+#endif
+    *declsz = WC_DSUB_SIZE;
+    return 1;
+}
+
+static void pack_declare_sub(declitem_idx_t sub)
+{
+#if ZHE_MAX_SELECTIONS > 0 && MAX_PEERS > 0
+    zhe_paysize_t urisz;
+    const uint8_t *uri;
+    subs[sub].declared = 1;
+    if (sub_has_selection(sub, &urisz, &uri)) {
+        const unsigned selidx = subs[sub].sel - 1u;
+        const zhe_rid_t sid = SELECTION_SID(selidx);
+        zhe_paysize_t enclen;
+        const uint8_t * const enc = zhe_uristore_get_enc(ZHE_MAX_URIHANDLES + selidx, &enclen);
+        ZT(PUBSUB, "sending dselection %d sid %ju rid %ju", sub, (uintmax_t)sid, (uintmax_t)subs[sub].rid);
+        zhe_pack_dresource(subs[sub].rid, urisz, uri);
+        zhe_pack_dselection(sid, enclen, enc);
+        zhe_pack_dsub(sid);
+        return;
+    }
+#endif
+    ZT(PUBSUB, "sending dsub %d rid %ju", sub, (uintmax_t)subs[sub].rid);
+    zhe_pack_dsub(subs[sub].rid);
+}
+
+/* Returns the number of declarations needed for item idx of the given kind and sets *declsz to
+   their (worst-case) size, or returns 0 if there is nothing to declare for it */
+static uint8_t declitem_size(enum declitem_kind kind, declitem_idx_t idx, zhe_paysize_t *declsz)
+{
+    switch (kind) {
+#if ZHE_MAX_URISPACE > 0
+        case DIK_RESOURCE:     return declare_resource_size(idx, declsz);
+#endif
+#if ZHE_MAX_URIBINDINGS > 0
+        case DIK_URIBINDING:   return declare_uribinding_size(idx, declsz);
+#endif
+        case DIK_PUBLICATION:  return declare_pub_size(idx, declsz);
+        case DIK_SUBSCRIPTION: return declare_sub_size(idx, declsz);
+    }
+    return 0;
+}
+
+static void declitem_pack(enum declitem_kind kind, declitem_idx_t idx)
+{
+    switch (kind) {
+#if ZHE_MAX_URISPACE > 0
+        case DIK_RESOURCE:     pack_declare_resource(idx); break;
+#endif
+#if ZHE_MAX_URIBINDINGS > 0
+        case DIK_URIBINDING:   pack_declare_uribinding(idx); break;
+#endif
+        case DIK_PUBLICATION:  pack_declare_pub(idx); break;
+        case DIK_SUBSCRIPTION: pack_declare_sub(idx); break;
+    }
+}
+
+static declitem_idx_t declitem_next(enum declitem_kind kind, declitem_idx_t idx)
+{
+    /* Resources and bindings are never deleted locally, publications and subscriptions are */
+    switch (kind) {
+#if ZHE_MAX_URISPACE > 0
+        case DIK_RESOURCE:     return (idx+1 == ZHE_MAX_RESOURCES) ? DECLITEM_IDX_INVALID : idx+1;
+#endif
+#if ZHE_MAX_URIBINDINGS > 0
+        case DIK_URIBINDING:   return (idx+1 == ZHE_MAX_URIBINDINGS) ? DECLITEM_IDX_INVALID : idx+1;
+#endif
+        case DIK_PUBLICATION:  return slotlist_next(pubs_lnext, idx);
+        case DIK_SUBSCRIPTION: return slotlist_next(subs_lnext, idx);
+    }
+    return DECLITEM_IDX_INVALID;
+}
+
+/* Walks the pending items of a cursor, one kind after the other. Without pack, it counts how many
+   items fit in a single DECLARE of at most maxsz bytes of declarations (items with nothing to
+   declare included); with pack, it packs the first nitems items and moves the cursor past them.
+   Either way, *ndecls and *declsz are the number and size of the declarations involved, and *all
+   is set iff no items remain after these. */
+static unsigned declitems_walk(declitem_idx_t *cursor, bool pack, unsigned nitems, zhe_paysize_t maxsz, uint8_t *ndecls, zhe_paysize_t *declsz, bool *all)
+{
+    enum declitem_kind kind = DECLITEM_KIND_FIRST;
+    declitem_idx_t idx = cursor[kind];
+    unsigned i = 0;
+    *ndecls = 0;
+    *declsz = 0;
+    while (i < nitems) {
+        zhe_paysize_t sz;
+        uint8_t n;
+        if (idx == DECLITEM_IDX_INVALID) {
+            if (kind == DECLITEM_KIND_LAST) {
+                break;
+            }
+            if (pack) {
+                cursor[kind] = idx;
+            }
+            idx = cursor[++kind];
+            continue;
+        }
+        if ((n = declitem_size(kind, idx, &sz)) > 0) {
+            if (!pack && (*ndecls + n > MAX_DECLS_PER_DECLARE || *declsz + sz > maxsz)) {
+                break;
+            } else if (pack) {
+                declitem_pack(kind, idx);
+            }
+            *ndecls = (uint8_t)(*ndecls + n);
+            *declsz = (zhe_paysize_t)(*declsz + sz);
         }
-        return;
+        idx = declitem_next(kind, idx);
+        i++;
     }
-#endif
+    if (pack) {
+        cursor[kind] = idx;
+    }
+    while (idx == DECLITEM_IDX_INVALID && kind != DECLITEM_KIND_LAST) {
+        idx = cursor[++kind];
+    }
+    *all = (idx == DECLITEM_IDX_INVALID);
+    return i;
 }
 
-/////////////////////////////////////////////////////////////////////////////////////
+/* Packs a COMMIT for the broker, remembering it so that its RESULT can be recognised */
+static void pack_dcommit(void)
+{
+    ZT(PUBSUB, "sending commit %u", gcommitid);
+#if MAX_PEERS == 0
+    lastcommit.commitid = gcommitid;
+    lastcommit.awaited = true;
+#endif
+    zhe_pack_dcommit(gcommitid++);
+}
 
-#if ZHE_MAX_URISPACE > 0
-static int send_declare_resource(struct out_conduit *oc, declitem_idx_t res, bool committed, zhe_time_t tnow)
+void zhe_decl_note_result(uint8_t commitid)
 {
-    zhe_msgsize_t from;
-    zhe_paysize_t urisz;
-    const uint8_t *uri;
-    zhe_rid_t rid;
-    if (!zhe_uristore_geturi((unsigned)res, &rid, &urisz, &uri)) {
-        return 1;
-    }
-    const zhe_paysize_t declsz = 1 + zhe_pack_ridreq(rid) + zhe_pack_vle16req(urisz) + urisz;
-    if (zhe_oc_pack_mdeclare(oc, committed, 1, declsz, &from, tnow)) {
-        ZT(PUBSUB, "sending dres %d rid %ju %*.*s", res, (uintmax_t)rid, (int)urisz, (int)urisz, (char*)uri);
-        zhe_pack_dresource(rid, urisz, uri);
-        zhe_oc_pack_mdeclare_done(oc, from, tnow);
-        return 1;
-    } else {
-        ZT(PUBSUB, "postponing dres %d rid %ju %*.*s", res, (uintmax_t)rid, (int)urisz, (int)urisz, (char*)uri);
-        return 0;
+#if MAX_PEERS == 0
+    if (lastcommit.awaited && commitid == lastcommit.commitid) {
+        lastcommit.awaited = false;
     }
-}
+#else
+    (void)commitid;
 #endif
+}
 
-static int send_declare_pub(struct out_conduit *oc, declitem_idx_t pub, bool committed, zhe_time_t tnow)
+/* True if the broker has replied to the latest COMMIT; peers don't reply to the C flag */
+bool zhe_decl_results_done(void)
 {
-    /* Currently not pushing publication declarations in peer mode */
 #if MAX_PEERS == 0
-    zhe_msgsize_t from;
-    if (pubs[pub].rid == 0) {
-        return 1;
-    } else if (zhe_oc_pack_mdeclare(oc, committed, 1, WC_DPUB_SIZE, &from, tnow)) {
-        ZT(PUBSUB, "sending dpub %d rid %ju", pub, (uintmax_t)pubs[pub].rid);
-        zhe_pack_dpub(pubs[pub].rid);
-        zhe_oc_pack_mdeclare_done(oc, from, tnow);
-        return 1;
-    } else {
-        ZT(PUBSUB, "postponing dpub %d rid %ju", pub, (uintmax_t)pubs[pub].rid);
-        return 0;
-    }
+    return !lastcommit.awaited;
 #else
-    return 1;
+    return true;
 #endif
 }
 
-static int send_declare_sub(struct out_conduit *oc, declitem_idx_t sub, bool committed, zhe_time_t tnow)
+/* Commits declarations sent in DECLAREs without the C flag: peers get an empty DECLARE with the C
+   flag set, a broker gets a COMMIT (to which it replies with a RESULT) */
+static int send_declare_commit(struct out_conduit *oc, zhe_time_t tnow)
 {
+    const bool committed = (MAX_PEERS > 0);
     zhe_msgsize_t from;
-    if (subs[sub].rid == 0) {
-        return 1;
-    } else if (zhe_oc_pack_mdeclare(oc, committed, 1, WC_DSUB_SIZE, &from, tnow)) {
-        ZT(PUBSUB, "sending dsub %d rid %ju", sub, (uintmax_t)subs[sub].rid);
-        zhe_pack_dsub(subs[sub].rid);
+    if (zhe_oc_pack_mdeclare(oc, committed, committed ? 0 : 1, committed ? 0 : WC_DCOMMIT_SIZE, &from, tnow)) {
+        if (committed) {
+            ZT(PUBSUB, "sending empty committed declare");
+        } else {
+            pack_dcommit();
+        }
         zhe_oc_pack_mdeclare_done(oc, from, tnow);
+        zhe_pack_msend();
         return 1;
     } else {
-        ZT(PUBSUB, "postponing dsub %d rid %ju", sub, (uintmax_t)subs[sub].rid);
+        ZT(PUBSUB, "postponing commit");
         return 0;
     }
 }
 
-static int send_declare_commit(struct out_conduit *oc, uint8_t commitid, zhe_time_t tnow)
+/* Withdraws a publication (DFPUB) or subscription (DFSUB) declaration, the latter followed by the
+   withdrawal of the selection if rid is a selection id, from all peers at once on reliable
+   conduit 0. In peer mode, the DECLARE commits itself; a broker gets a COMMIT. Returns false if
+   the transmit window has no space for it. */
+static bool send_undeclare(uint8_t kind, zhe_rid_t rid, bool selection, zhe_time_t tnow)
 {
+    struct out_conduit * const oc = zhe_out_conduit_from_cid(0, 0);
+    const bool committed = (MAX_PEERS > 0);
+    const uint8_t ndecls = (uint8_t)(1 + selection + !committed);
+    const zhe_paysize_t declsz = (zhe_paysize_t)((1 + selection) * (1 + zhe_pack_ridreq(rid)) + (committed ? 0 : WC_DCOMMIT_SIZE));
     zhe_msgsize_t from;
-    if (zhe_oc_pack_mdeclare(oc, false, 1, WC_DCOMMIT_SIZE, &from, tnow)) {
-        ZT(PUBSUB, "sending commit %u", commitid);
-        zhe_pack_dcommit(commitid);
-        zhe_oc_pack_mdeclare_done(oc, from, tnow);
-        zhe_pack_msend();
-        return 1;
+    if (!zhe_out_conduit_is_connected(0, 0)) {
+        /* nobody to tell */
+        return true;
+    } else if (zhe_oc_am_draining_window(oc) || !zhe_oc_pack_mdeclare(oc, committed, ndecls, declsz, &from, tnow)) {
+        return false;
+    }
+    ZT(PUBSUB, "sending %s rid %ju%s", (kind == DFPUB) ? "dfpub" : "dfsub", (uintmax_t)rid, selection ? " + dfselection" : "");
+    if (kind == DFPUB) {
+        zhe_pack_dfpub(rid);
     } else {
-        ZT(PUBSUB, "postponing commit %u", commitid);
-        return 0;
+        zhe_pack_dfsub(rid);
+    }
+    if (selection) {
+        zhe_pack_dfselection(rid);
+    }
+    if (!committed) {
+        pack_dcommit();
     }
+    zhe_oc_pack_mdeclare_done(oc, from, tnow);
+    zhe_pack_msend();
+    return true;
 }
 
+/* Sends the pending declarations of a cursor, packing as many of them in each DECLARE as the
+   packet and the transmit window allow, and continuing with the next DECLARE until all have been
+   sent (returning the conduit) or the window is full (returning NULL). In peer mode, the C flag is
+   set on the DECLARE with the last of them, which makes the peers commit them without a separate
+   COMMIT and RESULT; a broker always gets a COMMIT afterwards. */
 static struct out_conduit *zhe_send_declares1(zhe_time_t tnow, const cursoridx_t cursoridx)
 {
     zhe_assert(cursoridx == MULTICAST_CURSORIDX || cursoridx < MAX_PEERS_1);
@@ -474,38 +1701,41 @@ static struct out_conduit *zhe_send_declares1(zhe_time_t tnow, const cursoridx_t
 #else
     struct out_conduit * const oc = (cursoridx == MULTICAST_CURSORIDX) ? zhe_out_conduit_from_cid(0, 0) : zhe_out_conduit_from_cid(cursoridx, 0);
 #endif
-    const bool committed = (cursoridx != MULTICAST_CURSORIDX);
-    declitem_idx_t idx;
-    int done = 0;
-    enum declitem_kind kind;
+    declitem_idx_t * const cursor = pending_decls.cursor[cursoridx];
+    unsigned nitems;
+    uint8_t ndecls, ndecls1;
+    zhe_paysize_t declsz, declsz1;
+    zhe_msgsize_t from;
+    bool all, all1;
+
+    while ((nitems = declitems_walk(cursor, false, UINT_MAX, zhe_oc_mdeclare_maxdecllen(oc), &ndecls, &declsz, &all)) > 0) {
+        const bool committed = (MAX_PEERS > 0 && all);
+        if (ndecls == 0) {
+            /* nothing to declare for these, but there may be something after them */
+            (void)declitems_walk(cursor, true, nitems, 0, &ndecls1, &declsz1, &all1);
+            continue;
+        } else if (!zhe_oc_pack_mdeclare(oc, committed, ndecls, declsz, &from, tnow)) {
+            break;
+        }
+        ZT(PUBSUB, "sending declare cursoridx %u: %u items, %u decls, %u bytes%s", (unsigned)cursoridx, nitems, (unsigned)ndecls, (unsigned)declsz, committed ? ", committed" : "");
+        (void)declitems_walk(cursor, true, nitems, 0, &ndecls1, &declsz1, &all1);
+        zhe_assert(ndecls1 == ndecls && declsz1 == declsz && all1 == all);
+        zhe_oc_pack_mdeclare_done(oc, from, tnow);
+        pending_decls.uncommitted[cursoridx] = !committed;
+    }
 
-    kind = DECLITEM_KIND_FIRST;
+    enum declitem_kind kind = DECLITEM_KIND_FIRST;
     do {
-        if ((idx = pending_decls.cursor[cursoridx][kind]) == DECLITEM_IDX_INVALID) {
-            done++;
-        } else {
-            declitem_idx_t max;
-            int success;
-            //ZT(PUBSUB, "send_declares_1 cursoridx %u kind %u idx %u cid %u", (unsigned)cursoridx, (unsigned)kind, (unsigned)idx, (unsigned)zhe_oc_get_cid(oc));
-            switch (kind) {
-                    /* FIXME: the check against max value is only ok as long as we don't delete entities */
-#if ZHE_MAX_URISPACE > 0
-                case DIK_RESOURCE:     success = send_declare_resource(oc, idx, committed, tnow); max = ZHE_MAX_RESOURCES; break;
-#endif
-                case DIK_PUBLICATION:  success = send_declare_pub(oc, idx, committed, tnow); max = max_pubidx.idx+1;  break;
-                case DIK_SUBSCRIPTION: success = send_declare_sub(oc, idx, committed, tnow); max = max_subidx.idx+1;  break;
-            }
-            if (success) {
-                /* FIXME: improve iterator over items to declare */
-                if (++pending_decls.cursor[cursoridx][kind] == max) {
-                    pending_decls.cursor[cursoridx][kind] = DECLITEM_IDX_INVALID;
-                    done++;
-                }
-            }
+        if (cursor[kind] != DECLITEM_IDX_INVALID) {
+            /* out of space: ask for an acknowledgement with the next round of SYNCHs rather than
+               MSYNCH_INTERVAL after the oldest message, and continue once the ACK makes room;
+               the window isn't drained, that would block the application's writes */
+            ZT(PUBSUB, "postponing declares cursoridx %u kind %u idx %u", (unsigned)cursoridx, (unsigned)kind, (unsigned)cursor[kind]);
+            zhe_oc_request_ack(oc, tnow);
+            return NULL;
         }
     } while (kind++ != DECLITEM_KIND_LAST);
-
-    return (done == N_DECLITEM_KINDS) ? oc : NULL;
+    return oc;
 }
 
 void zhe_send_declares(zhe_time_t tnow)
@@ -514,19 +1744,14 @@ void zhe_send_declares(zhe_time_t tnow)
     if (pending_decls.cnt == 0) {
         zhe_assert(pending_decls.pos == 0);
     } else {
-        const bool fresh = (pending_decls.peers[pending_decls.pos] == MULTICAST_CURSORIDX);
-        if ((commit_oc = zhe_send_declares1(tnow, pending_decls.peers[pending_decls.pos])) == NULL) {
-            if (++pending_decls.pos == pending_decls.cnt) {
-                pending_decls.pos = 0;
-            }
-        } else if (fresh && !send_declare_commit(commit_oc, gcommitid, tnow)) {
+        const cursoridx_t cursoridx = pending_decls.peers[pending_decls.pos];
+        if ((commit_oc = zhe_send_declares1(tnow, cursoridx)) == NULL ||
+            (pending_decls.uncommitted[cursoridx] && !send_declare_commit(commit_oc, tnow))) {
             if (++pending_decls.pos == pending_decls.cnt) {
                 pending_decls.pos = 0;
             }
         } else {
-            if (fresh) {
-                gcommitid++;
-            }
+            pending_decls.uncommitted[cursoridx] = false;
             pending_decls.peers[pending_decls.pos] = pending_decls.peers[--pending_decls.cnt];
             if (pending_decls.pos == pending_decls.cnt) {
                 pending_decls.pos = 0;
@@ -535,6 +1760,12 @@ void zhe_send_declares(zhe_time_t tnow)
     }
 }
 
+/* True if no declarations (historical, fresh or commits) are waiting to be sent */
+bool zhe_send_declares_done(void)
+{
+    return pending_decls.cnt == 0;
+}
+
 /////////////////////////////////////////////////////////////////////////////
 
 bool zhe_declare_resource(zhe_rid_t rid, const char *uri)
@@ -559,102 +1790,377 @@ zhe_pubidx_t zhe_publish(zhe_rid_t rid, unsigned cid, int reliable)
      to send a reliable message when the transmit window is full.  */
     zhe_pubidx_t pubidx;
     zhe_assert(rid > 0 && rid <= ZHE_MAX_RID);
-    for (pubidx.idx = 0; pubidx.idx < ZHE_MAX_PUBLICATIONS; pubidx.idx++) {
-        if (pubs[pubidx.idx].rid == 0) {
-            break;
-        }
-    }
-    zhe_assert(pubidx.idx < ZHE_MAX_PUBLICATIONS);
+    const declitem_idx_t slot = slotlist_alloc(&publist, pubs_lnext, ZHE_MAX_PUBLICATIONS);
+    zhe_assert(slot != DECLITEM_IDX_INVALID);
+    pubidx.idx = (zhe_pubidx_inner_t)slot;
+    zhe_assert(pubs[pubidx.idx].rid == 0);
     zhe_assert(!zhe_bitset_test(pubs_isrel, pubidx.idx));
     zhe_assert(cid < N_OUT_CONDUITS);
+#if MAX_PEERS == 0
+    /* The broker's subscriptions to rid apply to this publication as well */
+    const declitem_idx_t other = pub_first(rid);
+    if (other != DECLITEM_IDX_INVALID && zhe_bitset_test(pubs_rsubs, other)) {
+        zhe_bitset_set(pubs_rsubs, pubidx.idx);
+    }
+#endif
+    pub_link(slot, rid);
     pubs[pubidx.idx].rid = rid;
+    pubs[pubidx.idx].lastseq_valid = false;
+#if XMITW_SAMPLE_LIFESPAN
+    pubs[pubidx.idx].lifespan = 0;
+#endif
     /* FIXME: horrible hack ... */
     pubs[pubidx.idx].oc = zhe_out_conduit_from_cid(0, (cid_t)cid);
-    max_pubidx = pubidx;
     if (reliable) {
         zhe_bitset_set(pubs_isrel, pubidx.idx);
     }
-    ZT(PUBSUB, "publish: %u rid %ju (%s)", pubidx.idx, (uintmax_t)rid, reliable ? "reliable" : "unreliable");
-#if MAX_PEERS == 0
-    {
-        cursoridx_t idx;
-        for (idx = 0; idx < pending_decls.cnt; idx++) {
-            if (pending_decls.peers[idx] == MULTICAST_CURSORIDX) {
-                break;
-            }
-        }
-        if (idx == pending_decls.cnt + 1) {
-            zhe_assert(pending_decls.cnt < sizeof(pending_decls.cursor) / sizeof(pending_decls.cursor[0]));
-            pending_decls.peers[pending_decls.cnt++] = MULTICAST_CURSORIDX;
-        }
-        if (pending_decls.cursor[MULTICAST_CURSORIDX][DIK_PUBLICATION] > pubidx.idx) {
-            /* FIXME: double declare ... once you can delete publications */
-            pending_decls.cursor[MULTICAST_CURSORIDX][DIK_PUBLICATION] = pubidx.idx;
-        }
+    if (reliable == ZHE_PUB_RELIABLE_KEEPLAST) {
+        zhe_bitset_set(pubs_keeplast, pubidx.idx);
     }
+    ZT(PUBSUB, "publish: %u rid %ju (%s)", pubidx.idx, (uintmax_t)rid, reliable == ZHE_PUB_RELIABLE_KEEPLAST ? "keep-last" : reliable ? "reliable" : "unreliable");
+#if MAX_PEERS == 0
+    sched_decl(DIK_PUBLICATION, pubidx.idx);
 #else
-    for (peeridx_t peeridx = 0; peeridx < MAX_PEERS_1; peeridx++) {
-        if (zhe_bitset_test(peers_rsubs[peeridx].rsubs, rid)) {
-            ZT(PUBSUB, "publish: %u rid %ju has remote subs", pubidx.idx, (uintmax_t)rid, reliable ? "reliable" : "unreliable");
-            zhe_bitset_set(pubs_rsubs, pubidx.idx);
-            break;
-        }
+    if (rsub_has_peers(rid)) {
+        ZT(PUBSUB, "publish: %u rid %ju has remote subs", pubidx.idx, (uintmax_t)rid);
+        zhe_bitset_set(pubs_rsubs, pubidx.idx);
     }
 #endif
     return pubidx;
 }
 
+bool zhe_unpublish(zhe_pubidx_t pubidx, zhe_time_t tnow)
+{
+    const zhe_rid_t rid = pubs[pubidx.idx].rid;
+    zhe_assert(rid != 0);
+    /* Currently not pushing publication declarations in peer mode, so peers need not be told; a
+       broker needs to be told only once no other publication of rid remains */
+    bool others = false;
+    for (declitem_idx_t idx = pub_first(rid); idx != DECLITEM_IDX_INVALID && !others; idx = pubs_rnext[idx]) {
+        others = (idx != pubidx.idx);
+    }
+    if (MAX_PEERS == 0 && !others && !send_undeclare(DFPUB, rid, false, tnow)) {
+        return false;
+    }
+    zhe_bitset_clear(pubs_isrel, pubidx.idx);
+    zhe_bitset_clear(pubs_rsubs, pubidx.idx);
+    zhe_bitset_clear(pubs_keeplast, pubidx.idx);
+#if MAX_PEERS == 0
+    zhe_bitset_clear(precommit[0].rsubs, pubidx.idx);
+    zhe_bitset_clear(precommit_curpkt.rsubs, pubidx.idx);
+#endif
+    cursors_skip(DIK_PUBLICATION, pubidx.idx, slotlist_next(pubs_lnext, pubidx.idx));
+    slotlist_free(&publist, pubs_lnext, pubidx.idx);
+    pub_unlink(pubidx.idx, rid);
+    pubs[pubidx.idx].rid = 0;
+    ZT(PUBSUB, "unpublish: %u rid %ju", (unsigned)pubidx.idx, (uintmax_t)rid);
+    return true;
+}
+
+bool zhe_set_lifespan(zhe_pubidx_t pubidx, zhe_timediff_t lifespan)
+{
+    zhe_assert(pubs[pubidx.idx].rid != 0);
+    zhe_assert(lifespan >= 0);
+#if XMITW_SAMPLE_LIFESPAN
+    pubs[pubidx.idx].lifespan = lifespan;
+    return true;
+#else
+    return lifespan == 0;
+#endif
+}
+
 zhe_subidx_t zhe_subscribe(zhe_rid_t rid, zhe_paysize_t xmitneed, unsigned cid, zhe_subhandler_t handler, void *arg)
 {
-    zhe_subidx_t subidx, nextidx;
+    zhe_subidx_t subidx, headidx;
     zhe_assert(rid > 0 && rid <= ZHE_MAX_RID);
-    for (subidx.idx = 0; subidx.idx < ZHE_MAX_SUBSCRIPTIONS; subidx.idx++) {
-        if (subs[subidx.idx].rid == 0) {
-            break;
+    const struct subtable * const head = find_subhead(rid);
+    headidx.idx = (head == NULL) ? SUBIDX_NONE : (zhe_subidx_inner_t)(head - subs);
+    const declitem_idx_t slot = slotlist_alloc(&sublist, subs_lnext, ZHE_MAX_SUBSCRIPTIONS);
+    zhe_assert(slot != DECLITEM_IDX_INVALID);
+    subidx.idx = (zhe_subidx_inner_t)slot;
+    zhe_assert(subs[subidx.idx].rid == 0);
+    subs[subidx.idx].rid = rid;
+    /* The list of subscriptions to rid is kept in order of index, so that the head is the one with
+       the lowest index, which is what find_subhead relies on for small tables */
+    if (headidx.idx == SUBIDX_NONE || subidx.idx < headidx.idx) {
+        subs[subidx.idx].next = headidx;
+        if (headidx.idx == SUBIDX_NONE) {
+            memset(subs[subidx.idx].ridneed, 0, sizeof(subs[subidx.idx].ridneed));
+#if ZHE_MAX_DELIVERY_QUEUES > 0
+            subs[subidx.idx].ridblock = 0;
+#endif
+        } else {
+            memcpy(subs[subidx.idx].ridneed, subs[headidx.idx].ridneed, sizeof(subs[subidx.idx].ridneed));
+#if ZHE_MAX_DELIVERY_QUEUES > 0
+            subs[subidx.idx].ridblock = subs[headidx.idx].ridblock;
+#endif
         }
-    }
+        headidx = subidx;
 #if ZHE_MAX_SUBSCRIPTIONS > RID_TABLE_THRESHOLD
-    nextidx = rid2sub[rid];
-#else
-    for (nextidx.idx = 0; nextidx.idx < ZHE_MAX_SUBSCRIPTIONS; nextidx.idx++) {
-        if (subs[nextidx.idx].rid == rid) {
-            break;
+        struct rid2sub * const r = rid2sub_lookup(rid);
+        r->rid = rid;
+        r->subidx = subidx;
+#endif
+    } else {
+        struct subtable *t = &subs[headidx.idx];
+        while (t->next.idx != SUBIDX_NONE && t->next.idx < subidx.idx) {
+            t = &subs[t->next.idx];
         }
+        subs[subidx.idx].next = t->next;
+        t->next = subidx;
     }
-    if (nextidx.idx == ZHE_MAX_SUBSCRIPTIONS) {
-        nextidx.idx = 0; /* using 0 to signal the end of the list is an ungainly hack, but it works for now */
+    if (xmitneed > 0) {
+        zhe_assert(cid < N_OUT_CONDUITS);
+        subs[headidx.idx].ridneed[cid] += xmitneed;
     }
-#endif
-    zhe_assert(subidx.idx < ZHE_MAX_SUBSCRIPTIONS);
-    subs[subidx.idx].rid = rid;
-    subs[subidx.idx].next = nextidx;
     subs[subidx.idx].xmitneed = xmitneed;
     /* FIXME: horrible hack ... */
     subs[subidx.idx].oc = zhe_out_conduit_from_cid(0, (cid_t)cid);
     subs[subidx.idx].handler = handler;
     subs[subidx.idx].arg = arg;
+#if ZHE_MAX_DELIVERY_QUEUES > 0
+    subs[subidx.idx].delivq = 0;
+#endif
+#if ZHE_MAX_SELECTIONS > 0
+    subs[subidx.idx].sel = 0;
+    subs[subidx.idx].declared = 0;
+#endif
+    sched_decl(DIK_SUBSCRIPTION, subidx.idx);
+    ZT(PUBSUB, "subscribe: %u rid %ju", subidx.idx, (uintmax_t)rid);
+    return subidx;
+}
+
+bool zhe_unsubscribe(zhe_subidx_t subidx, zhe_time_t tnow)
+{
+    struct subtable * const s = &subs[subidx.idx];
+    const zhe_rid_t rid = s->rid;
+    zhe_assert(rid != 0);
+    struct subtable * const head = find_subhead(rid);
+    zhe_assert(head != NULL);
+
+    /* Peers subscribe on behalf of all local subscriptions to the resource, but a selection has
+       an id of its own */
+#if ZHE_MAX_SELECTIONS > 0 && MAX_PEERS > 0
+    const bool selection = (s->sel != 0);
+    const zhe_rid_t declrid = selection ? SELECTION_SID(s->sel - 1) : rid;
+#else
+    const bool selection = false;
+    const zhe_rid_t declrid = rid;
+#endif
+    bool others = false;
+    for (const struct subtable *t = head; !others; t = &subs[t->next.idx]) {
+#if ZHE_MAX_SELECTIONS > 0 && MAX_PEERS > 0
+        others = (t != s && t->sel == 0);
+#else
+        others = (t != s);
+#endif
+        if (t->next.idx == SUBIDX_NONE) {
+            break;
+        }
+    }
+    if ((selection || !others) && !send_undeclare(DFSUB, declrid, selection, tnow)) {
+        return false;
+    }
+
+    /* Its handler no longer needs space in the transmit window, nor its queue any memory */
+    if (s->xmitneed > 0) {
+#if ZHE_MAX_DELIVERY_QUEUES > 0
+        if (s->delivq == 0) {
+            head->ridneed[zhe_oc_get_cid(s->oc)] -= s->xmitneed;
+        }
+#else
+        head->ridneed[zhe_oc_get_cid(s->oc)] -= s->xmitneed;
+#endif
+    }
+#if ZHE_MAX_DELIVERY_QUEUES > 0
+    if (s->delivq != 0) {
+        struct delivq * const q = &delivqs[s->delivq - 1];
+        q->buf = NULL;
+        q->rd = q->wr = 0;
+        q->n = 0;
+        if (q == delivq_dispatching) {
+            /* unsubscribing from within its own handler: the sample is gone already */
+            delivq_dispatching = NULL;
+        }
+        /* free queues at the end needn't be visited by zhe_dispatch */
+        while (n_delivqs > 0 && delivqs[n_delivqs - 1].buf == NULL) {
+            n_delivqs--;
+        }
+        if (delivq_next >= n_delivqs) {
+            delivq_next = 0;
+        }
+    }
+#endif
+#if ZHE_MAX_SELECTIONS > 0
+    if (s->sel != 0) {
+        sels[s->sel - 1].codelen = 0;
+        zhe_uristore_free_enc(ZHE_MAX_URIHANDLES + s->sel - 1u);
+    }
+#endif
+
+    /* Unlink it from the list of subscriptions to rid, handing the head's role to the next one */
+    if (s == head) {
 #if ZHE_MAX_SUBSCRIPTIONS > RID_TABLE_THRESHOLD
-    rid2sub[rid] = subidx;
+        struct rid2sub * const r = rid2sub_lookup(rid);
+        if (s->next.idx == SUBIDX_NONE) {
+            rid2sub_delete(r);
+        } else {
+            r->subidx = s->next;
+        }
 #endif
-    max_subidx = subidx;
-   {
-        cursoridx_t idx;
-        for (idx = 0; idx < pending_decls.cnt; idx++) {
-            if (pending_decls.peers[idx] == MULTICAST_CURSORIDX) {
+        if (s->next.idx != SUBIDX_NONE) {
+            memcpy(subs[s->next.idx].ridneed, s->ridneed, sizeof(s->ridneed));
+        }
+    } else {
+        struct subtable *t = head;
+        while (t->next.idx != subidx.idx) {
+            t = &subs[t->next.idx];
+        }
+        t->next = s->next;
+    }
+#if ZHE_MAX_DELIVERY_QUEUES > 0
+    if (s->next.idx != SUBIDX_NONE || s != head) {
+        struct subtable * const newhead = (s == head) ? &subs[s->next.idx] : head;
+        newhead->ridblock = 0;
+        for (const struct subtable *t = newhead; ; t = &subs[t->next.idx]) {
+            if (t->delivq != 0 && delivqs[t->delivq - 1].policy == ZHE_QUEUE_BLOCK) {
+                newhead->ridblock = 1;
+            }
+            if (t->next.idx == SUBIDX_NONE) {
                 break;
             }
         }
-        if (idx == pending_decls.cnt + 1) {
-            zhe_assert(pending_decls.cnt < sizeof(pending_decls.cursor) / sizeof(pending_decls.cursor[0]));
-            pending_decls.peers[pending_decls.cnt++] = MULTICAST_CURSORIDX;
+    }
+#endif
+
+    cursors_skip(DIK_SUBSCRIPTION, subidx.idx, slotlist_next(subs_lnext, subidx.idx));
+    slotlist_free(&sublist, subs_lnext, subidx.idx);
+    s->rid = 0;
+    ZT(PUBSUB, "unsubscribe: %u rid %ju", (unsigned)subidx.idx, (uintmax_t)rid);
+    return true;
+}
+
+bool zhe_set_delivery_queue(zhe_subidx_t subidx, void *buf, size_t size, int policy)
+{
+    zhe_assert(subs[subidx.idx].rid != 0);
+    zhe_assert(policy == ZHE_QUEUE_DROP_NEWEST || policy == ZHE_QUEUE_DROP_OLDEST || policy == ZHE_QUEUE_BLOCK);
+#if ZHE_MAX_DELIVERY_QUEUES > 0
+    struct subtable * const s = &subs[subidx.idx];
+    uint8_t qidx;
+    /* Queues of deleted subscriptions are free for reuse */
+    for (qidx = 0; qidx < n_delivqs; qidx++) {
+        if (delivqs[qidx].buf == NULL) {
+            break;
         }
-        if (pending_decls.cursor[MULTICAST_CURSORIDX][DIK_SUBSCRIPTION] > subidx.idx) {
-            /* FIXME: double declare ... once you can delete publications */
-            pending_decls.cursor[MULTICAST_CURSORIDX][DIK_SUBSCRIPTION] = subidx.idx;
+    }
+    if (s->delivq != 0 || qidx == ZHE_MAX_DELIVERY_QUEUES) {
+        return false;
+    } else if (qidx == n_delivqs) {
+        n_delivqs++;
+    }
+    struct delivq * const q = &delivqs[qidx];
+    q->buf = buf;
+    q->size = size;
+    q->rd = q->wr = 0;
+    q->n = 0;
+    q->subidx = subidx;
+    q->policy = (uint8_t)policy;
+    s->delivq = (uint8_t)(qidx + 1);
+    /* The handler no longer runs while processing input, so it no longer needs space then */
+    struct subtable * const head = find_subhead(s->rid);
+    if (s->xmitneed > 0) {
+        head->ridneed[zhe_oc_get_cid(s->oc)] -= s->xmitneed;
+    }
+    if (policy == ZHE_QUEUE_BLOCK) {
+        head->ridblock = 1;
+    }
+    ZT(PUBSUB, "set_delivery_queue: %u size %zu policy %d", subidx.idx, size, policy);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool zhe_set_selection(zhe_subidx_t subidx, const char *predicate)
+{
+    zhe_assert(subs[subidx.idx].rid != 0);
+#if ZHE_MAX_SELECTIONS > 0
+    struct subtable * const s = &subs[subidx.idx];
+    const size_t predsz = strlen(predicate);
+    zhe_paysize_t urisz, prefixlen;
+    const uint8_t *uri;
+    uint8_t selidx;
+    for (selidx = 0; selidx < ZHE_MAX_SELECTIONS; selidx++) {
+        if (sels[selidx].codelen == 0) {
+            break;
         }
     }
-    ZT(PUBSUB, "subscribe: %u rid %ju", subidx.idx, (uintmax_t)rid);
-    return subidx;
+    if (s->sel != 0 || selidx == ZHE_MAX_SELECTIONS || !zhe_uristore_find(s->rid, &urisz, &uri) || urisz + predsz + 3 > ZHE_MAX_URILENGTH) {
+        return false;
+    } else if (MAX_PEERS > 0 && s->declared) {
+        /* peers already have the plain subscription */
+        ZT(PUBSUB, "set_selection: %u already declared", subidx.idx);
+        return false;
+    }
+    struct selection * const sel = &sels[selidx];
+    if ((sel->codelen = zhe_predicate_compile((const uint8_t *)predicate, predsz, sel->code)) == 0) {
+        ZT(PUBSUB, "set_selection: %u invalid predicate %s", subidx.idx, predicate);
+        return false;
+    }
+    /* The query: "URI?{predicate}" */
+    uint8_t query[ZHE_MAX_URILENGTH];
+    memcpy(query, uri, urisz);
+    query[urisz] = '?';
+    query[urisz + 1] = '{';
+    memcpy(query + urisz + 2, predicate, predsz);
+    query[urisz + 2 + predsz] = '}';
+    if (zhe_uristore_store_enc(ZHE_MAX_URIHANDLES + selidx, query, urisz + predsz + 3, &prefixlen) != USR_OK) {
+        sel->codelen = 0;
+        return false;
+    }
+    s->sel = (uint8_t)(selidx + 1);
+    ZT(PUBSUB, "set_selection: %u sid %ju %s", subidx.idx, (uintmax_t)SELECTION_SID(s->sel - 1), predicate);
+    return true;
+#else
+    (void)predicate;
+    return false;
+#endif
+}
+
+unsigned zhe_dispatch(unsigned max)
+{
+    unsigned n = 0;
+#if ZHE_MAX_DELIVERY_QUEUES > 0
+    /* Take one sample from each non-empty queue in turn, so that one busy subscription can't starve
+       the others; stop once all queues have been found empty in a row */
+    uint8_t nempty = 0;
+    while (n < max && nempty < n_delivqs) {
+        struct delivq * const q = &delivqs[delivq_next];
+        if (++delivq_next == n_delivqs) {
+            delivq_next = 0;
+        }
+        if (q->n == 0) {
+            nempty++;
+        } else {
+            const struct subtable * const s = &subs[q->subidx.idx];
+            zhe_paysize_t paysz;
+            const uint8_t *pay = delivq_peek(q, &paysz);
+            /* the handler may unsubscribe, freeing the queue (and even handing it to another
+               subscription), so only pop if it still holds the sample */
+            delivq_dispatching = q;
+            s->handler(s->rid, pay, paysz, s->arg);
+            if (delivq_dispatching == q) {
+                delivq_pop(q, paysz);
+            }
+            delivq_dispatching = NULL;
+            nempty = 0;
+            n++;
+        }
+    }
+#else
+    (void)max;
+#endif
+    return n;
 }
 
 int zhe_write(zhe_pubidx_t pubidx, const void *data, zhe_paysize_t sz, zhe_time_t tnow)
@@ -662,23 +2168,44 @@ int zhe_write(zhe_pubidx_t pubidx, const void *data, zhe_paysize_t sz, zhe_time_
     /* returns 0 on failure and 1 on success; the only defined failure case is a full transmit
      window for reliable pulication while remote subscribers exist */
     struct out_conduit * const oc = pubs[pubidx.idx].oc;
-    int relflag;
+    int relflag, keeplast;
     zhe_assert(pubs[pubidx.idx].rid != 0);
     if (!zhe_bitset_test(pubs_rsubs, pubidx.idx)) {
         /* success is assured if there are no subscribers */
         return 1;
     }
+#if MAX_PEERS > 0 && ZHE_MAX_RSELECTIONS > 0
+    if (n_rsels > 0 && !rsel_wanted(pubs[pubidx.idx].rid, data, sz)) {
+        /* nor if all subscribers select samples and none selects this one */
+        return 1;
+    }
+#endif
 
     relflag = zhe_bitset_test(pubs_isrel, pubidx.idx);
-
+    keeplast = zhe_bitset_test(pubs_keeplast, pubidx.idx);
     if (zhe_oc_am_draining_window(oc)) {
         return !relflag;
     } else if (!zhe_oc_pack_msdata(oc, relflag, pubs[pubidx.idx].rid, sz, tnow)) {
         /* for reliable, a full window means failure; for unreliable it is a non-issue */
         return !relflag;
     } else {
+        const seq_t seq = zhe_oc_get_nextseq(oc);
         zhe_oc_pack_msdata_payload(oc, relflag, sz, data);
         zhe_oc_pack_msdata_done(oc, relflag, tnow);
+        if (keeplast) {
+            /* the previous sample is no longer of interest now that this one went out, so reclaim
+               its space in the window */
+            if (pubs[pubidx.idx].lastseq_valid) {
+                (void)zhe_oc_supersede(oc, pubs[pubidx.idx].lastseq, pubs[pubidx.idx].rid);
+            }
+            pubs[pubidx.idx].lastseq = seq;
+            pubs[pubidx.idx].lastseq_valid = true;
+        }
+#if XMITW_SAMPLE_LIFESPAN
+        if (relflag && pubs[pubidx.idx].lifespan != 0) {
+            zhe_oc_set_expiry(oc, seq, tnow + (zhe_time_t)pubs[pubidx.idx].lifespan);
+        }
+#endif
 #if LATENCY_BUDGET == 0
         zhe_pack_msend();
 #endif
@@ -687,6 +2214,21 @@ int zhe_write(zhe_pubidx_t pubidx, const void *data, zhe_paysize_t sz, zhe_time_
     }
 }
 
+#if ZHE_MAX_URIBINDINGS > 0
+static int write_bound(struct out_conduit *oc, zhe_rid_t rid, const void *data, zhe_paysize_t sz, zhe_time_t tnow)
+{
+    if (!zhe_oc_pack_msdata(oc, 1, rid, sz, tnow)) {
+        return 0;
+    }
+    zhe_oc_pack_msdata_payload(oc, 1, sz, data);
+    zhe_oc_pack_msdata_done(oc, 1, tnow);
+#if LATENCY_BUDGET == 0
+    zhe_pack_msend();
+#endif
+    return 1;
+}
+#endif
+
 int zhe_write_uri(const char *uri, const void *data, zhe_paysize_t sz, zhe_time_t tnow)
 {
     if (!zhe_out_conduit_is_connected(0, 0)) {
@@ -700,7 +2242,15 @@ int zhe_write_uri(const char *uri, const void *data, zhe_paysize_t sz, zhe_time_
         }
         if (zhe_oc_am_draining_window(oc)) {
             return 0;
-        } else if (!zhe_oc_pack_mwdata(oc, 1, (zhe_paysize_t)urisz, uri, sz, tnow)) {
+        }
+#if ZHE_MAX_URIBINDINGS > 0
+        const uint32_t h = zhe_uristore_urihash((const uint8_t *)uri, urisz);
+        const zhe_rid_t rid = uribind_lookup(h, (const uint8_t *)uri, (zhe_paysize_t)urisz, oc, tnow);
+        if (rid != 0) {
+            return write_bound(oc, rid, data, sz, tnow);
+        }
+#endif
+        if (!zhe_oc_pack_mwdata(oc, 1, (zhe_paysize_t)urisz, uri, sz, tnow)) {
             return 0;
         } else {
             zhe_oc_pack_msdata_payload(oc, 1, sz, data);
@@ -713,3 +2263,97 @@ int zhe_write_uri(const char *uri, const void *data, zhe_paysize_t sz, zhe_time_
         }
     }
 }
+
+#if ZHE_MAX_URIHANDLES > 0
+/* URIs prepared for writing: the URI is checked once and stored in the URI store already encoded
+   as in a WriteData, so that writing only needs to copy it into the packet. The hash used for
+   binding URIs to ids is computed once as well, and once bound, the id is remembered here. */
+struct urihandle {
+    struct out_conduit *oc;       /* NULL for a free handle */
+    uint32_t urihash;
+    zhe_paysize_t prefixlen;      /* length of the encoded length preceding the URI */
+    cid_t cid;
+    uint8_t reliable;
+#if ZHE_MAX_URIBINDINGS > 0
+    zhe_rid_t rid;                /* id bound to the URI, 0 if none (yet) */
+#endif
+};
+static struct urihandle urihandles[ZHE_MAX_URIHANDLES];
+#endif
+
+zhe_uri_handle_t zhe_prepare_uri(const char *uri, unsigned cid, int reliable)
+{
+    zhe_uri_handle_t handle;
+#if ZHE_MAX_URIHANDLES > 0
+    const size_t urisz = strlen(uri);
+    zhe_assert(cid < N_OUT_CONDUITS);
+    for (handle.idx = 0; handle.idx < ZHE_MAX_URIHANDLES; handle.idx++) {
+        if (urihandles[handle.idx].oc == NULL) {
+            break;
+        }
+    }
+    if (handle.idx < ZHE_MAX_URIHANDLES) {
+        struct urihandle * const h = &urihandles[handle.idx];
+        if (zhe_uristore_store_enc(handle.idx, (const uint8_t *)uri, urisz, &h->prefixlen) != USR_OK) {
+            ZT(PUBSUB, "prepare_uri: %s failed", uri);
+            handle.idx = ZHE_MAX_URIHANDLES;
+        } else {
+            h->urihash = zhe_uristore_urihash((const uint8_t *)uri, urisz);
+            h->cid = (cid_t)cid;
+            h->reliable = (reliable != 0);
+            /* FIXME: horrible hack ... */
+            h->oc = zhe_out_conduit_from_cid(0, (cid_t)cid);
+#if ZHE_MAX_URIBINDINGS > 0
+            h->rid = 0;
+#endif
+            ZT(PUBSUB, "prepare_uri: %u %s", (unsigned)handle.idx, uri);
+        }
+    }
+#else
+    handle.idx = ZHE_MAX_URIHANDLES;
+#endif
+    return handle;
+}
+
+int zhe_write_handle(zhe_uri_handle_t handle, const void *data, zhe_paysize_t sz, zhe_time_t tnow)
+{
+#if ZHE_MAX_URIHANDLES > 0
+    const struct urihandle * const h = &urihandles[handle.idx];
+    zhe_assert(handle.idx < ZHE_MAX_URIHANDLES && h->oc != NULL);
+    if (!zhe_out_conduit_is_connected(0, h->cid)) {
+        return 1;
+    } else if (zhe_oc_am_draining_window(h->oc)) {
+        return !h->reliable;
+    }
+#if ZHE_MAX_URIBINDINGS > 0
+    /* Binding declarations go out on reliable conduit 0, so they can only be relied upon for data
+       written reliably on that same conduit */
+    if (h->rid != 0) {
+        return write_bound(h->oc, h->rid, data, sz, tnow);
+    }
+#endif
+    zhe_paysize_t enclen;
+    const uint8_t * const enc = zhe_uristore_get_enc(handle.idx, &enclen);
+#if ZHE_MAX_URIBINDINGS > 0
+    if (h->cid == 0 && h->reliable) {
+        const zhe_rid_t rid = uribind_lookup(h->urihash, enc + h->prefixlen, (zhe_paysize_t)(enclen - h->prefixlen), h->oc, tnow);
+        if (rid != 0) {
+            urihandles[handle.idx].rid = rid;
+            return write_bound(h->oc, rid, data, sz, tnow);
+        }
+    }
+#endif
+    if (!zhe_oc_pack_mwdata_enc(h->oc, h->reliable, enclen, enc, sz, tnow)) {
+        return !h->reliable;
+    }
+    zhe_oc_pack_mwdata_payload(h->oc, h->reliable, sz, data);
+    zhe_oc_pack_mwdata_done(h->oc, h->reliable, tnow);
+#if LATENCY_BUDGET == 0
+    zhe_pack_msend();
+#endif
+    return 1;
+#else
+    zhe_assert(0);
+    return 0;
+#endif
+}
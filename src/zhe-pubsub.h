@@ -26,20 +26,41 @@
 #define WC_DPUB_SIZE        (1 + WC_RID_SIZE) /* pub: header, rid (not using properties) */
 #define WC_DSUB_SIZE        (2 + WC_RID_SIZE) /* sub: header, rid, mode (neither properties nor periodic modes) */
 
+/* Errors in declarations received, combined in the status of the commit. Fatal ones mean the
+   peers disagree about the declarations; the others only mean this node couldn't store some of
+   them, which needn't stop it from committing the rest when the peer doesn't wait for a RESULT */
+#define DECLERR_SUBMODE     1u  /* unsupported subscription mode (fatal) */
+#define DECLERR_RSUB        2u  /* subscription that can't be recorded */
+#define DECLERR_SELECTION   4u  /* selection on an unknown resource */
+#define DECLERR_URISTORE   16u  /* resource that can't be stored */
+#define DECLERR_URIMISMATCH 32u /* resource already declared with a different URI (fatal) */
+#define DECLERR_FATAL (DECLERR_SUBMODE | DECLERR_URIMISMATCH)
+#define DECLERR_ANY   0xffu
+
 void zhe_decl_note_error_curpkt(uint8_t bitmask, zhe_rid_t rid);
-int zhe_handle_msdata_deliver(zhe_rid_t prid, zhe_paysize_t paysz, const void *pay);
+void zhe_decl_note_result(uint8_t commitid);
+bool zhe_decl_results_done(void);
+int zhe_handle_msdata_deliver(peeridx_t peeridx, zhe_rid_t prid, zhe_paysize_t paysz, const void *pay);
 #if ZHE_MAX_URISPACE > 0
 int zhe_handle_mwdata_deliver(zhe_paysize_t urisz, const uint8_t *uri, zhe_paysize_t paysz, const void *pay);
 #endif
 
 void zhe_rsub_register(peeridx_t peeridx, zhe_rid_t rid, uint8_t submode);
-uint8_t zhe_rsub_precommit(peeridx_t peeridx, zhe_rid_t *err_rid);
+uint8_t zhe_rsub_precommit(peeridx_t peeridx, uint8_t failmask, zhe_rid_t *err_rid);
 void zhe_rsub_commit(peeridx_t peeridx);
 void zhe_rsub_precommit_curpkt_abort(peeridx_t peeridx);
 void zhe_rsub_clear(peeridx_t peeridx);
 void zhe_rsub_precommit_curpkt_done(peeridx_t peeridx);
+void zhe_rsub_unregister(peeridx_t peeridx, zhe_rid_t rid);
+#if MAX_PEERS > 0 && ZHE_MAX_URISPACE > 0
+bool zhe_rsel_register(peeridx_t peeridx, zhe_rid_t sid, const uint8_t *query, zhe_paysize_t querylen);
+#endif
+#if MAX_PEERS > 0 && ZHE_MAX_RSELECTIONS > 0
+void zhe_rsel_unregister(peeridx_t peeridx, zhe_rid_t sid);
+#endif
 
 void zhe_send_declares(zhe_time_t tnow);
+bool zhe_send_declares_done(void);
 
 void zhe_accept_peer_sched_hist_decls(peeridx_t peeridx);
 void zhe_reset_peer_unsched_hist_decls(peeridx_t peeridx);
@@ -24,8 +24,13 @@ enum zhe_unpack_result zhe_unpack_byte(uint8_t const * const end, uint8_t const
     return ZUR_OK;
 }
 
-#define DEF_UNPACK_VLE(size_) \
-enum zhe_unpack_result zhe_unpack_vle##size_(uint8_t const * const end, uint8_t const * * const data, uint##size_##_t * restrict u) \
+/* Maximum number of bytes in a VLE encoding of an N-bit number */
+#define VLE_MAXLEN(n_) (((n_) + 6) / 7)
+
+/* Generic VLE decoding: checks bounds on every byte, and tolerates (and checks) encodings padded
+   beyond the size of the type */
+#define DEF_UNPACK_VLE_GENERIC(size_) \
+static enum zhe_unpack_result unpack_vle##size_##_generic(uint8_t const * const end, uint8_t const * * const data, uint##size_##_t * restrict u) \
 { \
     uint##size_##_t n; \
     uint8_t shift = 7; \
@@ -60,6 +65,52 @@ enum zhe_unpack_result zhe_unpack_vle##size_(uint8_t const * const end, uint8_t
         return (overflow ? ZUR_OVERFLOW : ZUR_OK); \
     } \
 }
+DEF_UNPACK_VLE_GENERIC(8)
+DEF_UNPACK_VLE_GENERIC(16)
+DEF_UNPACK_VLE_GENERIC(32)
+#if ZHE_RID_SIZE > 32 || SEQNUM_LEN > 28
+DEF_UNPACK_VLE_GENERIC(64)
+#endif
+#undef DEF_UNPACK_VLE_GENERIC
+
+/* Sequence numbers, resource ids and lengths nearly always take 1 or 2 bytes, so those are
+   decoded directly; and if the input is known to extend beyond all but the last byte a
+   value can occupy, no bounds checks are needed until then. Anything else (the longest
+   encodings, which may overflow; and input near the end of the packet) goes the generic way. */
+#define DEF_UNPACK_VLE(size_) \
+enum zhe_unpack_result zhe_unpack_vle##size_(uint8_t const * const end, uint8_t const * * const data, uint##size_##_t * restrict u) \
+{ \
+    const uint8_t *p = *data; \
+    if (end - p >= VLE_MAXLEN(size_) - 1) { \
+        uint##size_##_t n; \
+        if (!(p[0] & 0x80)) { \
+            n = p[0]; \
+            p += 1; \
+        } else if (size_ > 8 && !(p[1] & 0x80)) { \
+            n = (uint##size_##_t)((p[0] & 0x7f) | ((uint##size_##_t)p[1] << 7)); \
+            p += 2; \
+        } else { \
+            int i = 0; \
+            uint8_t x; \
+            n = 0; \
+            do { \
+                x = p[i]; \
+                n |= (uint##size_##_t)((uint##size_##_t)(x & 0x7f) << (7 * i)); \
+                i++; \
+            } while ((x & 0x80) && i < VLE_MAXLEN(size_) - 1); \
+            if (x & 0x80) { \
+                return unpack_vle##size_##_generic(end, data, u); \
+            } \
+            p += i; \
+        } \
+        *data = p; \
+        if (u) { \
+            *u = n; \
+        } \
+        return ZUR_OK; \
+    } \
+    return unpack_vle##size_##_generic(end, data, u); \
+}
 DEF_UNPACK_VLE(8)
 DEF_UNPACK_VLE(16)
 DEF_UNPACK_VLE(32)
@@ -18,17 +18,410 @@ static union {
 struct restable {
     zhe_rid_t rid;
     uripos_t uripos;
+    uint32_t urihash;
     uint8_t reliable: 1;
     uint8_t transient: 1;
+    uint8_t pattern: 1;           /* in the pattern trie rather than in the URI hash index */
+#if ZHE_MAX_URIPATTERN_NODES > 0
+    zhe_residx_t nextpat;         /* next resource with a pattern ending in the same trie node */
+#endif
     DECL_BITSET(peers, MAX_PEERS_1 + 1); /* self is MAX_PEERS_1 */
 };
 static struct restable ress[ZHE_MAX_RESOURCES];
 static zhe_residx_t max_residx;
 
+/* Every node picks the ids for binding URIs (see zhe_write_uri) from the top ZHE_URIBIND_RIDS ids
+   by itself, so different nodes may well bind different URIs to the same id. Resources with such
+   an id are scoped to the peers that declared them: a conflicting declaration by another peer is a
+   resource of its own, and only one declared by the same peer is a mismatch. Bindings are per peer
+   already, so data on such an id is still delivered as data written to the right URI. */
+#if defined(ZHE_URIBIND_RIDS) && (ZHE_MAX_URIBINDINGS > 0 || ZHE_MAX_RBINDINGS > 0)
+#define RID_PER_PEER(rid) ((rid) > ZHE_MAX_RID - ZHE_URIBIND_RIDS)
+#else
+#define RID_PER_PEER(rid) false
+#endif
+
+#if ZHE_URISTORE_ENC_SLOTS > 0
+/* Positions of the encoded strings: the URIs prepared for writing and the queries of selections,
+   these are in the store with reference ZHE_MAX_RESOURCES + slot */
+static uripos_t encpos[ZHE_URISTORE_ENC_SLOTS];
+#endif
+
+#if ZHE_MAX_RBINDINGS > 0
+/* Bindings declared by peers (DBINDID): data a peer publishes on "rid" is to be delivered as data
+   written to the URI of resource "residx" */
+struct rbinding {
+    zhe_rid_t rid;
+    zhe_residx_t residx;
+    peeridx_t peeridx;
+};
+static struct rbinding rbinds[ZHE_MAX_RBINDINGS];
+static unsigned n_rbinds;
+
+/* Removes the bindings of peeridx, to resource idx or, if idx is RESIDX_NONE, to any resource */
+static void rbinds_remove(peeridx_t peeridx, zhe_residx_t idx);
+#endif
+
+/* Open-addressing hash table with linear probing from URI to the resource(s) with that URI, so
+   that looking up a URI costs a hash of it plus, normally, a single comparison. Each resource
+   occurs at most once, hence twice the number of resources guarantees an empty slot to terminate
+   probing. */
+#define URIHASH_SIZE (2 * ZHE_MAX_RESOURCES)
+#define RESIDX_NONE ((zhe_residx_t)ZHE_MAX_RESOURCES)
+static zhe_residx_t uriidx[URIHASH_SIZE];
+
+static uint32_t uri_hash(const uint8_t *uri, size_t urilen)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < urilen; i++) {
+        h = (h ^ uri[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void uriidx_insert(zhe_residx_t idx)
+{
+    unsigned pos = ress[idx].urihash % URIHASH_SIZE;
+    while (uriidx[pos] != RESIDX_NONE) {
+        pos = (pos + 1) % URIHASH_SIZE;
+    }
+    uriidx[pos] = idx;
+}
+
+static void uriidx_remove(zhe_residx_t idx)
+{
+    unsigned i = ress[idx].urihash % URIHASH_SIZE, j;
+    while (uriidx[i] != idx) {
+        zhe_assert(uriidx[i] != RESIDX_NONE);
+        i = (i + 1) % URIHASH_SIZE;
+    }
+    /* Backward-shift deletion, as for the peer tables in zhe.c */
+    j = i;
+    while (1) {
+        j = (j + 1) % URIHASH_SIZE;
+        if (uriidx[j] == RESIDX_NONE) {
+            break;
+        }
+        const unsigned k = ress[uriidx[j]].urihash % URIHASH_SIZE;
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        uriidx[i] = uriidx[j];
+        i = j;
+    }
+    uriidx[i] = RESIDX_NONE;
+}
+
+#if ZHE_MAX_URIPATTERN_NODES > 0
+/* URIs containing the wildcards "?" (any character but the path separator), "*" (any number of
+   characters excluding the path separator) or "**" (any number of characters including the path
+   separator) are patterns. Instead of in the hash index, these are stored in a trie of path
+   segments, in which literal segments are represented by their hash, segments containing "**"
+   match any number of segments and other segments containing wildcards match any one segment.
+   One walk over the segments of a URI thus gives the candidate patterns, each of which is then
+   verified by matching the URI against the full pattern. */
+#if ZHE_MAX_URIPATTERN_NODES < UINT8_MAX
+typedef uint8_t urinode_idx_t;
+#else
+typedef uint16_t urinode_idx_t;
+#endif
+#define URINODE_NONE ((urinode_idx_t)ZHE_MAX_URIPATTERN_NODES)
+#define URINODE_ROOT 0
+
+enum uriseg_kind {
+    USK_LITERAL,
+    USK_ONE,                      /* matches any one segment */
+    USK_ANY                       /* matches any number of segments, including none */
+};
+
+struct urinode {
+    uint32_t hash;                /* hash of the segment, if kind is USK_LITERAL */
+    uint8_t kind;
+    zhe_residx_t refc;            /* number of patterns passing through this node */
+    zhe_residx_t res;             /* first of the resources with a pattern ending here */
+    urinode_idx_t child, sibling; /* the free nodes are linked through sibling */
+};
+static struct urinode urinodes[ZHE_MAX_URIPATTERN_NODES];
+static urinode_idx_t urinode_free;
+static urinode_idx_t urinode_nfree;
+
+static size_t uriseg_len(const uint8_t *uri, size_t urilen, size_t pos)
+{
+    const uint8_t *sep = memchr(uri + pos, '/', urilen - pos);
+    return (sep == NULL) ? urilen - pos : (size_t)(sep - (uri + pos));
+}
+
+static enum uriseg_kind uriseg_kind(const uint8_t *seg, size_t seglen, uint32_t *hash)
+{
+    enum uriseg_kind kind = USK_LITERAL;
+    for (size_t i = 0; i < seglen; i++) {
+        if (seg[i] == '*' && i + 1 < seglen && seg[i + 1] == '*') {
+            return USK_ANY;
+        } else if (seg[i] == '*' || seg[i] == '?') {
+            kind = USK_ONE;
+        }
+    }
+    if (kind == USK_LITERAL) {
+        *hash = uri_hash(seg, seglen);
+    }
+    return kind;
+}
+
+static bool uri_is_pattern(const uint8_t *uri, size_t urilen)
+{
+    return memchr(uri, '*', urilen) != NULL || memchr(uri, '?', urilen) != NULL;
+}
+
+/* Child of node n for segment kind and hash, URINODE_NONE if it doesn't exist */
+static urinode_idx_t urinode_find_child(urinode_idx_t n, enum uriseg_kind kind, uint32_t hash)
+{
+    urinode_idx_t c;
+    for (c = urinodes[n].child; c != URINODE_NONE; c = urinodes[c].sibling) {
+        if (urinodes[c].kind == kind && (kind != USK_LITERAL || urinodes[c].hash == hash)) {
+            break;
+        }
+    }
+    return c;
+}
+
+/* Walks the path of pattern uri through the trie, creating the missing nodes if create is set;
+   returns the final node, or, if not creating, the number of missing nodes in *missing */
+static urinode_idx_t urinode_walk(const uint8_t *uri, size_t urilen, bool create, size_t *missing)
+{
+    urinode_idx_t n = URINODE_ROOT;
+    *missing = 0;
+    for (size_t pos = 0; pos <= urilen; ) {
+        const size_t seglen = uriseg_len(uri, urilen, pos);
+        uint32_t hash = 0;
+        const enum uriseg_kind kind = uriseg_kind(uri + pos, seglen, &hash);
+        urinode_idx_t c = (n == URINODE_NONE) ? URINODE_NONE : urinode_find_child(n, kind, hash);
+        if (c == URINODE_NONE) {
+            if (!create) {
+                (*missing)++;
+            } else {
+                c = urinode_free;
+                zhe_assert(c != URINODE_NONE);
+                urinode_free = urinodes[c].sibling;
+                urinode_nfree--;
+                urinodes[c].hash = hash;
+                urinodes[c].kind = (uint8_t)kind;
+                urinodes[c].refc = 0;
+                urinodes[c].res = RESIDX_NONE;
+                urinodes[c].child = URINODE_NONE;
+                urinodes[c].sibling = urinodes[n].child;
+                urinodes[n].child = c;
+            }
+        }
+        if (create) {
+            urinodes[c].refc++;
+        }
+        n = c;
+        pos += seglen + 1;
+    }
+    return n;
+}
+
+static void urinode_insert(zhe_residx_t idx, const uint8_t *uri, size_t urilen)
+{
+    size_t missing;
+    const urinode_idx_t n = urinode_walk(uri, urilen, true, &missing);
+    urinodes[URINODE_ROOT].refc++;
+    ress[idx].nextpat = urinodes[n].res;
+    urinodes[n].res = idx;
+}
+
+static void urinode_remove(zhe_residx_t idx, const uint8_t *uri, size_t urilen)
+{
+    urinode_idx_t n = URINODE_ROOT;
+    bool freeing = false;
+    urinodes[URINODE_ROOT].refc--;
+    for (size_t pos = 0; pos <= urilen; ) {
+        const size_t seglen = uriseg_len(uri, urilen, pos);
+        uint32_t hash = 0;
+        const enum uriseg_kind kind = uriseg_kind(uri + pos, seglen, &hash);
+        const urinode_idx_t c = urinode_find_child(n, kind, hash);
+        zhe_assert(c != URINODE_NONE);
+        if (--urinodes[c].refc == 0 && !freeing) {
+            /* the rest of the path is used by this pattern only: unlink it from the trie */
+            urinode_idx_t *p = &urinodes[n].child;
+            while (*p != c) {
+                p = &urinodes[*p].sibling;
+            }
+            *p = urinodes[c].sibling;
+            freeing = true;
+        }
+        if (pos + seglen >= urilen) {
+            /* final node: remove resource from list of patterns ending here */
+            zhe_residx_t *r = &urinodes[c].res;
+            while (*r != idx) {
+                zhe_assert(*r != RESIDX_NONE);
+                r = &ress[*r].nextpat;
+            }
+            *r = ress[idx].nextpat;
+        }
+        if (freeing) {
+            zhe_assert(urinodes[c].refc == 0);
+            urinodes[c].sibling = urinode_free;
+            urinode_free = c;
+            urinode_nfree++;
+        }
+        n = c;
+        pos += seglen + 1;
+    }
+}
+
+/* Whether uri matches pattern pat, by dynamic programming over the characters of the pattern:
+   m[j] is true iff the pattern so far matches the first j characters of the URI */
+static bool uri_pattern_match(const uint8_t *pat, size_t patlen, const uint8_t *uri, size_t urilen)
+{
+    static bool m[2][ZHE_MAX_URILENGTH + 1];
+    bool *cur = m[0], *next = m[1];
+    if (urilen > ZHE_MAX_URILENGTH) {
+        return false;
+    }
+    cur[0] = true;
+    for (size_t j = 1; j <= urilen; j++) {
+        cur[j] = false;
+    }
+    for (size_t i = 0; i < patlen; i++) {
+        if (pat[i] == '*') {
+            const bool any = (i + 1 < patlen && pat[i + 1] == '*');
+            if (any) {
+                i++;
+            }
+            next[0] = cur[0];
+            for (size_t j = 1; j <= urilen; j++) {
+                next[j] = cur[j] || (next[j - 1] && (any || uri[j - 1] != '/'));
+            }
+        } else {
+            next[0] = false;
+            for (size_t j = 1; j <= urilen; j++) {
+                next[j] = cur[j - 1] && (pat[i] == '?' ? uri[j - 1] != '/' : uri[j - 1] == pat[i]);
+            }
+        }
+        bool * const t = cur; cur = next; next = t;
+    }
+    return cur[urilen];
+}
+
+/* Adds node n to the set of active nodes, and with it, the nodes reachable from it without
+   consuming a segment */
+static void urinode_activate(urinode_idx_t *set, urinode_idx_t *nset, uint8_t *seen, urinode_idx_t n)
+{
+    urinode_idx_t i = *nset;
+    if (zhe_bitset_test(seen, n)) {
+        return;
+    }
+    zhe_bitset_set(seen, n);
+    set[(*nset)++] = n;
+    for (; i < *nset; i++) {
+        for (urinode_idx_t c = urinodes[set[i]].child; c != URINODE_NONE; c = urinodes[c].sibling) {
+            if (urinodes[c].kind == USK_ANY && !zhe_bitset_test(seen, c)) {
+                zhe_bitset_set(seen, c);
+                set[(*nset)++] = c;
+            }
+        }
+    }
+}
+
+static void urinode_foreach_match(const uint8_t *uri, zhe_paysize_t urilen, void (*f)(zhe_rid_t rid, void *arg), void *arg)
+{
+    static urinode_idx_t sets[2][ZHE_MAX_URIPATTERN_NODES];
+    static DECL_BITSET(seen, ZHE_MAX_URIPATTERN_NODES);
+    urinode_idx_t *cur = sets[0], *next = sets[1];
+    urinode_idx_t ncur = 0, nnext;
+    if (urinodes[URINODE_ROOT].refc == 0) {
+        return;
+    }
+    memset(seen, 0, sizeof(seen));
+    urinode_activate(cur, &ncur, seen, URINODE_ROOT);
+    for (size_t pos = 0; pos <= urilen && ncur > 0; ) {
+        const size_t seglen = uriseg_len(uri, urilen, pos);
+        const uint32_t hash = uri_hash(uri + pos, seglen);
+        memset(seen, 0, sizeof(seen));
+        nnext = 0;
+        for (urinode_idx_t i = 0; i < ncur; i++) {
+            const urinode_idx_t n = cur[i];
+            if (urinodes[n].kind == USK_ANY) {
+                urinode_activate(next, &nnext, seen, n);
+            }
+            for (urinode_idx_t c = urinodes[n].child; c != URINODE_NONE; c = urinodes[c].sibling) {
+                if (urinodes[c].kind != USK_LITERAL || urinodes[c].hash == hash) {
+                    urinode_activate(next, &nnext, seen, c);
+                }
+            }
+        }
+        urinode_idx_t * const t = cur; cur = next; next = t;
+        ncur = nnext;
+        pos += seglen + 1;
+    }
+    for (urinode_idx_t i = 0; i < ncur; i++) {
+        for (zhe_residx_t idx = urinodes[cur[i]].res; idx != RESIDX_NONE; idx = ress[idx].nextpat) {
+            const uint8_t *pat = uris.store + ress[idx].uripos;
+            if (uri_pattern_match(pat, zhe_icgcb_getsize(&uris.b, pat), uri, urilen)) {
+                f(ress[idx].rid, arg);
+            }
+        }
+    }
+}
+
+static void urinode_init(void)
+{
+    urinodes[URINODE_ROOT].kind = USK_LITERAL;
+    urinodes[URINODE_ROOT].refc = 0;
+    urinodes[URINODE_ROOT].res = RESIDX_NONE;
+    urinodes[URINODE_ROOT].child = URINODE_NONE;
+    urinodes[URINODE_ROOT].sibling = URINODE_NONE;
+    urinode_free = URINODE_NONE;
+    urinode_nfree = 0;
+    for (urinode_idx_t n = ZHE_MAX_URIPATTERN_NODES - 1; n > URINODE_ROOT; n--) {
+        urinodes[n].sibling = urinode_free;
+        urinode_free = n;
+        urinode_nfree++;
+    }
+}
+#endif
+
+#if ZHE_MAX_RBINDINGS > 0
+static void rbinds_remove(peeridx_t peeridx, zhe_residx_t idx)
+{
+    unsigned i = 0;
+    while (i < n_rbinds) {
+        if (rbinds[i].peeridx == peeridx && (idx == RESIDX_NONE || rbinds[i].residx == idx)) {
+            rbinds[i] = rbinds[--n_rbinds];
+        } else {
+            i++;
+        }
+    }
+}
+#endif
+
+static void res_unindex(zhe_residx_t idx)
+{
+#if ZHE_MAX_URIPATTERN_NODES > 0
+    if (ress[idx].pattern) {
+        const uint8_t *uri = uris.store + ress[idx].uripos;
+        urinode_remove(idx, uri, zhe_icgcb_getsize(&uris.b, uri));
+        return;
+    }
+#endif
+    uriidx_remove(idx);
+}
+
 void zhe_uristore_init(void)
 {
     zhe_icgcb_init(&uris.b, sizeof(uris));
     memset(&ress, 0, sizeof(ress));
+    for (unsigned pos = 0; pos < URIHASH_SIZE; pos++) {
+        uriidx[pos] = RESIDX_NONE;
+    }
+#if ZHE_MAX_RBINDINGS > 0
+    n_rbinds = 0;
+#endif
+#if ZHE_MAX_URIPATTERN_NODES > 0
+    urinode_init();
+#endif
 }
 
 static void set_props_one(struct restable * const r, const uint8_t *tag, size_t taglen)
@@ -85,6 +478,8 @@ enum uristore_result zhe_uristore_store(peeridx_t peeridx, zhe_rid_t rid, const
                 zhe_bitset_set(ress[idx].peers, peeridx);
                 ZT(PUBSUB, "uristore_store: match");
                 return USR_OK;
+            } else if (RID_PER_PEER(rid) && !zhe_bitset_test(ress[idx].peers, peeridx)) {
+                ZT(PUBSUB, "uristore_store: different peer");
             } else {
                 ZT(PUBSUB, "uristore_store: mismatch");
                 return USR_MISMATCH;
@@ -97,6 +492,19 @@ enum uristore_result zhe_uristore_store(peeridx_t peeridx, zhe_rid_t rid, const
         ZT(PUBSUB, "uristore_store: no space (max res hit)");
         return USR_NOSPACE;
     }
+#if ZHE_MAX_URIPATTERN_NODES > 0
+    const bool pattern = uri_is_pattern(uri, urilen);
+    if (pattern) {
+        size_t missing;
+        (void)urinode_walk(uri, urilen, false, &missing);
+        if (missing > urinode_nfree) {
+            ZT(PUBSUB, "uristore_store: no space (max pattern nodes hit)");
+            return USR_NOSPACE;
+        }
+    }
+#else
+    const bool pattern = false;
+#endif
     void *ptr;
     switch (zhe_icgcb_alloc(&ptr, &uris.b, urilen, free_idx)) {
         case IAR_OK:
@@ -110,6 +518,7 @@ enum uristore_result zhe_uristore_store(peeridx_t peeridx, zhe_rid_t rid, const
     }
     ress[free_idx].rid = rid;
     ress[free_idx].uripos = (uripos_t)((uint8_t *)ptr - uris.store);
+    ress[free_idx].urihash = uri_hash(uri, urilen_in);
     ress[free_idx].transient = 0;
     ress[free_idx].reliable = 1;
     memset(ress[free_idx].peers, 0, sizeof(ress[free_idx].peers));
@@ -127,7 +536,16 @@ enum uristore_result zhe_uristore_store(peeridx_t peeridx, zhe_rid_t rid, const
     if (free_idx > max_residx) {
         max_residx = free_idx;
     }
-   ZT(PUBSUB, "uristore_store: ok, index %u", (unsigned)free_idx);
+    ress[free_idx].pattern = pattern;
+#if ZHE_MAX_URIPATTERN_NODES > 0
+    if (pattern) {
+        urinode_insert(free_idx, uri, urilen);
+    } else
+#endif
+    {
+        uriidx_insert(free_idx);
+    }
+    ZT(PUBSUB, "uristore_store: ok, index %u", (unsigned)free_idx);
     return USR_OK;
 }
 
@@ -135,8 +553,12 @@ void zhe_uristore_drop(peeridx_t peeridx, zhe_rid_t rid)
 {
     for (zhe_residx_t idx = 0; idx <= max_residx; idx++) {
         if (ress[idx].rid == rid) {
+#if ZHE_MAX_RBINDINGS > 0
+            rbinds_remove(peeridx, idx);
+#endif
             zhe_bitset_clear(ress[idx].peers, peeridx);
             if (zhe_bitset_count(ress[idx].peers, MAX_PEERS_1 + 1) == 0) {
+                res_unindex(idx);
                 zhe_icgcb_free(&uris.b, uris.store + ress[idx].uripos);
                 ress[idx].rid = 0;
             }
@@ -157,14 +579,116 @@ bool zhe_uristore_geturi(unsigned idx, zhe_rid_t *rid, zhe_paysize_t *sz, const
     }
 }
 
+bool zhe_uristore_foreign_binding(unsigned idx)
+{
+    return ress[idx].rid != 0 && RID_PER_PEER(ress[idx].rid) && !zhe_bitset_test(ress[idx].peers, URISTORE_PEERIDX_SELF);
+}
+
+bool zhe_uristore_find(zhe_rid_t rid, zhe_paysize_t *sz, const uint8_t **uri)
+{
+    for (zhe_residx_t idx = 0; idx <= max_residx; idx++) {
+        if (ress[idx].rid == rid && (!RID_PER_PEER(rid) || zhe_bitset_test(ress[idx].peers, URISTORE_PEERIDX_SELF))) {
+            return zhe_uristore_geturi(idx, &rid, sz, uri);
+        }
+    }
+    return false;
+}
+
+uint32_t zhe_uristore_urihash(const uint8_t *uri, size_t urilen)
+{
+    return uri_hash(uri, urilen);
+}
+
+#if ZHE_MAX_RBINDINGS > 0
+bool zhe_uristore_bind(peeridx_t peeridx, zhe_rid_t oldrid, zhe_rid_t newrid)
+{
+    zhe_residx_t idx;
+    unsigned i;
+    for (idx = 0; idx <= max_residx; idx++) {
+        if (ress[idx].rid == oldrid && zhe_bitset_test(ress[idx].peers, peeridx)) {
+            break;
+        }
+    }
+    if (idx > max_residx || ress[idx].rid == 0) {
+        ZT(PUBSUB, "uristore_bind: %ju unknown", (uintmax_t)oldrid);
+        return false;
+    }
+    for (i = 0; i < n_rbinds; i++) {
+        if (rbinds[i].peeridx == peeridx && rbinds[i].rid == newrid) {
+            break;
+        }
+    }
+    if (i == n_rbinds) {
+        if (n_rbinds == ZHE_MAX_RBINDINGS) {
+            ZT(PUBSUB, "uristore_bind: no space");
+            return false;
+        }
+        n_rbinds++;
+    }
+    ZT(PUBSUB, "uristore_bind: peer %u %ju -> %ju", (unsigned)peeridx, (uintmax_t)newrid, (uintmax_t)oldrid);
+    rbinds[i].rid = newrid;
+    rbinds[i].residx = idx;
+    rbinds[i].peeridx = peeridx;
+    return true;
+}
+
+bool zhe_uristore_getbound(peeridx_t peeridx, zhe_rid_t rid, zhe_paysize_t *sz, const uint8_t **uri)
+{
+    for (unsigned i = 0; i < n_rbinds; i++) {
+        if (rbinds[i].rid == rid && rbinds[i].peeridx == peeridx) {
+            zhe_rid_t dummy;
+            return zhe_uristore_geturi(rbinds[i].residx, &dummy, sz, uri);
+        }
+    }
+    return false;
+}
+#endif
+
+bool zhe_uristore_lookup_uri(peeridx_t peeridx, const uint8_t *uri, zhe_paysize_t urilen, zhe_rid_t *rid)
+{
+    const uint32_t h = uri_hash(uri, urilen);
+    unsigned pos = h % URIHASH_SIZE;
+    zhe_residx_t idx;
+    while ((idx = uriidx[pos]) != RESIDX_NONE) {
+        const struct restable * const r = &ress[idx];
+        if (r->urihash == h && zhe_bitset_test(r->peers, peeridx) && zhe_icgcb_getsize(&uris.b, uris.store + r->uripos) == urilen && memcmp(uris.store + r->uripos, uri, urilen) == 0) {
+            *rid = r->rid;
+            return true;
+        }
+        pos = (pos + 1) % URIHASH_SIZE;
+    }
+    return false;
+}
+
+void zhe_uristore_foreach_uri(const uint8_t *uri, zhe_paysize_t urilen, void (*f)(zhe_rid_t rid, void *arg), void *arg)
+{
+    const uint32_t h = uri_hash(uri, urilen);
+    unsigned pos = h % URIHASH_SIZE;
+    zhe_residx_t idx;
+    while ((idx = uriidx[pos]) != RESIDX_NONE) {
+        const struct restable * const r = &ress[idx];
+        if (r->urihash == h && zhe_icgcb_getsize(&uris.b, uris.store + r->uripos) == urilen && memcmp(uris.store + r->uripos, uri, urilen) == 0) {
+            f(r->rid, arg);
+        }
+        pos = (pos + 1) % URIHASH_SIZE;
+    }
+#if ZHE_MAX_URIPATTERN_NODES > 0
+    urinode_foreach_match(uri, urilen, f, arg);
+#endif
+}
+
 void zhe_uristore_reset_peer(peeridx_t peeridx)
 {
+#if ZHE_MAX_RBINDINGS > 0
+    rbinds_remove(peeridx, RESIDX_NONE);
+#endif
     /* FIXME: find a better way */
     for (zhe_residx_t idx = 0; idx <= max_residx; idx++) {
         if (ress[idx].rid !=0 && zhe_bitset_test(ress[idx].peers, peeridx)) {
             zhe_bitset_clear(ress[idx].peers, peeridx);
             if (zhe_bitset_count(ress[idx].peers, MAX_PEERS_1 + 1) == 0) {
                 ZT(PUBSUB, "uristore_reset_peer: drop %ju", (uintmax_t)ress[idx].rid);
+                res_unindex(idx);
                 zhe_icgcb_free(&uris.b, uris.store + ress[idx].uripos);
                 ress[idx].rid = 0;
             }
@@ -172,8 +696,58 @@ void zhe_uristore_reset_peer(peeridx_t peeridx)
     }
 }
 
+#if ZHE_URISTORE_ENC_SLOTS > 0
+enum uristore_result zhe_uristore_store_enc(unsigned slot, const uint8_t *uri, size_t urilen, zhe_paysize_t *prefixlen)
+{
+    uint8_t prefix[3];
+    size_t n = 0, x = urilen;
+    zhe_assert(slot < ZHE_URISTORE_ENC_SLOTS);
+    if (urilen > ZHE_MAX_URILENGTH) {
+        return USR_OVERSIZE;
+    }
+    /* VLE-encoded length, as in a WriteData */
+    do {
+        prefix[n++] = (uint8_t)((x & 0x7f) | ((x > 127) ? 0x80 : 0));
+        x >>= 7;
+    } while (x != 0);
+    void *ptr;
+    switch (zhe_icgcb_alloc(&ptr, &uris.b, (uripos_t)(n + urilen), (uripos_t)(ZHE_MAX_RESOURCES + slot))) {
+        case IAR_OK:
+            break;
+        case IAR_AGAIN:
+            return USR_AGAIN;
+        case IAR_NOSPACE:
+            return USR_NOSPACE;
+    }
+    memcpy(ptr, prefix, n);
+    memcpy((uint8_t *)ptr + n, uri, urilen);
+    encpos[slot] = (uripos_t)((uint8_t *)ptr - uris.store);
+    *prefixlen = (zhe_paysize_t)n;
+    return USR_OK;
+}
+
+const uint8_t *zhe_uristore_get_enc(unsigned slot, zhe_paysize_t *enclen)
+{
+    const uint8_t * const enc = uris.store + encpos[slot];
+    *enclen = zhe_icgcb_getsize(&uris.b, enc);
+    return enc;
+}
+
+void zhe_uristore_free_enc(unsigned slot)
+{
+    zhe_assert(slot < ZHE_URISTORE_ENC_SLOTS);
+    zhe_icgcb_free(&uris.b, uris.store + encpos[slot]);
+}
+#endif
+
 static void move_cb(uripos_t ref, void *newptr, void *arg)
 {
+#if ZHE_URISTORE_ENC_SLOTS > 0
+    if (ref >= ZHE_MAX_RESOURCES) {
+        encpos[ref - ZHE_MAX_RESOURCES] = (uripos_t)((uint8_t *)newptr - uris.store);
+        return;
+    }
+#endif
     ress[ref].uripos = (uripos_t)((uint8_t *)newptr - uris.store);
 }
 
@@ -29,6 +29,38 @@ void zhe_uristore_drop(peeridx_t peeridx, zhe_rid_t rid);
 void zhe_uristore_reset_peer(peeridx_t peeridx);
 /* FIXME: need a proper type for the cursor */
 bool zhe_uristore_geturi(unsigned idx, zhe_rid_t *rid, zhe_paysize_t *sz, const uint8_t **uri);
+/* True if resource idx is one of the ids another node bound a URI to, which only that node
+   may declare */
+bool zhe_uristore_foreign_binding(unsigned idx);
+/* Looks up the URI of resource rid, returning false if there is no such resource; for an id in
+   the range used for binding URIs, that is the URI this node bound to it */
+bool zhe_uristore_find(zhe_rid_t rid, zhe_paysize_t *sz, const uint8_t **uri);
+/* Hash of a URI as used by the URI store */
+uint32_t zhe_uristore_urihash(const uint8_t *uri, size_t urilen);
+#if ZHE_MAX_RBINDINGS > 0
+/* Records that data published by peeridx on newrid is data for the URI of resource oldrid (as
+   declared by that peer); returns false if unknown or out of space */
+bool zhe_uristore_bind(peeridx_t peeridx, zhe_rid_t oldrid, zhe_rid_t newrid);
+/* Looks up the URI bound to rid by peeridx, returning false if there is none */
+bool zhe_uristore_getbound(peeridx_t peeridx, zhe_rid_t rid, zhe_paysize_t *sz, const uint8_t **uri);
+#endif
+/* Encoded strings (the length followed by the string, as in a WriteData or a selection
+   declaration): the first ZHE_MAX_URIHANDLES slots are for the URI handles, the next
+   ZHE_MAX_SELECTIONS for the queries of selections */
+#define ZHE_URISTORE_ENC_SLOTS (ZHE_MAX_URIHANDLES + ZHE_MAX_SELECTIONS)
+#if ZHE_URISTORE_ENC_SLOTS > 0
+/* Stores the encoding of uri in slot, returning the length of the encoded length in *prefixlen */
+enum uristore_result zhe_uristore_store_enc(unsigned slot, const uint8_t *uri, size_t urilen, zhe_paysize_t *prefixlen);
+/* Returns the encoding stored in slot, valid until the next garbage collection */
+const uint8_t *zhe_uristore_get_enc(unsigned slot, zhe_paysize_t *enclen);
+/* Frees the encoding stored in slot */
+void zhe_uristore_free_enc(unsigned slot);
+#endif
+/* Looks up a resource with URI uri (exactly) declared by peeridx */
+bool zhe_uristore_lookup_uri(peeridx_t peeridx, const uint8_t *uri, zhe_paysize_t urilen, zhe_rid_t *rid);
+/* Calls f(rid, arg) for every resource with URI uri or with a pattern matching uri (there is no
+   guarantee yet that there is at most one with URI uri, see zhe_uristore_store) */
+void zhe_uristore_foreach_uri(const uint8_t *uri, zhe_paysize_t urilen, void (*f)(zhe_rid_t rid, void *arg), void *arg);
 #endif
 
 #endif
@@ -14,6 +14,7 @@
 #include "zhe-bitset.h"
 #include "zhe-binheap.h"
 #include "zhe-pubsub.h"
+#include "zhe-fec.h"
 
 #if ZHE_MAX_URISPACE > 0
 #include "zhe-uristore.h"
@@ -36,6 +37,8 @@ struct in_conduit {
     seq_t useq;                   /* next unreliable seq to be delivered */
     uint8_t synched: 1;           /* whether a synch was received since (re)establishing the connection */
     uint8_t usynched: 1;          /* whether some unreliable data was received since (re)establishing the connection */
+    uint8_t ack_pending: 1;       /* whether an ACKNACK may be needed at the end of the input batch */
+    uint8_t ack_wanted: 1;        /* whether an ACK was requested in the input batch */
     zhe_time_t tack;              /* time of most recent ack sent */
 };
 
@@ -58,11 +61,20 @@ struct out_conduit {
     zhe_time_t last_rexmit;       /* time of latest retransmit */
     seq_t    last_rexmit_seq;     /* latest sequence number retransmitted */
     uint8_t  draining_window: 1;  /* set to true if draining window (waiting for ACKs) after hitting limit */
+    uint8_t  notify_writable: 1;  /* set to true if draining window completed and writable handler not yet called */
+    uint8_t  decls_unacked: 1;    /* set to true if a DECLARE has been sent that hasn't been ack'd yet */
+    uint8_t  ack_requested: 1;    /* set to true if an early SYNCH was requested and no ACK has advanced seqbase since */
+    seq_t    declseq;             /* seq following the latest DECLARE, valid if decls_unacked */
     uint8_t  *rbuf;               /* reliable samples (or declarations); prepended by size (of type zhe_msgsize_t) */
 #if XMITW_SAMPLE_INDEX
     seq_t    firstidx;
     xwpos_t *rbufidx;             /* rbuf[rbufidx[seq % xmitw_samples]] is first byte of length of message seq */
 #endif
+#if XMITW_SAMPLE_LIFESPAN
+    zhe_time_t *rbufexp;          /* expiry time of message seq, indexed like rbufidx; 0 if it doesn't expire */
+    zhe_time_t texpire;           /* earliest expiry time of messages in window, if has_expiring */
+    uint8_t  has_expiring: 1;     /* whether any message in the window has an expiry time */
+#endif
 };
 
 struct peer {
@@ -88,6 +100,9 @@ struct peer {
 struct out_mconduit {
     struct out_conduit oc;        /* same transmit window management as unicast */
     struct minseqheap seqbase;    /* tracks ACKs from peers for computing oc.seqbase as min of them all */
+#if FEC_GROUP_SIZE > 0
+    struct fec_enc fec;           /* parity of current group of reliable messages */
+#endif
 };
 
 static struct out_mconduit out_mconduits[N_OUT_MCONDUITS];
@@ -95,6 +110,9 @@ static uint8_t out_mconduits_oc_rbuf[N_OUT_MCONDUITS][XMITW_BYTES];
 #if XMITW_SAMPLE_INDEX
 static xwpos_t out_mconduits_oc_rbufidx[N_OUT_MCONDUITS][XMITW_SAMPLES];
 #endif
+#if XMITW_SAMPLE_LIFESPAN
+static zhe_time_t out_mconduits_oc_rbufexp[N_OUT_MCONDUITS][XMITW_SAMPLES];
+#endif
 #endif
 
 #if N_OUT_MCONDUITS == 0
@@ -149,12 +167,39 @@ static uint8_t peers_oc_rbuf[MAX_PEERS_1][XMITW_BYTES_UNICAST];
 #if XMITW_SAMPLE_INDEX
 static xwpos_t peers_oc_rbufidx[MAX_PEERS_1][XMITW_SAMPLES_UNICAST];
 #endif
+#if XMITW_SAMPLE_LIFESPAN
+static zhe_time_t peers_oc_rbufexp[MAX_PEERS_1][XMITW_SAMPLES_UNICAST];
+#endif
+#endif
+#if FEC_GROUP_SIZE > 0
+/* Reliable messages of the current group for each input conduit of each peer, for reconstructing
+   a lost one from the parity message */
+static struct fec_dec peers_ic_fec[MAX_PEERS_1][N_IN_CONDUITS];
+#endif
+
+/* Open-addressing hash tables (linear probing, PEERIDX_INVALID marks an empty slot) for locating
+   a peer by source address on every incoming packet and by peer id on session messages without
+   scanning all peers. A peer occurs at most once in each, hence sizing them at twice the number of
+   peers guarantees an empty slot to terminate probing. Entry i is keyed on peers[i].oc.addr resp.
+   peers[i].id, so those must not be modified while i is in the table. The id table contains
+   exactly the established peers; the address table contains those peers (established or not)
+   that have been assigned an address by an incoming packet. */
+#define PEERHASH_SIZE (2 * MAX_PEERS_1)
+static peeridx_t peers_by_id[PEERHASH_SIZE];
+#if TRANSPORT_MODE == TRANSPORT_PACKET
+static peeridx_t peers_by_addr[PEERHASH_SIZE];
+/* Slots in peers[] in state UNKNOWN, i.e., available for a new source address */
+static DECL_BITSET(peers_unknown, MAX_PEERS_1);
 #endif
 
 /* In peer mode, always send scouts periodically, with tnextscout giving the time for the next scout
    message to go out. In client mode, scouting is conditional upon the state of the broker, in that
    case scouts only go out if peers[0].state = UNKNOWN. We also use it to send KEEPALIVEs, but those
-   should be suppressed if data went out recently enough. FIXME: solve that. */
+   should be suppressed if data went out recently enough. FIXME: solve that.
+
+   The interval between scouts starts at SCOUT_INTERVAL_MIN and doubles with every scout sent until
+   it reaches SCOUT_INTERVAL, so that a lost scout or hello at startup doesn't delay discovery by a
+   full SCOUT_INTERVAL. Losing a session resets it to SCOUT_INTERVAL_MIN. */
 #if SCOUT_COUNT > 0
 #if SCOUT_COUNT <= 255
 static uint8_t scout_count = SCOUT_COUNT;
@@ -163,17 +208,55 @@ static uint16_t scout_count = SCOUT_COUNT;
 #endif
 #endif /* SCOUT_COUNT > 0 */
 static zhe_time_t tnextscout;
+static zhe_time_t scout_interval;
+
+/* Per-conduit application callbacks for when a transmit window that filled up has been drained,
+   invoked only once the processing of input (or housekeeping) is complete, so the application
+   may freely write data from the handler */
+static struct {
+    zhe_writablehandler_t handler;
+    void *arg;
+} writable_handlers[N_OUT_CONDUITS];
+static bool writable_pending;
+
+/* Application callback for when all declarations have been accepted by all peers, invoked like the
+   writable handlers; decls_complete_notified is cleared whenever a DECLARE goes out */
+static struct {
+    zhe_declshandler_t handler;
+    void *arg;
+} decls_complete_handler;
+static bool decls_complete_notified;
+
+/* While processing a batch of input packets, ACKNACKs are deferred until the end of the batch,
+   so at most one goes out per peer and conduit rather than (potentially) one per message */
+static bool input_batching;
+static DECL_BITSET(peers_ack_pending, MAX_PEERS_1);
 
 static void remove_acked_messages(struct out_conduit * const c, seq_t seq);
+static void notify_writable(void);
+static void notify_declarations_complete(void);
+
+static void oc_set_writable(struct out_conduit * const oc)
+{
+    oc->draining_window = 0;
+    oc->notify_writable = 1;
+    writable_pending = true;
+}
 
 static void oc_reset_transmit_window(struct out_conduit * const oc)
 {
     oc->seqbase = oc->seq;
     oc->firstpos = oc->spos;
     oc->draining_window = 0;
+    oc->notify_writable = 0;
+    oc->decls_unacked = 0;
+    oc->ack_requested = 0;
+#if XMITW_SAMPLE_LIFESPAN
+    oc->has_expiring = 0;
+#endif
 }
 
-static void oc_setup1(struct out_conduit * const oc, cid_t cid, xwpos_t xmitw_bytes, uint8_t *rbuf, uint16_t xmitw_samples, xwpos_t *rbufidx)
+static void oc_setup1(struct out_conduit * const oc, cid_t cid, xwpos_t xmitw_bytes, uint8_t *rbuf, uint16_t xmitw_samples, xwpos_t *rbufidx, zhe_time_t *rbufexp)
 {
     memset(&oc->addr, 0, sizeof(oc->addr));
     oc->cid = cid;
@@ -189,10 +272,96 @@ static void oc_setup1(struct out_conduit * const oc, cid_t cid, xwpos_t xmitw_by
 #if XMITW_SAMPLE_INDEX
     oc->firstidx = 0;
     oc->rbufidx = rbufidx;
+#endif
+#if XMITW_SAMPLE_LIFESPAN
+    oc->rbufexp = rbufexp;
+#else
+    (void)rbufexp;
 #endif
     oc_reset_transmit_window(oc);
 }
 
+static unsigned peer_id_home(zhe_paysize_t idlen, const uint8_t * restrict id)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
+    for (zhe_paysize_t i = 0; i < idlen; i++) {
+        h = (h ^ id[i]) * 16777619u;
+    }
+    return (unsigned)(h % PEERHASH_SIZE);
+}
+
+static unsigned peer_id_home_of(peeridx_t peeridx)
+{
+    return peer_id_home(peers[peeridx].id.len, peers[peeridx].id.id);
+}
+
+#if TRANSPORT_MODE == TRANSPORT_PACKET
+static unsigned peer_addr_home_of(peeridx_t peeridx)
+{
+    return (unsigned)(zhe_platform_addr_hash(&peers[peeridx].oc.addr) % PEERHASH_SIZE);
+}
+#endif
+
+static void peerhash_delete(peeridx_t *tab, unsigned pos, unsigned (*home_of)(peeridx_t peeridx))
+{
+    /* Backward-shift deletion: move up any entries further along the probe sequence that would
+       otherwise become unreachable, so lookups can stop at the first empty slot */
+    unsigned i = pos, j = pos;
+    while (1) {
+        j = (j + 1) % PEERHASH_SIZE;
+        if (tab[j] == PEERIDX_INVALID) {
+            break;
+        }
+        const unsigned k = home_of(tab[j]);
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        tab[i] = tab[j];
+        i = j;
+    }
+    tab[i] = PEERIDX_INVALID;
+}
+
+static unsigned peerhash_id_pos(zhe_paysize_t idlen, const uint8_t * restrict id)
+{
+    unsigned pos = peer_id_home(idlen, id);
+    peeridx_t i;
+    while ((i = peers_by_id[pos]) != PEERIDX_INVALID && !(peers[i].id.len == idlen && memcmp(peers[i].id.id, id, idlen) == 0)) {
+        pos = (pos + 1) % PEERHASH_SIZE;
+    }
+    return pos;
+}
+
+#if TRANSPORT_MODE == TRANSPORT_PACKET
+static unsigned peerhash_addr_pos(const zhe_address_t *addr)
+{
+    unsigned pos = (unsigned)(zhe_platform_addr_hash(addr) % PEERHASH_SIZE);
+    peeridx_t i;
+    while ((i = peers_by_addr[pos]) != PEERIDX_INVALID && !zhe_platform_addr_eq(addr, &peers[i].oc.addr)) {
+        pos = (pos + 1) % PEERHASH_SIZE;
+    }
+    return pos;
+}
+
+static void peerhash_addr_remove(peeridx_t peeridx)
+{
+    const unsigned pos = peerhash_addr_pos(&peers[peeridx].oc.addr);
+    /* The address may have been taken over by another peer (see find_peeridx_by_id) */
+    if (peers_by_addr[pos] == peeridx) {
+        peerhash_delete(peers_by_addr, pos, peer_addr_home_of);
+    }
+}
+
+static void peer_set_addr(peeridx_t peeridx, const zhe_address_t *addr)
+{
+    peerhash_addr_remove(peeridx);
+    const unsigned pos = peerhash_addr_pos(addr);
+    peers[peeridx].oc.addr = *addr;
+    peers_by_addr[pos] = peeridx;
+}
+#endif
+
 static void reset_outbuf(void)
 {
     outspos = OUTSPOS_UNSET;
@@ -204,7 +373,22 @@ static void reset_outbuf(void)
 static void reset_peer(peeridx_t peeridx, zhe_time_t tnow)
 {
     struct peer * const p = &peers[peeridx];
+#if HAVE_UNICAST_CONDUIT
+    const bool oc_draining = (p->state != PEERST_UNKNOWN && p->oc.draining_window);
+#endif
     ZT(PEERDISC, "reset_peer @ %u", peeridx);
+    if (p->state == PEERST_ESTABLISHED) {
+        const unsigned pos = peerhash_id_pos(p->id.len, p->id.id);
+        zhe_assert(peers_by_id[pos] == peeridx);
+        peerhash_delete(peers_by_id, pos, peer_id_home_of);
+        /* Losing a session (lease expiry, close, reconnect) means scouting at the fast cadence
+           again, starting right away, to recover quickly if the peer comes back */
+        scout_interval = SCOUT_INTERVAL_MIN;
+        tnextscout = tnow;
+    }
+#if TRANSPORT_MODE == TRANSPORT_PACKET
+    peerhash_addr_remove(peeridx);
+#endif
     /* FIXME: stupid naming */
     zhe_rsub_clear(peeridx);
     /* If data destined for this peer, drop it it */
@@ -244,13 +428,25 @@ static void reset_peer(peeridx_t peeridx, zhe_time_t tnow)
         npeers--;
     }
     p->state = PEERST_UNKNOWN;
+#if TRANSPORT_MODE == TRANSPORT_PACKET
+    zhe_bitset_set(peers_unknown, peeridx);
+#endif
 #if HAVE_UNICAST_CONDUIT
 #if XMITW_SAMPLE_INDEX
     xwpos_t * const rbufidx = peers_oc_rbufidx[peeridx];
 #else
     xwpos_t * const rbufidx = NULL;
 #endif
-    oc_setup1(&p->oc, UNICAST_CID, XMITW_BYTES_UNICAST, peers_oc_rbuf[peeridx], XMITW_SAMPLES_UNICAST, rbufidx);
+#if XMITW_SAMPLE_LIFESPAN
+    zhe_time_t * const rbufexp = peers_oc_rbufexp[peeridx];
+#else
+    zhe_time_t * const rbufexp = NULL;
+#endif
+    oc_setup1(&p->oc, UNICAST_CID, XMITW_BYTES_UNICAST, peers_oc_rbuf[peeridx], XMITW_SAMPLES_UNICAST, rbufidx, rbufexp);
+    if (oc_draining) {
+        /* window is empty now, and a writer waiting for it must not be left hanging */
+        oc_set_writable(&p->oc);
+    }
 #endif
     for (cid_t i = 0; i < N_IN_CONDUITS; i++) {
         p->ic[i].seq = 0;
@@ -258,6 +454,11 @@ static void reset_peer(peeridx_t peeridx, zhe_time_t tnow)
         p->ic[i].useq = 0;
         p->ic[i].synched = 0;
         p->ic[i].usynched = 0;
+        p->ic[i].ack_pending = 0;
+        p->ic[i].ack_wanted = 0;
+#if FEC_GROUP_SIZE > 0
+        zhe_fec_dec_reset(&peers_ic_fec[peeridx][i]);
+#endif
     }
 #if N_OUT_MCONDUITS > 0
     memset(p->mc_member, 0, sizeof(p->mc_member));
@@ -275,7 +476,15 @@ static void init_globals(zhe_time_t tnow)
 #else
         xwpos_t * const rbufidx = NULL;
 #endif
-        oc_setup1(&mc->oc, i, XMITW_BYTES, out_mconduits_oc_rbuf[i], XMITW_SAMPLES, rbufidx);
+#if XMITW_SAMPLE_LIFESPAN
+        zhe_time_t * const rbufexp = out_mconduits_oc_rbufexp[i];
+#else
+        zhe_time_t * const rbufexp = NULL;
+#endif
+        oc_setup1(&mc->oc, i, XMITW_BYTES, out_mconduits_oc_rbuf[i], XMITW_SAMPLES, rbufidx, rbufexp);
+#if FEC_GROUP_SIZE > 0
+        zhe_fec_enc_start(&mc->fec);
+#endif
         mc->seqbase.n = 0;
         for (peeridx_t j = 0; j < MAX_PEERS; j++) {
             mc->seqbase.hx[j] = PEERIDX_INVALID;
@@ -283,7 +492,15 @@ static void init_globals(zhe_time_t tnow)
         }
     }
 #endif
+    for (unsigned i = 0; i < PEERHASH_SIZE; i++) {
+        peers_by_id[i] = PEERIDX_INVALID;
+#if TRANSPORT_MODE == TRANSPORT_PACKET
+        peers_by_addr[i] = PEERIDX_INVALID;
+#endif
+    }
     for (peeridx_t i = 0; i < MAX_PEERS_1; i++) {
+        /* reset_peer only looks at the id if the state is ESTABLISHED */
+        peers[i].state = PEERST_UNKNOWN;
         reset_peer(i, tnow);
     }
     npeers = 0;
@@ -292,6 +509,7 @@ static void init_globals(zhe_time_t tnow)
     outdeadline = tnow;
 #endif
     tnextscout = tnow;
+    scout_interval = SCOUT_INTERVAL_MIN;
 #if ZHE_MAX_URISPACE > 0
     zhe_uristore_init();
 #endif
@@ -365,6 +583,18 @@ int zhe_xmitw_hasspace(const struct out_conduit *c, zhe_paysize_t sz)
     return av >= sizeof(zhe_msgsize_t) && av - sizeof(zhe_msgsize_t) >= sz;
 }
 
+/* Largest message size for which zhe_xmitw_hasspace currently holds, 0 if there is no room */
+zhe_paysize_t zhe_xmitw_maxmsgsize(const struct out_conduit *c)
+{
+#if (defined(XMITW_SAMPLES) && XMITW_SAMPLES > 0) || (defined(XMITW_SAMPLES_UNICAST) && XMITW_SAMPLES_UNICAST > 0)
+    if (oc_get_nsamples(c) == c->xmitw_samples) {
+        return 0;
+    }
+#endif
+    const zhe_paysize_t av = zhe_xmitw_bytesavail(c);
+    return (av >= sizeof(zhe_msgsize_t)) ? (zhe_paysize_t)(av - sizeof(zhe_msgsize_t)) : 0;
+}
+
 static xwpos_t xmitw_skip_sample(const struct out_conduit *c, xwpos_t p)
 {
     zhe_msgsize_t sz = xmitw_load_msgsize(c, p);
@@ -386,6 +616,22 @@ static void xmitw_store_rbufidx(const struct out_conduit *c, seq_t seq, xwpos_t
     c->rbufidx[idx] = p;
 }
 
+#if XMITW_SAMPLE_LIFESPAN
+static zhe_time_t xmitw_load_rbufexp(const struct out_conduit *c, seq_t seq)
+{
+    seq_t off = (seq_t)(seq - c->seqbase) >> SEQNUM_SHIFT;
+    seq_t idx = (c->firstidx + off) % c->xmitw_samples;
+    return c->rbufexp[idx];
+}
+
+static void xmitw_store_rbufexp(const struct out_conduit *c, seq_t seq, zhe_time_t texp)
+{
+    seq_t off = (seq_t)(seq - c->seqbase) >> SEQNUM_SHIFT;
+    seq_t idx = (c->firstidx + off) % c->xmitw_samples;
+    c->rbufexp[idx] = texp;
+}
+#endif
+
 #ifndef NDEBUG
 static void check_xmitw(const struct out_conduit *c)
 {
@@ -473,12 +719,15 @@ void zhe_pack2(uint8_t x, uint8_t y)
 
 void zhe_pack_vec(zhe_paysize_t n, const void *vbuf)
 {
-    const uint8_t *buf = vbuf;
     zhe_pack_vle16(n);
+    zhe_pack_bytes(n, vbuf);
+}
+
+void zhe_pack_bytes(zhe_paysize_t n, const void *buf)
+{
     pack_check_avail(n);
-    while (n--) {
-        outbuf[outp++] = *buf++;
-    }
+    memcpy(outbuf + outp, buf, n);
+    outp = (zhe_msgsize_t)(outp + n);
 }
 
 uint16_t zhe_pack_locs_calcsize(void)
@@ -531,6 +780,16 @@ int zhe_oc_am_draining_window(const struct out_conduit *c)
     return c->draining_window;
 }
 
+/* Brings the next SYNCH forward to tnow, once per advance of seqbase, so that the peers
+   acknowledge the window sooner; unlike zhe_oc_hit_full_window, writes remain possible */
+void zhe_oc_request_ack(struct out_conduit *c, zhe_time_t tnow)
+{
+    if (c->seq != c->seqbase && !c->ack_requested) {
+        c->ack_requested = 1;
+        c->tsynch = tnow;
+    }
+}
+
 #if N_OUT_MCONDUITS > 0
 int zhe_ocm_have_peers(const struct out_mconduit *mc)
 {
@@ -581,15 +840,49 @@ void zhe_oc_pack_payload(struct out_conduit *c, int relflag, zhe_paysize_t sz, c
     }
 }
 
+#if FEC_GROUP_SIZE > 0 && N_OUT_MCONDUITS > 0
+static void ocm_fec_add(struct out_mconduit *mc, xwpos_t p, zhe_msgsize_t len, seq_t seq, zhe_time_t tnow)
+{
+    struct out_conduit * const c = &mc->oc;
+    if (FEC_GROUP_SLOT(seq) == 0) {
+        zhe_fec_enc_start(&mc->fec);
+    }
+    if (zhe_fec_enc_msg(&mc->fec, len)) {
+        /* message may wrap around the end of the transmit window */
+        const zhe_msgsize_t n1 = (p + len <= c->xmitw_bytes) ? len : (zhe_msgsize_t)(c->xmitw_bytes - p);
+        zhe_fec_enc_add(&mc->fec, 0, n1, &c->rbuf[p]);
+        if (n1 < len) {
+            zhe_fec_enc_add(&mc->fec, n1, len - n1, &c->rbuf[0]);
+        }
+    }
+    if (FEC_GROUP_SLOT(seq) == FEC_GROUP_SIZE - 1 && mc->fec.ok) {
+        /* Parity is not sequenced and not stored in the transmit window, but it does follow the
+           group in the same packet if it fits, and it must be able to carry the S flag */
+        const seq_t base = FEC_GROUP_BASE(seq);
+        const zhe_paysize_t sz = 1 + zhe_pack_seqreq(base) + 1 + zhe_pack_vle16req(mc->fec.lenxor) + zhe_pack_vle16req(mc->fec.len) + mc->fec.len;
+        zhe_pack_reserve_mconduit(&c->addr, c, c->cid, sz, tnow);
+        outspos = outp;
+        zhe_pack_mfec(base, FEC_GROUP_SIZE, mc->fec.lenxor, mc->fec.len, mc->fec.parity);
+        ZT(RELIABLE, "fec cid %u base %u len %u", c->cid, base >> SEQNUM_SHIFT, (unsigned)mc->fec.len);
+    }
+}
+#endif
+
 void zhe_oc_pack_payload_done(struct out_conduit *c, int relflag, zhe_time_t tnow)
 {
     if (!relflag) {
         c->useq += SEQNUM_UNIT;
     } else {
         zhe_msgsize_t len = (zhe_msgsize_t) (c->pos - c->spos + (c->pos < c->spos ? c->xmitw_bytes : 0) - sizeof(zhe_msgsize_t));
+#if FEC_GROUP_SIZE > 0 && N_OUT_MCONDUITS > 0
+        const xwpos_t msgpos = xmitw_pos_add(c, c->spos, sizeof(zhe_msgsize_t));
+#endif
         xmitw_store_msgsize(c, c->spos, len);
 #if XMITW_SAMPLE_INDEX
         xmitw_store_rbufidx(c, c->seq, c->spos);
+#endif
+#if XMITW_SAMPLE_LIFESPAN
+        xmitw_store_rbufexp(c, c->seq, 0);
 #endif
         c->spos = c->pos;
         c->pos = xmitw_pos_add(c, c->pos, sizeof(zhe_msgsize_t));
@@ -599,6 +892,9 @@ void zhe_oc_pack_payload_done(struct out_conduit *c, int relflag, zhe_time_t tno
         }
         /* prep for next sample */
         c->seq += SEQNUM_UNIT;
+#if FEC_GROUP_SIZE > 0 && N_OUT_MCONDUITS > 0
+        DO_FOR_UNICAST_OR_MULTICAST(c->cid, (void)0, ocm_fec_add(&out_mconduits[c->cid], msgpos, len, c->seq - SEQNUM_UNIT, tnow));
+#endif
     }
 }
 
@@ -676,10 +972,12 @@ static enum zhe_unpack_result handle_dresource(peeridx_t peeridx, const uint8_t
                 *interpret = DIM_ABORT;
                 return ZUR_OK;
             case USR_NOSPACE:
-            case USR_MISMATCH:
             case USR_OVERSIZE:
                 /* note an error so that a COMMIT will result in a RESULT with an error code */
-                zhe_decl_note_error_curpkt(16, rid);
+                zhe_decl_note_error_curpkt(DECLERR_URISTORE, rid);
+                return ZUR_OK;
+            case USR_MISMATCH:
+                zhe_decl_note_error_curpkt(DECLERR_URIMISMATCH, rid);
                 return ZUR_OK;
         }
     }
@@ -737,18 +1035,26 @@ static enum zhe_unpack_result handle_dselection(peeridx_t peeridx, const uint8_t
     enum zhe_unpack_result res;
     zhe_rid_t sid;
     uint8_t hdr;
-    zhe_paysize_t dummy;
+    zhe_paysize_t querysz;
+    const uint8_t *query;
     struct unpack_props_iter it;
     if ((res = zhe_unpack_byte(end, data, &hdr)) != ZUR_OK ||
         (res = zhe_unpack_rid(end, data, &sid)) != ZUR_OK ||
-        (res = zhe_unpack_vec(end, data, 0, &dummy, NULL)) != ZUR_OK) {
+        (res = zhe_unpack_vecref(end, data, &querysz, &query)) != ZUR_OK) {
         return res;
     }
     if ((hdr & DPFLAG) && (res = zhe_unpack_props(end, data, &it)) != ZUR_OK) {
         return res;
     }
     if (*interpret == DIM_INTERPRET) {
-        zhe_decl_note_error_curpkt(4, sid);
+#if MAX_PEERS > 0 && ZHE_MAX_URISPACE > 0
+        /* Only fails if the resource is unknown, a selection that can't be stored is ignored */
+        if (!zhe_rsel_register(peeridx, sid, query, querysz)) {
+            zhe_decl_note_error_curpkt(DECLERR_SELECTION, sid);
+        }
+#else
+        zhe_decl_note_error_curpkt(DECLERR_SELECTION, sid);
+#endif
     }
     return ZUR_OK;
 }
@@ -756,14 +1062,24 @@ static enum zhe_unpack_result handle_dselection(peeridx_t peeridx, const uint8_t
 static enum zhe_unpack_result handle_dbindid(peeridx_t peeridx, const uint8_t * const end, const uint8_t **data, enum declaration_interpretation_mode *interpret)
 {
     enum zhe_unpack_result res;
-    zhe_rid_t sid;
+    zhe_rid_t oldid, newid;
     if ((res = zhe_unpack_skip(end, data, 1)) != ZUR_OK ||
-        (res = zhe_unpack_rid(end, data, &sid)) != ZUR_OK ||
-        (res = zhe_unpack_rid(end, data, NULL)) != ZUR_OK) {
+        (res = zhe_unpack_rid(end, data, &oldid)) != ZUR_OK ||
+        (res = zhe_unpack_rid(end, data, &newid)) != ZUR_OK) {
         return res;
     }
     if (*interpret == DIM_INTERPRET) {
-        zhe_decl_note_error_curpkt(8, sid);
+#if ZHE_MAX_URISPACE > 0 && ZHE_MAX_RBINDINGS > 0
+        /* Only binding a new id to the URI of a resource declared by the same peer is supported,
+           which is what is needed for delivering data published on that id like a WriteData. A
+           binding is merely an optimisation, so one that can't be stored (or isn't supported) is
+           ignored rather than failing the declarations. */
+        if (!zhe_uristore_bind(peeridx, oldid, newid)) {
+            ZT(PUBSUB, "handle_dbindid %u: ignoring binding %ju -> %ju", (unsigned)peeridx, (uintmax_t)newid, (uintmax_t)oldid);
+        }
+#else
+        ZT(PUBSUB, "handle_dbindid %u: ignoring binding %ju -> %ju", (unsigned)peeridx, (uintmax_t)newid, (uintmax_t)oldid);
+#endif
     }
     return ZUR_OK;
 }
@@ -793,7 +1109,7 @@ static enum zhe_unpack_result handle_dcommit(peeridx_t peeridx, const uint8_t *
             return ZUR_OK;
         } else {
             zhe_rsub_precommit_curpkt_done(peeridx);
-            if ((commitres = zhe_rsub_precommit(peeridx, &err_rid)) == 0) {
+            if ((commitres = zhe_rsub_precommit(peeridx, DECLERR_ANY, &err_rid)) == 0) {
                 zhe_rsub_commit(peeridx);
             }
             zhe_pack_dresult(commitid, commitres, err_rid);
@@ -821,12 +1137,12 @@ static enum zhe_unpack_result handle_dresult(peeridx_t peeridx, const uint8_t *
     if (*interpret == DIM_INTERPRET && status != 0) {
         /* Don't know what to do when the broker refuses my declarations - although I guess it
          would make some sense to close the connection and try again.  But even if that is
-         the right thing to do, don't do that just yet, because it shouldn't fail.
-
-         Also note that we're not looking at the commit id at all, I am not sure yet what
-         problems that may cause ... */
+         the right thing to do, don't do that just yet, because it shouldn't fail. */
         zhe_assert(0);
     }
+    if (*interpret == DIM_INTERPRET) {
+        zhe_decl_note_result(commitid);
+    }
     return ZUR_OK;
 }
 
@@ -858,6 +1174,10 @@ static enum zhe_unpack_result handle_dfsub(peeridx_t peeridx, const uint8_t * co
         (res = zhe_unpack_rid(end, data, &rid)) != ZUR_OK) {
         return res;
     }
+    if (*interpret == DIM_INTERPRET) {
+        /* Takes effect immediately: there is nothing to be gained from waiting for the commit */
+        zhe_rsub_unregister(peeridx, rid);
+    }
     return ZUR_OK;
 }
 
@@ -869,6 +1189,11 @@ static enum zhe_unpack_result handle_dfselection(peeridx_t peeridx, const uint8_
         (res = zhe_unpack_rid(end, data, &sid))) {
         return res;
     }
+#if MAX_PEERS > 0 && ZHE_MAX_RSELECTIONS > 0
+    if (*interpret == DIM_INTERPRET) {
+        zhe_rsel_unregister(peeridx, sid);
+    }
+#endif
     return ZUR_OK;
 }
 
@@ -955,6 +1280,9 @@ static enum zhe_unpack_result handle_mhello(peeridx_t peeridx, const uint8_t * c
                 send_open = 0;
             } else {
                 peers[peeridx].state = PEERST_OPENING_MIN;
+#if TRANSPORT_MODE == TRANSPORT_PACKET
+                zhe_bitset_clear(peers_unknown, peeridx);
+#endif
                 peers[peeridx].tlease = tnow;
             }
         } else {
@@ -983,24 +1311,25 @@ static peeridx_t find_peeridx_by_id(peeridx_t peeridx, zhe_paysize_t idlen, cons
         return peeridx;
     }
 
-    for (peeridx_t i = 0; i < MAX_PEERS_1; i++) {
-        if (peers[i].state != PEERST_ESTABLISHED) {
-            continue;
-        }
-        if (peers[i].id.len == idlen && memcmp(peers[i].id.id, id, idlen) == 0) {
+    const peeridx_t i = peers_by_id[peerhash_id_pos(idlen, id)];
+    if (i == PEERIDX_INVALID) {
+        return peeridx;
+    }
+    zhe_assert(peers[i].state == PEERST_ESTABLISHED);
 #if ENABLE_TRACING
-            if (ZTT(PEERDISC)) {
-                char olda[TRANSPORT_ADDRSTRLEN], newa[TRANSPORT_ADDRSTRLEN];
-                zhe_platform_addr2string(zhe_platform, olda, sizeof(olda), &peers[i].oc.addr);
-                zhe_platform_addr2string(zhe_platform, newa, sizeof(newa), &peers[peeridx].oc.addr);
-                ZT(PEERDISC, "peer %u changed address from %s to %s", (unsigned)i, olda, newa);
-            }
-#endif
-            peers[i].oc.addr = peers[peeridx].oc.addr;
-            return i;
-        }
+    if (ZTT(PEERDISC)) {
+        char olda[TRANSPORT_ADDRSTRLEN], newa[TRANSPORT_ADDRSTRLEN];
+        zhe_platform_addr2string(zhe_platform, olda, sizeof(olda), &peers[i].oc.addr);
+        zhe_platform_addr2string(zhe_platform, newa, sizeof(newa), &peers[peeridx].oc.addr);
+        ZT(PEERDISC, "peer %u changed address from %s to %s", (unsigned)i, olda, newa);
     }
-    return peeridx;
+#endif
+#if TRANSPORT_MODE == TRANSPORT_PACKET
+    peer_set_addr(i, &peers[peeridx].oc.addr);
+#else
+    peers[i].oc.addr = peers[peeridx].oc.addr;
+#endif
+    return i;
 }
 
 #if ENABLE_TRACING
@@ -1038,8 +1367,16 @@ static void accept_peer(peeridx_t peeridx, zhe_paysize_t idlen, const uint8_t *
 #endif
 
     p->state = PEERST_ESTABLISHED;
+#if TRANSPORT_MODE == TRANSPORT_PACKET
+    zhe_bitset_clear(peers_unknown, peeridx);
+#endif
     p->id.len = idlen;
     memcpy(p->id.id, id, idlen);
+    {
+        const unsigned pos = peerhash_id_pos(idlen, id);
+        zhe_assert(peers_by_id[pos] == PEERIDX_INVALID);
+        peers_by_id[pos] = peeridx;
+    }
     p->lease_dur = lease_dur;
     p->tlease = tnow + (zhe_time_t)p->lease_dur;
 #if N_OUT_MCONDUITS > 0
@@ -1264,7 +1601,7 @@ static void ic_update_seq (struct in_conduit *ic, uint8_t hdr, seq_t seq)
     }
 }
 
-static void acknack_if_needed(peeridx_t peeridx, cid_t cid, int wantsack, zhe_time_t tnow)
+static void acknack_if_needed1(peeridx_t peeridx, cid_t cid, int wantsack, zhe_time_t tnow)
 {
     seq_t cnt = (peers[peeridx].ic[cid].lseqpU - peers[peeridx].ic[cid].seq) >> SEQNUM_SHIFT;
     uint32_t mask;
@@ -1277,6 +1614,12 @@ static void acknack_if_needed(peeridx_t peeridx, cid_t cid, int wantsack, zhe_ti
             mask >>= 32 - cnt;
         }
     }
+#if FEC_GROUP_SIZE > 0
+    if (!wantsack && mask != 0 && zhe_fec_dec_may_recover(&peers_ic_fec[peeridx][cid], peers[peeridx].ic[cid].seq)) {
+        /* parity may yet allow reconstructing the missing message, no need to ask for it */
+        return;
+    }
+#endif
     if (wantsack || (mask != 0 && (zhe_timediff_t)(tnow - peers[peeridx].ic[cid].tack) > ROUNDTRIP_TIME_ESTIMATE)) {
         /* ACK goes out over unicast path; the conduit used for sending it doesn't have
            much to do with it other than administrative stuff */
@@ -1287,6 +1630,39 @@ static void acknack_if_needed(peeridx_t peeridx, cid_t cid, int wantsack, zhe_ti
     }
 }
 
+static void acknack_if_needed(peeridx_t peeridx, cid_t cid, int wantsack, zhe_time_t tnow)
+{
+    if (input_batching) {
+        struct in_conduit * const ic = &peers[peeridx].ic[cid];
+        ic->ack_pending = 1;
+        ic->ack_wanted |= (wantsack != 0);
+        zhe_bitset_set(peers_ack_pending, peeridx);
+    } else {
+        acknack_if_needed1(peeridx, cid, wantsack, tnow);
+    }
+}
+
+#if TRANSPORT_MODE == TRANSPORT_PACKET
+static void flush_deferred_acknacks(zhe_time_t tnow)
+{
+    int i;
+    while ((i = zhe_bitset_findfirst(peers_ack_pending, MAX_PEERS_1)) >= 0) {
+        const peeridx_t peeridx = (peeridx_t)i;
+        zhe_bitset_clear(peers_ack_pending, peeridx);
+        for (cid_t cid = 0; cid < N_IN_CONDUITS; cid++) {
+            struct in_conduit * const ic = &peers[peeridx].ic[cid];
+            /* a reset of the peer during the batch clears ack_pending */
+            if (ic->ack_pending) {
+                const int wantsack = ic->ack_wanted;
+                ic->ack_pending = 0;
+                ic->ack_wanted = 0;
+                acknack_if_needed1(peeridx, cid, wantsack, tnow);
+            }
+        }
+    }
+}
+#endif
+
 static enum zhe_unpack_result handle_mdeclare(peeridx_t peeridx, const uint8_t * const end, const uint8_t **data, cid_t cid, zhe_time_t tnow)
 {
     /* Note 1: not buffering data received out-of-order, so but need to decode everything to
@@ -1315,7 +1691,14 @@ static enum zhe_unpack_result handle_mdeclare(peeridx_t peeridx, const uint8_t *
         }
         intp = ic_may_deliver_seq(&peers[peeridx].ic[cid], MRFLAG, seq) ? DIM_INTERPRET : DIM_IGNORE;
     }
-    ZT(PUBSUB, "handle_mdeclare %p seq %u peeridx %u ndecls %u intp %s", data, seq, peeridx, ndecls, decl_intp_mode_str(intp));
+    /* Empty DECLAREs stand in for superseded samples (see zhe_oc_supersede), not interesting for
+       tracing declarations */
+    const bool empty = (ndecls == 0);
+    if (empty) {
+        ZT(RELIABLE, "handle_mdeclare %p seq %u peeridx %u empty intp %s", data, seq, peeridx, decl_intp_mode_str(intp));
+    } else {
+        ZT(PUBSUB, "handle_mdeclare %p seq %u peeridx %u ndecls %u intp %s", data, seq, peeridx, ndecls, decl_intp_mode_str(intp));
+    }
     while (ndecls > 0 && *data < end && res == ZUR_OK) {
         switch (**data & DKIND) {
             case DRESOURCE:   res = handle_dresource(peeridx, end, data, &intp); break;
@@ -1352,15 +1735,18 @@ static enum zhe_unpack_result handle_mdeclare(peeridx_t peeridx, const uint8_t *
             /* Merge uncommitted declaration state resulting from this DECLARE message into
                uncommitted state accumulator, as we have now completely and successfully processed
                this message.  */
-            ZT(PUBSUB, "handle_mdeclare %u .. packet done", peeridx);
+            if (!empty) {
+                ZT(PUBSUB, "handle_mdeclare %u .. packet done", peeridx);
+            }
             zhe_rsub_precommit_curpkt_done(peeridx);
             (void)ic_update_seq(&peers[peeridx].ic[cid], MRFLAG, seq);
-            /* If C flag set, commit, closing the connection if an error is encountered */
+            /* If C flag set, commit, closing the connection if a fatal error is encountered: there
+               is no RESULT to report the others in, and a peer reconnecting can't do better */
             if (hdr & MCFLAG) {
                 uint8_t commitres;
                 zhe_rid_t err_rid;
                 ZT(PUBSUB, "handle_mdeclare %u .. C flag set", peeridx);
-                if ((commitres = zhe_rsub_precommit(peeridx, &err_rid)) == 0) {
+                if ((commitres = zhe_rsub_precommit(peeridx, DECLERR_FATAL, &err_rid)) == 0) {
                     zhe_rsub_commit(peeridx);
                 }
                 if (commitres != 0) {
@@ -1413,6 +1799,54 @@ static enum zhe_unpack_result handle_msynch(peeridx_t peeridx, const uint8_t * c
 
 unsigned zhe_delivered, zhe_discarded;
 
+static void process_msdata(peeridx_t peeridx, cid_t cid, uint8_t hdr, seq_t seq, zhe_rid_t prid, zhe_paysize_t paysz, const uint8_t *pay, zhe_time_t tnow);
+
+/* Longest SDATA header the unchecked decoding accepts: numbers of at most N/7 bytes can't overflow
+   an N-bit type, and the payload size is at most 2 bytes */
+#define MSDATA_VALIDATED_HDRLEN (1 + SEQNUM_LEN / 7 + 2 * (ZHE_RID_SIZE / 7) + 2)
+
+static const uint8_t *unpack_validated_seq(const uint8_t *data, seq_t *seq)
+{
+    seq_t n = 0;
+    for (unsigned i = 0; i < SEQNUM_LEN / 7; i++) {
+        const uint8_t x = data[i];
+        n |= (seq_t)((seq_t)(x & 0x7f) << (7 * i));
+        if (!(x & 0x80)) {
+            *seq = (seq_t)(n << SEQNUM_SHIFT);
+            return data + i + 1;
+        }
+    }
+    return NULL;
+}
+
+static const uint8_t *unpack_validated_rid(const uint8_t *data, zhe_rid_t *rid)
+{
+    zhe_rid_t n = 0;
+    for (unsigned i = 0; i < ZHE_RID_SIZE / 7; i++) {
+        const uint8_t x = data[i];
+        n |= (zhe_rid_t)((zhe_rid_t)(x & 0x7f) << (7 * i));
+        if (!(x & 0x80)) {
+            zhe_assert(!(n & 1)); /* while not doing SIDs yet */
+            *rid = n >> 1;
+            return data + i + 1;
+        }
+    }
+    return NULL;
+}
+
+static const uint8_t *unpack_validated_paysize(const uint8_t *data, zhe_paysize_t *paysz)
+{
+    if (!(data[0] & 0x80)) {
+        *paysz = data[0];
+        return data + 1;
+    } else if (!(data[1] & 0x80)) {
+        *paysz = (zhe_paysize_t)((data[0] & 0x7f) | (data[1] << 7));
+        return data + 2;
+    } else {
+        return NULL;
+    }
+}
+
 static enum zhe_unpack_result handle_msdata(peeridx_t peeridx, const uint8_t * const end, const uint8_t **data, cid_t cid, zhe_time_t tnow)
 {
     enum zhe_unpack_result res;
@@ -1421,6 +1855,24 @@ static enum zhe_unpack_result handle_msdata(peeridx_t peeridx, const uint8_t * c
     const uint8_t *pay;
     seq_t seq;
     zhe_rid_t rid, prid;
+    if (end - *data >= MSDATA_VALIDATED_HDRLEN) {
+        /* A single check that the longest header we care to decode fast fits suffices for
+           decoding the header, and then only the payload remains to be checked. Anything
+           unusual (very long encodings, data near the end of the packet) is left to the
+           fully checked decoding below, as that decides between short input and overflow */
+        const uint8_t *p = *data;
+        hdr = *p++;
+        if ((p = unpack_validated_seq(p, &seq)) != NULL && (p = unpack_validated_rid(p, &rid)) != NULL) {
+            prid = rid;
+            if ((!(hdr & MAFLAG) || (p = unpack_validated_rid(p, &prid)) != NULL) &&
+                (p = unpack_validated_paysize(p, &paysz)) != NULL &&
+                end - p >= paysz) {
+                *data = p + paysz;
+                process_msdata(peeridx, cid, hdr, seq, prid, paysz, p, tnow);
+                return ZUR_OK;
+            }
+        }
+    }
     if ((res = zhe_unpack_byte(end, data, &hdr)) != ZUR_OK ||
         (res = zhe_unpack_seq(end, data, &seq)) != ZUR_OK ||
         (res = zhe_unpack_rid(end, data, &rid)) != ZUR_OK) {
@@ -1434,15 +1886,20 @@ static enum zhe_unpack_result handle_msdata(peeridx_t peeridx, const uint8_t * c
     if ((res = zhe_unpack_vecref(end, data, &paysz, &pay)) != ZUR_OK) {
         return res;
     }
+    process_msdata(peeridx, cid, hdr, seq, prid, paysz, pay, tnow);
+    return ZUR_OK;
+}
 
+static void process_msdata(peeridx_t peeridx, cid_t cid, uint8_t hdr, seq_t seq, zhe_rid_t prid, zhe_paysize_t paysz, const uint8_t *pay, zhe_time_t tnow)
+{
     if (peers[peeridx].state != PEERST_ESTABLISHED) {
         /* Not accepting data from peers that we haven't (yet) established a connection with */
-        return ZUR_OK;
+        return;
     }
 
     if (!(hdr & MRFLAG)) {
         if (ic_may_deliver_seq(&peers[peeridx].ic[cid], hdr, seq)) {
-            (void)zhe_handle_msdata_deliver(prid, paysz, pay);
+            (void)zhe_handle_msdata_deliver(peeridx, prid, paysz, pay);
             ic_update_seq(&peers[peeridx].ic[cid], hdr, seq);
         }
     } else if (peers[peeridx].ic[cid].synched) {
@@ -1452,7 +1909,7 @@ static enum zhe_unpack_result handle_msdata(peeridx_t peeridx, const uint8_t * c
         }
         if (ic_may_deliver_seq(&peers[peeridx].ic[cid], hdr, seq)) {
             ZT(RELIABLE, "handle_msdata peeridx %u cid %u seq %u deliver", peeridx, cid, seq >> SEQNUM_SHIFT);
-            if (zhe_handle_msdata_deliver(prid, paysz, pay)) {
+            if (zhe_handle_msdata_deliver(peeridx, prid, paysz, pay)) {
                 /* if failed to deliver, we must retry, which necessitates a retransmit and not updating the conduit state */
                 ic_update_seq(&peers[peeridx].ic[cid], hdr, seq);
             }
@@ -1463,8 +1920,6 @@ static enum zhe_unpack_result handle_msdata(peeridx_t peeridx, const uint8_t * c
         }
         acknack_if_needed(peeridx, cid, hdr & MSFLAG, tnow);
     }
-
-    return ZUR_OK;
 }
 
 static enum zhe_unpack_result handle_mwdata(peeridx_t peeridx, const uint8_t * const end, const uint8_t **data, cid_t cid, zhe_time_t tnow)
@@ -1521,6 +1976,88 @@ static enum zhe_unpack_result handle_mwdata(peeridx_t peeridx, const uint8_t * c
     return ZUR_OK;
 }
 
+unsigned zhe_fec_recovered;
+
+#if FEC_GROUP_SIZE > 0
+static void ic_fec_replay(peeridx_t peeridx, cid_t cid, zhe_time_t tnow)
+{
+    /* Deliver whatever buffered messages have become deliverable, stopping when delivery fails
+       because then the conduit state doesn't advance (nor would it on retrying immediately) */
+    struct in_conduit * const ic = &peers[peeridx].ic[cid];
+    const uint8_t *msg;
+    zhe_msgsize_t len;
+    while (peers[peeridx].state == PEERST_ESTABLISHED && (msg = zhe_fec_dec_get(&peers_ic_fec[peeridx][cid], ic->seq, &len)) != NULL) {
+        const seq_t seq = ic->seq;
+        const uint8_t *p = msg;
+        ZT(RELIABLE, "ic_fec_replay peeridx %u cid %u seq %u", peeridx, cid, seq >> SEQNUM_SHIFT);
+        switch (*msg & MKIND) {
+            case MDECLARE: (void)handle_mdeclare(peeridx, msg + len, &p, cid, tnow); break;
+            case MSDATA:   (void)handle_msdata(peeridx, msg + len, &p, cid, tnow); break;
+            case MWDATA:   (void)handle_mwdata(peeridx, msg + len, &p, cid, tnow); break;
+        }
+        if (ic->seq == seq) {
+            break;
+        }
+    }
+}
+
+static void ic_fec_note(peeridx_t peeridx, cid_t cid, const uint8_t *msg, const uint8_t *end, zhe_time_t tnow)
+{
+    /* Buffer reliable messages once the peer is known to send parity on this conduit */
+    struct fec_dec * const d = &peers_ic_fec[peeridx][cid];
+    const uint8_t kind = *msg & MKIND;
+    const uint8_t *p = msg + 1;
+    seq_t seq;
+    if (kind != MDECLARE && !((kind == MSDATA || kind == MWDATA) && (*msg & MRFLAG))) {
+        return;
+    } else if (!d->active || peers[peeridx].state != PEERST_ESTABLISHED || !peers[peeridx].ic[cid].synched) {
+        return;
+    } else if (zhe_unpack_seq(end, &p, &seq) != ZUR_OK) {
+        return;
+    } else if (*msg == MDECLARE && (p == end || *p == 0)) {
+        /* empty DECLAREs (without flags, unlike a commit) replace superseded samples in the
+           transmit window, and so may differ from what the parity was computed over */
+        return;
+    }
+    zhe_fec_dec_store(d, seq, msg, (zhe_msgsize_t)(end - msg));
+    ic_fec_replay(peeridx, cid, tnow);
+}
+#endif
+
+static enum zhe_unpack_result handle_mfec(peeridx_t peeridx, const uint8_t * const end, const uint8_t **data, cid_t cid, zhe_time_t tnow)
+{
+    enum zhe_unpack_result res;
+    uint8_t hdr, k;
+    seq_t base;
+    uint16_t lenxor;
+    zhe_paysize_t plen;
+    const uint8_t *parity;
+    if ((res = zhe_unpack_byte(end, data, &hdr)) != ZUR_OK ||
+        (res = zhe_unpack_seq(end, data, &base)) != ZUR_OK ||
+        (res = zhe_unpack_byte(end, data, &k)) != ZUR_OK ||
+        (res = zhe_unpack_vle16(end, data, &lenxor)) != ZUR_OK ||
+        (res = zhe_unpack_vecref(end, data, &plen, &parity)) != ZUR_OK) {
+        return res;
+    }
+    if (peers[peeridx].state != PEERST_ESTABLISHED || !peers[peeridx].ic[cid].synched) {
+        return ZUR_OK;
+    }
+#if FEC_GROUP_SIZE > 0
+    /* Different group sizes can't be handled, in which case it will simply rely on retransmits */
+    if (k == FEC_GROUP_SIZE && plen <= FEC_MAX_MSGSIZE && lenxor <= FEC_MAX_MSGSIZE) {
+        if (zhe_fec_dec_recover(&peers_ic_fec[peeridx][cid], base, (zhe_msgsize_t)lenxor, plen, parity)) {
+            ZT(RELIABLE, "handle_mfec peeridx %u cid %u base %u recovered", peeridx, cid, base >> SEQNUM_SHIFT);
+            zhe_fec_recovered++;
+            ic_fec_replay(peeridx, cid, tnow);
+        }
+    }
+#endif
+    if (peers[peeridx].state == PEERST_ESTABLISHED) {
+        acknack_if_needed(peeridx, cid, hdr & MSFLAG, tnow);
+    }
+    return ZUR_OK;
+}
+
 #if ! XMITW_SAMPLE_INDEX
 static xwpos_t xmitw_skip_to_seq(const struct out_conduit *c, xwpos_t p, seq_t s, seq_t end)
 {
@@ -1558,13 +2095,193 @@ static void remove_acked_messages(struct out_conduit * restrict c, seq_t seq)
         c->seqbase = seq;
 #endif
         zhe_assert(((c->firstpos + sizeof(zhe_msgsize_t)) % c->xmitw_bytes == c->pos) == (c->seq == c->seqbase));
+        if (c->decls_unacked && zhe_seq_le(c->declseq, c->seqbase)) {
+            c->decls_unacked = 0;
+        }
+        c->ack_requested = 0;
     }
 
-    if (oc_get_nsamples(c) == 0) {
-        c->draining_window = 0;
+    if (oc_get_nsamples(c) == 0 && c->draining_window) {
+        oc_set_writable(c);
     }
 }
 
+static bool xmitw_is_empty_declare(const struct out_conduit *c, xwpos_t p)
+{
+    /* header without flags, VLE sequence number (that must end somewhere) and 0 for the number of
+       declarations; an empty DECLARE with the C flag is a commit and must be delivered */
+    const zhe_msgsize_t len = xmitw_load_msgsize(c, p);
+    p = xmitw_pos_add(c, p, sizeof(zhe_msgsize_t));
+    if (c->rbuf[p] != MDECLARE) {
+        return false;
+    }
+    for (zhe_msgsize_t i = 1; i < len; i++) {
+        p = xmitw_pos_add(c, p, 1);
+        if (!(c->rbuf[p] & 0x80)) {
+            return i + 2 == len && c->rbuf[xmitw_pos_add(c, p, 1)] == 0;
+        }
+    }
+    return false;
+}
+
+static void xmitw_make_empty(struct out_conduit * restrict c, seq_t seq, xwpos_t p)
+{
+    /* Replace the sample with sequence number SEQ at position P in the transmit window by an
+       empty DECLARE message with the same sequence number.  Receivers need to receive something
+       for every sequence number, but an empty DECLARE consumes the sequence number without side
+       effects.  The bytes freed up this way are reclaimed by moving the remainder of the window
+       down, and so this must not be done while a reliable message is being constructed. */
+    const zhe_msgsize_t len = xmitw_load_msgsize(c, p);
+    const zhe_msgsize_t tlen = (zhe_msgsize_t)(1 + zhe_pack_seqreq(seq) + 1);
+    xwpos_t src, dst;
+    zhe_assert(c->pos == xmitw_pos_add(c, c->spos, sizeof(zhe_msgsize_t)));
+    zhe_assert(tlen <= len);
+
+    /* Header byte becomes DECLARE, sequence number stays, followed by 0 declarations */
+    dst = xmitw_pos_add(c, p, sizeof(zhe_msgsize_t));
+    c->rbuf[dst] = MDECLARE;
+    dst = xmitw_pos_add(c, dst, (xwpos_t)(tlen - 1));
+    c->rbuf[dst] = 0;
+    dst = xmitw_pos_add(c, dst, 1);
+    xmitw_store_msgsize(c, p, tlen);
+#if XMITW_SAMPLE_LIFESPAN
+    xmitw_store_rbufexp(c, seq, 0);
+#endif
+
+    if (tlen < len) {
+        const xwpos_t delta = (xwpos_t)(len - tlen);
+        src = xmitw_pos_add(c, p, (xwpos_t)(sizeof(zhe_msgsize_t) + len));
+        while (src != c->spos) {
+            c->rbuf[dst] = c->rbuf[src];
+            dst = xmitw_pos_add(c, dst, 1);
+            src = xmitw_pos_add(c, src, 1);
+        }
+#if XMITW_SAMPLE_INDEX
+        for (seq_t s = seq + SEQNUM_UNIT; s != c->seq; s += SEQNUM_UNIT) {
+            xwpos_t q = xmitw_load_rbufidx(c, s);
+            xmitw_store_rbufidx(c, s, (xwpos_t)(q >= delta ? q - delta : q + c->xmitw_bytes - delta));
+        }
+#endif
+        c->spos = dst;
+        c->pos = xmitw_pos_add(c, c->spos, sizeof(zhe_msgsize_t));
+    }
+    ZT(RELIABLE, "xmitw_make_empty cid %u seq %u freed %u", c->cid, seq >> SEQNUM_SHIFT, (unsigned)(len - tlen));
+#if !defined(NDEBUG) && XMITW_SAMPLE_INDEX
+    check_xmitw(c);
+#endif
+}
+
+bool zhe_oc_supersede(struct out_conduit * restrict c, seq_t seq, zhe_rid_t rid)
+{
+    /* Replace the reliable MSDATA for RID with sequence number SEQ, if it is still in the
+       transmit window, by an empty DECLARE message.  Empty DECLAREs at the start of the window
+       are dropped altogether, the usual SYNCH/ACKNACK exchange then moves the receivers past
+       them. */
+    uint8_t hdr[24];
+    const uint8_t *hp = hdr + 1;
+    zhe_msgsize_t len, n;
+    xwpos_t p, src;
+    seq_t hseq;
+    zhe_rid_t hrid;
+    if (zhe_seq_lt(seq, c->seqbase) || !zhe_seq_lt(seq, c->seq)) {
+        return false;
+    }
+#if XMITW_SAMPLE_INDEX
+    p = xmitw_load_rbufidx(c, seq);
+#else
+    p = xmitw_skip_to_seq(c, c->firstpos, c->seqbase, seq);
+#endif
+    len = xmitw_load_msgsize(c, p);
+    n = (len < sizeof(hdr)) ? len : (zhe_msgsize_t)sizeof(hdr);
+    src = xmitw_pos_add(c, p, sizeof(zhe_msgsize_t));
+    for (zhe_msgsize_t i = 0; i < n; i++) {
+        hdr[i] = c->rbuf[src];
+        src = xmitw_pos_add(c, src, 1);
+    }
+    /* Sequence numbers get reused eventually, so verify it really is the expected sample */
+    if (hdr[0] != (MSDATA | MRFLAG) ||
+        zhe_unpack_seq(hdr + n, &hp, &hseq) != ZUR_OK || hseq != seq ||
+        zhe_unpack_rid(hdr + n, &hp, &hrid) != ZUR_OK || hrid != rid) {
+        return false;
+    }
+    xmitw_make_empty(c, seq, p);
+    if (seq == c->seqbase) {
+        seq_t s = c->seqbase;
+        p = c->firstpos;
+        while (s != c->seq && xmitw_is_empty_declare(c, p)) {
+            p = xmitw_skip_sample(c, p);
+            s += SEQNUM_UNIT;
+        }
+        remove_acked_messages(c, s);
+    }
+    return true;
+}
+
+#if XMITW_SAMPLE_LIFESPAN
+void zhe_oc_set_expiry(struct out_conduit *c, seq_t seq, zhe_time_t texp)
+{
+    /* 0 means the sample doesn't expire, expiring 1 unit later is no problem */
+    if (texp == 0) {
+        texp = 1;
+    }
+    xmitw_store_rbufexp(c, seq, texp);
+    if (!c->has_expiring || (zhe_timediff_t)(texp - c->texpire) < 0) {
+        c->texpire = texp;
+        c->has_expiring = 1;
+    }
+}
+
+static void oc_expire_samples(struct out_conduit * const c, zhe_time_t tnow)
+{
+    /* Expired samples at the start of the window are simply dropped, those in the middle are
+       replaced by empty DECLAREs that get dropped once they reach the start; a SYNCH then tells
+       the receivers not to wait for the dropped ones.  Usually all publications will have the
+       same lifespan, and then it is only ever the oldest samples that expire. */
+    const seq_t seqbase0 = c->seqbase;
+    zhe_time_t tnext = 0;
+    bool any = false;
+    if (!c->has_expiring || (zhe_timediff_t)(tnow - c->texpire) < 0) {
+        return;
+    }
+    for (seq_t s = c->seqbase; s != c->seq; s += SEQNUM_UNIT) {
+        const zhe_time_t texp = xmitw_load_rbufexp(c, s);
+        if (texp != 0 && (zhe_timediff_t)(tnow - texp) >= 0) {
+            if (s == c->seqbase) {
+                remove_acked_messages(c, s + SEQNUM_UNIT);
+            } else {
+                xmitw_make_empty(c, s, xmitw_load_rbufidx(c, s));
+            }
+        } else if (texp == 0 && s == c->seqbase && xmitw_is_empty_declare(c, c->firstpos)) {
+            remove_acked_messages(c, s + SEQNUM_UNIT);
+        } else if (texp != 0 && (!any || (zhe_timediff_t)(texp - tnext) < 0)) {
+            tnext = texp;
+            any = true;
+        }
+    }
+    c->texpire = tnext;
+    c->has_expiring = any;
+    if (c->seqbase != seqbase0) {
+        ZT(RELIABLE, "oc_expire_samples cid %u seqbase %u -> %u", c->cid, seqbase0 >> SEQNUM_SHIFT, c->seqbase >> SEQNUM_SHIFT);
+        zhe_pack_msynch(&c->addr, (c->seq != c->seqbase) ? MSFLAG : 0, c->cid, c->seqbase, oc_get_nsamples(c), tnow);
+        zhe_pack_msend();
+    }
+}
+#endif
+
+seq_t zhe_oc_get_nextseq(const struct out_conduit *c)
+{
+    return c->seq;
+}
+
+void zhe_oc_note_declare(struct out_conduit *c)
+{
+    c->declseq = c->seq;
+    c->decls_unacked = 1;
+    decls_complete_notified = false;
+}
+
+unsigned zhe_rexmit_sent;
+
 static enum zhe_unpack_result handle_macknack(peeridx_t peeridx, const uint8_t * const end, const uint8_t **data, cid_t cid, zhe_time_t tnow)
 {
     struct out_conduit * const c = zhe_out_conduit_from_cid(peeridx, cid);
@@ -1648,6 +2365,7 @@ static enum zhe_unpack_result handle_macknack(peeridx_t peeridx, const uint8_t *
                 p = xmitw_pos_add(c, p, sizeof(zhe_msgsize_t));
                 zhe_pack_reserve_mconduit(&c->addr, NULL, cid, sz, tnow);
                 outspos_tmp = outp;
+                zhe_rexmit_sent++;
                 while (sz--) {
                     zhe_pack1(c->rbuf[p]);
                     p = xmitw_pos_add(c, p, 1);
@@ -1756,9 +2474,13 @@ static enum zhe_unpack_result handle_packet(peeridx_t * restrict peeridx, const
             case MACKNACK:   res = handle_macknack(*peeridx, end, &data1, cid, tnow); break;
             case MKEEPALIVE: res = handle_mkeepalive(peeridx, end, &data1, tnow); break;
             case MCONDUIT:   res = handle_mconduit(*peeridx, end, &data1, &cid, tnow); break;
+            case MFEC:       res = handle_mfec(*peeridx, end, &data1, cid, tnow); break;
             default:         res = ZUR_OVERFLOW; break;
         }
         if (res == ZUR_OK) {
+#if FEC_GROUP_SIZE > 0
+            ic_fec_note(*peeridx, cid, *data, data1, tnow);
+#endif
             *data = data1;
         }
     } while (data1 < end && res == ZUR_OK);
@@ -1803,12 +2525,14 @@ int zhe_init(const struct zhe_config *config, struct zhe_platform *pf, zhe_time_
 void zhe_start(zhe_time_t tnow)
 {
     tnextscout = tnow - SCOUT_INTERVAL;
+    scout_interval = SCOUT_INTERVAL_MIN;
 }
 
 static void maybe_send_scout(zhe_time_t tnow)
 {
     if ((zhe_timediff_t)(tnow - tnextscout) >= 0) {
-        tnextscout = tnow + SCOUT_INTERVAL;
+        tnextscout = tnow + scout_interval;
+        scout_interval = (scout_interval >= SCOUT_INTERVAL / 2) ? SCOUT_INTERVAL : 2 * scout_interval;
 #if MAX_PEERS == 0
         if (peers[0].state == PEERST_UNKNOWN) {
             zhe_pack_mscout(&scoutaddr, tnow);
@@ -1840,20 +2564,12 @@ static void maybe_send_scout(zhe_time_t tnow)
 }
 
 #if TRANSPORT_MODE == TRANSPORT_PACKET
-int zhe_input(const void * restrict buf, size_t sz, const struct zhe_address *src, zhe_time_t tnow)
+static int input_packet(const void * restrict buf, size_t sz, const struct zhe_address *src, zhe_time_t tnow)
 {
 #if ENABLE_TRACING
     char addrstr[TRANSPORT_ADDRSTRLEN];
 #endif
-    peeridx_t peeridx, free_peeridx = PEERIDX_INVALID;
-
-    for (peeridx = 0; peeridx < MAX_PEERS_1; peeridx++) {
-        if (zhe_platform_addr_eq(src, &peers[peeridx].oc.addr)) {
-            break;
-        } else if (peers[peeridx].state == PEERST_UNKNOWN && free_peeridx == PEERIDX_INVALID) {
-            free_peeridx = peeridx;
-        }
-    }
+    peeridx_t peeridx = peers_by_addr[peerhash_addr_pos(src)];
 
 #if ENABLE_TRACING
     if (ZTT(DEBUG)) {
@@ -1861,13 +2577,16 @@ int zhe_input(const void * restrict buf, size_t sz, const struct zhe_address *sr
     }
 #endif
 
-    if (peeridx == MAX_PEERS_1 && free_peeridx != PEERIDX_INVALID) {
-        ZT(DEBUG, "possible new peer %s @ %u", addrstr, free_peeridx);
-        peeridx = free_peeridx;
-        peers[peeridx].oc.addr = *src;
+    if (peeridx == PEERIDX_INVALID) {
+        const int free_peeridx = zhe_bitset_findfirst(peers_unknown, MAX_PEERS_1);
+        if (free_peeridx >= 0) {
+            ZT(DEBUG, "possible new peer %s @ %u", addrstr, (unsigned)free_peeridx);
+            peeridx = (peeridx_t)free_peeridx;
+            peer_set_addr(peeridx, src);
+        }
     }
 
-    if (peeridx < MAX_PEERS_1) {
+    if (peeridx != PEERIDX_INVALID) {
         enum zhe_unpack_result res;
         const uint8_t *bufp = buf;
         ZT(DEBUG, "handle message from %s @ %u", addrstr, peeridx);
@@ -1891,7 +2610,71 @@ int zhe_input(const void * restrict buf, size_t sz, const struct zhe_address *sr
         return 0;
     }
 }
-#elif TRANSPORT_MODE == TRANSPORT_STREAM
+
+int zhe_input(const void * restrict buf, size_t sz, const struct zhe_address *src, zhe_time_t tnow)
+{
+    const int n = input_packet(buf, sz, src, tnow);
+    notify_writable();
+    notify_declarations_complete();
+    return n;
+}
+
+#if ENABLE_LOANS
+/* Packet being processed by zhe_input_batch, the buffer of which handlers may borrow */
+static const struct zhe_inpkt *loan_pkt;
+#endif
+
+void zhe_input_batch(const struct zhe_inpkt *pkts, size_t n, zhe_time_t tnow)
+{
+    input_batching = true;
+    for (size_t i = 0; i < n; i++) {
+#if ENABLE_LOANS
+        loan_pkt = &pkts[i];
+#endif
+        (void)input_packet(pkts[i].buf, pkts[i].sz, pkts[i].src, tnow);
+    }
+#if ENABLE_LOANS
+    loan_pkt = NULL;
+#endif
+    input_batching = false;
+    flush_deferred_acknacks(tnow);
+    notify_writable();
+    notify_declarations_complete();
+}
+#endif
+
+void *zhe_loan_retain(const void *payload)
+{
+#if ENABLE_LOANS
+    /* Only payloads that are in the received packet itself can be lent out: not those of samples
+       delivered from the FEC buffers, nor those from zhe_input or delivery queues */
+    if (loan_pkt == NULL || loan_pkt->loan == NULL) {
+        return NULL;
+    }
+    const uintptr_t p = (uintptr_t)payload, b = (uintptr_t)loan_pkt->buf;
+    if (p < b || p >= b + loan_pkt->sz) {
+        return NULL;
+    }
+    zhe_platform_loan_retain(loan_pkt->loan);
+    return loan_pkt->loan;
+#else
+    (void)payload;
+    return NULL;
+#endif
+}
+
+void zhe_loan_release(void *loan)
+{
+    if (loan != NULL) {
+#if ENABLE_LOANS
+        zhe_platform_loan_release(loan);
+#else
+        zhe_assert(0);
+#endif
+    }
+}
+
+#if TRANSPORT_MODE == TRANSPORT_STREAM
 #if MAX_PEERS != 0
 #  error "stream currently only implemented for client mode"
 #endif
@@ -1918,6 +2701,8 @@ int zhe_input(const void * restrict buf, size_t sz, const struct zhe_address *sr
                 reset_peer(peeridx, tnow);
                 break;
         }
+        notify_writable();
+        notify_declarations_complete();
         return (int)(bufp - (const uint8_t *)buf);
     }
 }
@@ -1932,6 +2717,86 @@ static void maybe_send_msync_oc(struct out_conduit * const oc, zhe_time_t tnow)
     }
 }
 
+bool zhe_declarations_complete(void)
+{
+    if (npeers == 0 || !zhe_send_declares_done() || !zhe_decl_results_done()) {
+        return false;
+    }
+#if N_OUT_MCONDUITS > 0
+    for (cid_t cid = 0; cid < N_OUT_MCONDUITS; cid++) {
+        if (out_mconduits[cid].oc.decls_unacked) {
+            return false;
+        }
+    }
+#endif
+#if HAVE_UNICAST_CONDUIT
+    for (peeridx_t i = 0; i < MAX_PEERS_1; i++) {
+        if (peers[i].state == PEERST_ESTABLISHED && peers[i].oc.decls_unacked) {
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+void zhe_set_declarations_complete_handler(zhe_declshandler_t handler, void *arg)
+{
+    decls_complete_handler.handler = handler;
+    decls_complete_handler.arg = arg;
+    decls_complete_notified = false;
+}
+
+static void notify_declarations_complete(void)
+{
+    if (decls_complete_handler.handler == 0 || decls_complete_notified) {
+        return;
+    }
+    if (zhe_declarations_complete()) {
+        decls_complete_notified = true;
+        decls_complete_handler.handler(decls_complete_handler.arg);
+    }
+}
+
+void zhe_set_writable_handler(unsigned cid, zhe_writablehandler_t handler, void *arg)
+{
+    zhe_assert(cid < N_OUT_CONDUITS);
+    writable_handlers[cid].handler = handler;
+    writable_handlers[cid].arg = arg;
+}
+
+static void notify_writable(void)
+{
+    if (!writable_pending) {
+        return;
+    }
+    writable_pending = false;
+#if N_OUT_MCONDUITS > 0
+    for (cid_t cid = 0; cid < N_OUT_MCONDUITS; cid++) {
+        struct out_conduit * const oc = &out_mconduits[cid].oc;
+        if (oc->notify_writable) {
+            oc->notify_writable = 0;
+            if (writable_handlers[cid].handler) {
+                writable_handlers[cid].handler((unsigned)cid, writable_handlers[cid].arg);
+            }
+        }
+    }
+#endif
+#if HAVE_UNICAST_CONDUIT
+    {
+        bool notify = false;
+        for (peeridx_t i = 0; i < MAX_PEERS_1; i++) {
+            if (peers[i].oc.notify_writable) {
+                peers[i].oc.notify_writable = 0;
+                notify = true;
+            }
+        }
+        if (notify && writable_handlers[UNICAST_CID].handler) {
+            writable_handlers[UNICAST_CID].handler((unsigned)UNICAST_CID, writable_handlers[UNICAST_CID].arg);
+        }
+    }
+#endif
+}
+
 void zhe_flush(void)
 {
     if (outp > 0) {
@@ -1939,6 +2804,24 @@ void zhe_flush(void)
     }
 }
 
+/* Retrying an OPEN backs off the same way as scouting, starting at SCOUT_INTERVAL_MIN and doubling
+   with each attempt up to OPEN_INTERVAL. The wait after the last attempt is whatever remains of
+   the time a fixed OPEN_INTERVAL would take, so that giving up still takes as long as that. */
+static zhe_timediff_t open_retry_interval(uint8_t state)
+{
+    zhe_timediff_t intv = (SCOUT_INTERVAL_MIN < OPEN_INTERVAL) ? SCOUT_INTERVAL_MIN : OPEN_INTERVAL;
+    zhe_timediff_t sofar = 0;
+    for (uint8_t s = PEERST_OPENING_MIN; s < state; s++) {
+        sofar += intv;
+        intv = (intv >= OPEN_INTERVAL / 2) ? OPEN_INTERVAL : 2 * intv;
+    }
+    if (state == PEERST_OPENING_MAX) {
+        return (zhe_timediff_t)(PEERST_OPENING_MAX - PEERST_OPENING_MIN + 1) * OPEN_INTERVAL - sofar;
+    } else {
+        return intv;
+    }
+}
+
 void zhe_housekeeping(zhe_time_t tnow)
 {
     /* FIXME: obviously, this is a waste of CPU time if MAX_PEERS is biggish (but worst-case cost isn't affected) */
@@ -1954,12 +2837,15 @@ void zhe_housekeeping(zhe_time_t tnow)
                     reset_peer(i, tnow);
                 }
 #if HAVE_UNICAST_CONDUIT
+#if XMITW_SAMPLE_LIFESPAN
+                oc_expire_samples(&peers[i].oc, tnow);
+#endif
                 maybe_send_msync_oc(&peers[i].oc, tnow);
 #endif
                 break;
             default:
                 zhe_assert(peers[i].state >= PEERST_OPENING_MIN && peers[i].state <= PEERST_OPENING_MAX);
-                if ((zhe_timediff_t)(tnow - peers[i].tlease) > OPEN_INTERVAL) {
+                if ((zhe_timediff_t)(tnow - peers[i].tlease) > open_retry_interval(peers[i].state)) {
                     if (peers[i].state == PEERST_OPENING_MAX) {
                         /* maximum number of attempts reached, forget it */
                         ZT(PEERDISC, "giving up on attempting to establish a session with peer @ %u", i);
@@ -1979,6 +2865,9 @@ void zhe_housekeeping(zhe_time_t tnow)
 #if N_OUT_MCONDUITS > 0
     for (cid_t cid = 0; cid < N_OUT_MCONDUITS; cid++) {
         struct out_mconduit * const mc = &out_mconduits[cid];
+#if XMITW_SAMPLE_LIFESPAN
+        oc_expire_samples(&mc->oc, tnow);
+#endif
         maybe_send_msync_oc(&mc->oc, tnow);
     }
 #endif
@@ -1995,4 +2884,7 @@ void zhe_housekeeping(zhe_time_t tnow)
         zhe_pack_msend();
     }
 #endif
+
+    notify_writable();
+    notify_declarations_complete();
 }
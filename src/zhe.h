@@ -22,10 +22,22 @@ typedef uint16_t zhe_subidx_inner_t;
 #error "ZHE_MAX_SUBSCRIPTIONS >= 32768 not implemented (cf bitset_findfirst)"
 #endif
 
+#if ZHE_MAX_URIHANDLES < 256
+typedef uint8_t zhe_uri_handle_inner_t;
+#else
+typedef uint16_t zhe_uri_handle_inner_t;
+#endif
+
 typedef struct { zhe_pubidx_inner_t idx; } zhe_pubidx_t;
 typedef struct { zhe_subidx_inner_t idx; } zhe_subidx_t;
+typedef struct { zhe_uri_handle_inner_t idx; } zhe_uri_handle_t;
+
+/* zhe_prepare_uri returns an invalid handle if the URI can't be prepared */
+#define ZHE_URI_HANDLE_VALID(h_) ((h_).idx < ZHE_MAX_URIHANDLES)
 
 typedef void (*zhe_subhandler_t)(zhe_rid_t rid, const void *payload, zhe_paysize_t size, void *arg);
+typedef void (*zhe_writablehandler_t)(unsigned cid, void *arg);
+typedef void (*zhe_declshandler_t)(void *arg);
 
 struct zhe_address;
 struct zhe_platform;
@@ -47,13 +59,49 @@ int zhe_init(const struct zhe_config *config, struct zhe_platform *pf, zhe_time_
 void zhe_start(zhe_time_t tnow);
 void zhe_housekeeping(zhe_time_t tnow);
 int zhe_input(const void * restrict buf, size_t sz, const struct zhe_address *src, zhe_time_t tnow);
+
+/* A datagram for zhe_input_batch: sz bytes starting at buf received from src; loan is the
+   platform's handle for lending out buf to subscription handlers, NULL if it can't be lent out */
+struct zhe_inpkt {
+    const void *buf;
+    size_t sz;
+    const struct zhe_address *src;
+    void *loan;
+};
+void zhe_input_batch(const struct zhe_inpkt *pkts, size_t n, zhe_time_t tnow);
+void *zhe_loan_retain(const void *payload);
+void zhe_loan_release(void *loan);
 void zhe_flush(void);
 
+/* Values for the "reliable" parameter of zhe_publish: KEEPLAST is reliable, but with a history
+   depth of 1: a new sample supersedes the previous one if that hasn't been acknowledged yet */
+#define ZHE_PUB_UNRELIABLE        0
+#define ZHE_PUB_RELIABLE          1
+#define ZHE_PUB_RELIABLE_KEEPLAST 2
+
+/* Values for the "policy" parameter of zhe_set_delivery_queue, determining what happens to a sample
+   that doesn't fit in the queue: DROP_NEWEST discards it, DROP_OLDEST discards queued samples
+   until it fits and BLOCK refuses it, so that (reliable) data is retransmitted later */
+#define ZHE_QUEUE_DROP_NEWEST     0
+#define ZHE_QUEUE_DROP_OLDEST     1
+#define ZHE_QUEUE_BLOCK           2
+
 bool zhe_declare_resource(zhe_rid_t rid, const char *uri);
 zhe_pubidx_t zhe_publish(zhe_rid_t rid, unsigned cid, int reliable);
+bool zhe_unpublish(zhe_pubidx_t pubidx, zhe_time_t tnow);
 zhe_subidx_t zhe_subscribe(zhe_rid_t rid, zhe_paysize_t xmitneed, unsigned cid, zhe_subhandler_t handler, void *arg);
+bool zhe_unsubscribe(zhe_subidx_t subidx, zhe_time_t tnow);
+bool zhe_set_delivery_queue(zhe_subidx_t subidx, void *buf, size_t size, int policy);
+bool zhe_set_selection(zhe_subidx_t subidx, const char *predicate);
+unsigned zhe_dispatch(unsigned max);
 
 int zhe_write(zhe_pubidx_t pubidx, const void *data, zhe_paysize_t sz, zhe_time_t tnow);
+bool zhe_set_lifespan(zhe_pubidx_t pubidx, zhe_timediff_t lifespan);
+void zhe_set_writable_handler(unsigned cid, zhe_writablehandler_t handler, void *arg);
+bool zhe_declarations_complete(void);
+void zhe_set_declarations_complete_handler(zhe_declshandler_t handler, void *arg);
 int zhe_write_uri(const char *uri, const void *data, zhe_paysize_t sz, zhe_time_t tnow);
+zhe_uri_handle_t zhe_prepare_uri(const char *uri, unsigned cid, int reliable);
+int zhe_write_handle(zhe_uri_handle_t handle, const void *data, zhe_paysize_t sz, zhe_time_t tnow);
 
 #endif
@@ -1,3 +1,6 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* for recvmmsg */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -16,6 +19,9 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #include "platform-udp.h"
 #include "zhe-assert.h"
@@ -25,8 +31,26 @@
 
 #define BLOCKING_SEND 0
 #define SIMUL_PACKET_LOSS 1
+#ifdef __linux__
+#define USE_EPOLL_RECVMMSG 1
+#else
+#define USE_EPOLL_RECVMMSG 0
+#endif
 
 #define MAX_SELF 16
+#define SELFHASH_SIZE 32 /* power of 2, > MAX_SELF */
+
+/* Number of packets zhe_platform_recv_batch can return at once, and the number of additional
+   receive buffers available for lending out to the application */
+#define RECV_BATCH 32
+#define RECV_LOANS 32
+#define RECV_BUFS (RECV_BATCH + RECV_LOANS)
+
+struct rbuf {
+    unsigned refc;                /* number of loans outstanding, can't receive into it unless 0 */
+    zhe_address_t src;
+    char data[TRANSPORT_MTU];
+};
 
 struct udp {
     int s[2];
@@ -34,10 +58,16 @@ struct udp {
     uint16_t port;
     uint16_t ucport;
     size_t nself;
-    in_addr_t self[MAX_SELF];
+    /* own IP addresses, hashed; INADDR_ANY is never an own address and so marks empty slots */
+    in_addr_t selfhash[SELFHASH_SIZE];
 #if SIMUL_PACKET_LOSS
     long randomthreshold;
 #endif
+#if USE_EPOLL_RECVMMSG
+    int epfd;
+#endif
+    /* buffers for zhe_platform_recv_batch, valid until the next call or while on loan */
+    struct rbuf rbufs[RECV_BUFS];
 };
 
 static struct udp gudp;
@@ -63,6 +93,41 @@ void zhe_platform_trace(struct zhe_platform *pf, const char *fmt, ...)
     va_end(ap);
 }
 
+static unsigned selfhash_home(in_addr_t a)
+{
+    const uint32_t h = (uint32_t)a * 0x9e3779b1u;
+    return (unsigned)(h >> 16) & (SELFHASH_SIZE - 1);
+}
+
+static int selfhash_add(struct udp *udp, in_addr_t a)
+{
+    unsigned i = selfhash_home(a);
+    while (udp->selfhash[i] != htonl(INADDR_ANY)) {
+        if (udp->selfhash[i] == a) {
+            return 1;
+        }
+        i = (i + 1) & (SELFHASH_SIZE - 1);
+    }
+    if (udp->nself == MAX_SELF) {
+        return 0;
+    }
+    udp->selfhash[i] = a;
+    udp->nself++;
+    return 1;
+}
+
+static int selfhash_contains(const struct udp *udp, in_addr_t a)
+{
+    unsigned i = selfhash_home(a);
+    while (udp->selfhash[i] != htonl(INADDR_ANY)) {
+        if (udp->selfhash[i] == a) {
+            return 1;
+        }
+        i = (i + 1) & (SELFHASH_SIZE - 1);
+    }
+    return 0;
+}
+
 static void set_nonblock(int sock)
 {
     int flags = fcntl(sock, F_GETFL, 0);
@@ -92,6 +157,9 @@ struct zhe_platform *zhe_platform_new(uint16_t port, int drop_pct)
        testing. This does the trick as long as the addresses don't change. There are (probably)
        various better ways to deal with the original problem as well. */
     udp->nself = 0;
+    for (size_t i = 0; i < SELFHASH_SIZE; i++) {
+        udp->selfhash[i] = htonl(INADDR_ANY);
+    }
     if (getifaddrs(&ifa) == -1) {
         perror("getifaddrs");
         return NULL;
@@ -104,9 +172,8 @@ struct zhe_platform *zhe_platform_new(uint16_t port, int drop_pct)
                 zhe_platform_addr2string(NULL, str, sizeof(str), &za);
                 if (a->sin_addr.s_addr == htonl(INADDR_ANY) || a->sin_addr.s_addr == htonl(INADDR_NONE)) {
                     ZT(TRANSPORT, "%s: %s (not interesting)", c->ifa_name, str);
-                } else if (udp->nself < MAX_SELF) {
+                } else if (selfhash_add(udp, a->sin_addr.s_addr)) {
                     ZT(TRANSPORT, "%s: %s", c->ifa_name, str);
-                    udp->self[udp->nself++] = a->sin_addr.s_addr;
                 } else {
                     ZT(TRANSPORT, "%s: %s (no space left)", c->ifa_name, str);
                 }
@@ -163,6 +230,24 @@ struct zhe_platform *zhe_platform_new(uint16_t port, int drop_pct)
         perror("bind[1]");
         goto err;
     }
+
+#if USE_EPOLL_RECVMMSG
+    if ((udp->epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        goto err;
+    }
+    for (size_t i = 0; i < sizeof(udp->s) / sizeof(udp->s[0]); i++) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = udp->s[i];
+        if (epoll_ctl(udp->epfd, EPOLL_CTL_ADD, udp->s[i], &ev) == -1) {
+            perror("epoll_ctl");
+            close(udp->epfd);
+            goto err;
+        }
+    }
+#endif
     return (struct zhe_platform *)udp;
 
 err:
@@ -331,12 +416,7 @@ static ssize_t recv1(struct udp *udp, void * restrict buf, size_t size, zhe_addr
 
 static int is_from_me(const struct udp *udp, const zhe_address_t * restrict src)
 {
-    for (size_t i = 0; i < udp->nself; i++) {
-        if (src->a.sin_addr.s_addr == udp->self[i] && src->a.sin_port == udp->ucport) {
-            return 1;
-        }
-    }
-    return 0;
+    return src->a.sin_port == udp->ucport && selfhash_contains(udp, src->a.sin_addr.s_addr);
 }
 
 int zhe_platform_recv(struct zhe_platform *pf, void * restrict buf, size_t size, zhe_address_t * restrict src)
@@ -365,14 +445,121 @@ int zhe_platform_recv(struct zhe_platform *pf, void * restrict buf, size_t size,
     }
 }
 
+int zhe_platform_recv_batch(struct zhe_platform *pf, struct zhe_inpkt *pkts, size_t n)
+{
+    struct udp * const udp = (struct udp *)pf;
+    struct rbuf *bufs[RECV_BATCH];
+    size_t sz[RECV_BATCH];
+    size_t k = 0, m = 0;
+    bool error = false;
+    if (n > RECV_BATCH) {
+        n = RECV_BATCH;
+    }
+    /* Receive only into buffers that are not on loan, there may be fewer than n of those */
+    {
+        size_t nfree = 0;
+        for (size_t i = 0; i < RECV_BUFS && nfree < n; i++) {
+            if (udp->rbufs[i].refc == 0) {
+                bufs[nfree++] = &udp->rbufs[i];
+            }
+        }
+        n = nfree;
+    }
+    /* Drain both sockets, alternating which goes first so neither can starve the other */
+    for (int j = 0; j < 2 && k < n && !error; j++) {
+        const int sock = udp->s[(udp->next + j) % 2];
+#if USE_EPOLL_RECVMMSG
+        struct mmsghdr msgs[RECV_BATCH];
+        struct iovec iovs[RECV_BATCH];
+        int ret;
+        memset(msgs, 0, (n - k) * sizeof(msgs[0]));
+        for (size_t i = 0; i < n - k; i++) {
+            iovs[i].iov_base = bufs[k + i]->data;
+            iovs[i].iov_len = sizeof(bufs[k + i]->data);
+            msgs[i].msg_hdr.msg_name = &bufs[k + i]->src.a;
+            msgs[i].msg_hdr.msg_namelen = sizeof(bufs[k + i]->src.a);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        if ((ret = recvmmsg(sock, msgs, (unsigned)(n - k), MSG_DONTWAIT, NULL)) > 0) {
+            for (int i = 0; i < ret; i++) {
+                sz[k + (size_t)i] = msgs[i].msg_len;
+            }
+            k += (size_t)ret;
+        } else if (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            error = true;
+        }
+#else
+        while (k < n) {
+            socklen_t srclen = sizeof(bufs[k]->src.a);
+            const ssize_t ret = recvfrom(sock, bufs[k]->data, sizeof(bufs[k]->data), 0, (struct sockaddr *)&bufs[k]->src.a, &srclen);
+            if (ret <= 0) {
+                error = (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK);
+                break;
+            }
+            sz[k++] = (size_t)ret;
+        }
+#endif
+    }
+    udp->next = 1 - udp->next;
+    if (error && k == 0) {
+        /* packets received before the error are still returned, the error (if it persists) is
+           reported on the next call */
+        return SENDRECV_ERROR;
+    }
+    for (size_t i = 0; i < k; i++) {
+        const int self = is_from_me(udp, &bufs[i]->src);
+#if ENABLE_TRACING
+        if (ZTT(TRANSPORT)) {
+            char tmp[TRANSPORT_ADDRSTRLEN];
+            zhe_platform_addr2string(pf, tmp, sizeof(tmp), &bufs[i]->src);
+            ZT(TRANSPORT, "recv %zu from %s%s", sz[i], tmp, self ? " (self)" : "");
+        }
+#endif
+        if (!self) {
+            pkts[m].buf = bufs[i]->data;
+            pkts[m].sz = sz[i];
+            pkts[m].src = &bufs[i]->src;
+            pkts[m].loan = bufs[i];
+            m++;
+        }
+    }
+    return (int)m;
+}
+
+void zhe_platform_loan_retain(void *loan)
+{
+    struct rbuf * const b = loan;
+    b->refc++;
+}
+
+void zhe_platform_loan_release(void *loan)
+{
+    struct rbuf * const b = loan;
+    zhe_assert(b->refc > 0);
+    b->refc--;
+}
+
 int zhe_platform_addr_eq(const struct zhe_address *a, const struct zhe_address *b)
 {
     return a->a.sin_addr.s_addr == b->a.sin_addr.s_addr && a->a.sin_port == b->a.sin_port;
 }
 
+unsigned zhe_platform_addr_hash(const struct zhe_address *a)
+{
+    uint32_t h = (uint32_t)a->a.sin_addr.s_addr ^ ((uint32_t)a->a.sin_port << 16);
+    h *= 0x9e3779b1u;
+    return (unsigned)(h ^ (h >> 16));
+}
+
 int zhe_platform_wait(const struct zhe_platform *pf, zhe_timediff_t timeout)
 {
     struct udp * const udp = (struct udp *)pf;
+#if USE_EPOLL_RECVMMSG
+    struct epoll_event evs[2];
+    const int ms = (timeout < 0) ? -1 : (int)(1000 * ZTIME_TO_SECu32(timeout) + ZTIME_TO_MSECu32(timeout));
+    return epoll_wait(udp->epfd, evs, 2, ms) > 0;
+#else
     const int k = (udp->s[0] > udp->s[1]) ? udp->s[0] : udp->s[1];
     fd_set rs;
     FD_ZERO(&rs);
@@ -386,4 +573,5 @@ int zhe_platform_wait(const struct zhe_platform *pf, zhe_timediff_t timeout)
         tv.tv_usec = 1000 * ZTIME_TO_MSECu32(timeout);
         return select(k+1, &rs, NULL, NULL, &tv) > 0;
     }
+#endif
 }
@@ -20,7 +20,15 @@ int zhe_platform_string2addr(const struct zhe_platform *pf, struct zhe_address *
 int zhe_platform_join(const struct zhe_platform *pf, const struct zhe_address *addr);
 int zhe_platform_wait(const struct zhe_platform *pf, zhe_timediff_t timeout);
 int zhe_platform_recv(struct zhe_platform *pf, void * restrict buf, size_t size, zhe_address_t * restrict src);
+/* Receives up to n packets, filling pkts, and returns the number of packets or SENDRECV_ERROR if
+   none could be received because of an error; the packets remain valid until the next call, or, if
+   a loan has been taken on it, until the last loan is released */
+struct zhe_inpkt;
+int zhe_platform_recv_batch(struct zhe_platform *pf, struct zhe_inpkt *pkts, size_t n);
+void zhe_platform_loan_retain(void *loan);
+void zhe_platform_loan_release(void *loan);
 int zhe_platform_send(struct zhe_platform *pf, const void * restrict buf, size_t size, const zhe_address_t * restrict dst);
 int zhe_platform_addr_eq(const struct zhe_address *a, const struct zhe_address *b);
+unsigned zhe_platform_addr_hash(const struct zhe_address *a);
 
 #endif
@@ -22,6 +22,7 @@ struct data {
 #define MAX_LAT 10000
 static uint64_t lat[MAX_LAT];
 static int latp = 0;
+static unsigned npongs = 0;
 
 static int uint64_cmp(const void *va, const void *vb)
 {
@@ -69,16 +70,25 @@ static void ping_handler(zhe_rid_t rid, const void *payload, zhe_paysize_t size,
     uint64_t hrtnow = gethrtime();
     const zhe_pubidx_t *pub = vpub;
     const struct data *pong = payload;
+    npongs++;
     latupd(hrtnow - pong->ts);
     struct data ping = { hrtnow };
     zhe_write(*pub, &ping, sizeof(ping), zhe_platform_time());
     zhe_flush(); /* just in case we use latency budget */
 }
 
-static void loop(struct zhe_platform *platform)
+static void send_ping(zhe_pubidx_t pub)
+{
+    /* write can't really fail with a reasonably sized buffer */
+    struct data d = { gethrtime() };
+    (void)zhe_write(pub, &d, sizeof(d), zhe_platform_time());
+    zhe_flush();
+}
+
+static void loop(struct zhe_platform *platform, bool (*done)(void))
 {
     zhe_time_t tnow = zhe_platform_time(), tend = tnow + (1000000000 / ZHE_TIMEBASE);
-    while ((zhe_timediff_t)(tnow - tend) < 0) {
+    while ((zhe_timediff_t)(tnow - tend) < 0 && !(done && done())) {
         zhe_housekeeping(tnow);
         if (zhe_platform_wait(platform, 10)) {
             char inbuf[TRANSPORT_MTU];
@@ -178,16 +188,22 @@ int main(int argc, char * const *argv)
     } else { /* ping */
         p = zhe_publish(1, cid, 1);
         (void)zhe_subscribe(2, 100, cid, ping_handler, &p);
-        /* while (!decls_done()) ... */
-        loop(platform);
-        /* first write can't really fail with a reasonably sized buffer */
-        struct data d = { gethrtime() };
-        (void)zhe_write(p, &d, sizeof(d), zhe_platform_time());
-        zhe_flush();
+        /* the first ping only gets through once the pong knows about our declarations */
+        do {
+            loop(platform, zhe_declarations_complete);
+        } while (!zhe_declarations_complete());
+        send_ping(p);
     }
     printf("starting loop\n");
     while(1) {
-        loop(platform);
+        const unsigned npongs0 = npongs;
+        loop(platform, NULL);
+        if (mode == 1 && npongs == npongs0) {
+            /* A ping written while we don't know of a subscriber for it is silently dropped, and
+               our declarations being complete doesn't mean we know about the pong's. So if no
+               pong arrived for a whole loop, ping again. */
+            send_ping(p);
+        }
     }
     return 0;
 }
@@ -22,20 +22,35 @@ struct data {
 
 static uint32_t checkintv = 16384;
 
-extern unsigned zhe_delivered, zhe_discarded;
+extern unsigned zhe_delivered, zhe_discarded, zhe_fec_recovered;
 
 struct pong { uint32_t k; zhe_time_t t; };
 
 #define MAX_KEY 9u
 
+#define INPUT_BATCH 32
+
+/* Buffer for queueing received samples when -Q is given, to call the handler outside zhe_input */
+static uint8_t delivq_buf[16384];
+
+/* Time of startup, for reporting the time it took for the first sample to arrive, which covers
+   discovery, session establishment and matching */
+static zhe_time_t tstartup;
+
 static void shandler(zhe_rid_t rid, const void *payload, zhe_paysize_t size, void *arg)
 {
     static zhe_time_t tprint;
     static uint32_t lastseq[MAX_KEY+1];
     static uint32_t oooc;
     static uint32_t lastseq_init;
+    static int got_first;
     const struct data * const d = payload;
     assert(size == sizeof(*d));
+    if (!got_first) {
+        zhe_time_t tnow = zhe_platform_time();
+        printf ("%4"PRIu32".%03"PRIu32" first sample after %"PRIu32".%03"PRIu32"s\n", ZTIME_TO_SECu32(tnow), ZTIME_TO_MSECu32(tnow), ZTIME_TO_SECu32(tnow - tstartup), ZTIME_TO_MSECu32(tnow - tstartup));
+        got_first = 1;
+    }
     if (rid == 0) {
         zhe_time_t tnow = zhe_platform_time();
         printf ("%4"PRIu32".%03"PRIu32" got a WriteData %u %u\n", ZTIME_TO_SECu32(tnow), ZTIME_TO_MSECu32(tnow), d->key, d->seq);
@@ -58,7 +73,7 @@ static void shandler(zhe_rid_t rid, const void *payload, zhe_paysize_t size, voi
             zhe_write(*pub, &pong, sizeof(pong), tnow);
             for (uint32_t k = 0; k <= MAX_KEY; k++) {
                 if (lastseq_init & (1u << k)) {
-                    printf ("%4"PRIu32".%03"PRIu32" [%u] %u %u [%u,%u]\n", ZTIME_TO_SECu32(tnow), ZTIME_TO_MSECu32(tnow), k, lastseq[k], oooc, zhe_delivered, zhe_discarded);
+                    printf ("%4"PRIu32".%03"PRIu32" [%u] %u %u [%u,%u,%u]\n", ZTIME_TO_SECu32(tnow), ZTIME_TO_MSECu32(tnow), k, lastseq[k], oooc, zhe_delivered, zhe_discarded, zhe_fec_recovered);
                 }
             }
             tprint = tnow;
@@ -75,6 +90,19 @@ static void rhandler(zhe_rid_t rid, const void *payload, zhe_paysize_t size, voi
     printf ("%4"PRIu32".%03"PRIu32" pong %u %4"PRIu32".%03"PRIu32"\n", ZTIME_TO_SECu32(tnow), ZTIME_TO_MSECu32(tnow), pong->k, ZTIME_TO_SECu32(pong->t), ZTIME_TO_MSECu32(pong->t));
 }
 
+static void dhandler(void *arg)
+{
+    zhe_time_t tnow = zhe_platform_time();
+    (void)arg;
+    printf ("%4"PRIu32".%03"PRIu32" declarations complete after %"PRIu32".%03"PRIu32"s\n", ZTIME_TO_SECu32(tnow), ZTIME_TO_MSECu32(tnow), ZTIME_TO_SECu32(tnow - tstartup), ZTIME_TO_MSECu32(tnow - tstartup));
+}
+
+static void whandler(unsigned cid, void *arg)
+{
+    int *blocked = arg;
+    *blocked = 0;
+}
+
 int main(int argc, char * const *argv)
 {
     unsigned char ownid[16];
@@ -82,11 +110,13 @@ int main(int argc, char * const *argv)
     int opt;
     int mode = 0;
     unsigned cid = 0;
-    int reliable = 1;
+    int reliable = ZHE_PUB_RELIABLE;
+    zhe_timediff_t lifespan = 0;
     uint32_t key = 0;
     struct zhe_config cfg;
     uint16_t port = 7447;
     int drop_pct = 0;
+    int use_delivq = 0;
     const char *scoutaddrstr = "239.255.0.1";
 #if N_OUT_MCONDUITS == 0
     char *mcgroups_join_str = "";
@@ -113,7 +143,7 @@ int main(int argc, char * const *argv)
 #endif
 
     scoutaddrstr = "239.255.0.1";
-    while((opt = getopt(argc, argv, "C:k:c:h:psquS:G:M:X:")) != EOF) {
+    while((opt = getopt(argc, argv, "C:k:c:h:lL:psquQS:G:M:X:")) != EOF) {
         switch(opt) {
             case 'h': ownidsize = getidfromarg(ownid, sizeof(ownid), optarg); break;
             case 'k':
@@ -134,7 +164,10 @@ int main(int argc, char * const *argv)
                 cid = (unsigned)t;
                 break;
             }
-            case 'u': reliable = 0; break;
+            case 'u': reliable = ZHE_PUB_UNRELIABLE; break;
+            case 'Q': use_delivq = 1; break;
+            case 'l': reliable = ZHE_PUB_RELIABLE_KEEPLAST; break;
+            case 'L': lifespan = (zhe_timediff_t)atoi(optarg); break;
             case 'C': checkintv = (unsigned)atoi(optarg); break;
             case 'S': scoutaddrstr = optarg; break;
             case 'X': drop_pct = atoi(optarg); break;
@@ -158,7 +191,9 @@ int main(int argc, char * const *argv)
         fprintf(stderr, "init failed\n");
         exit(1);
     }
-    zhe_start(zhe_platform_time());
+    tstartup = zhe_platform_time();
+    zhe_start(tstartup);
+    zhe_set_declarations_complete_handler(dhandler, NULL);
 
     zhe_declare_resource(1, "/t/data");
     zhe_declare_resource(2, "/t/pong");
@@ -171,21 +206,27 @@ int main(int argc, char * const *argv)
             zhe_pubidx_t p;
             if (mode != 0) {
                 p = zhe_publish(2, cid, 1);
-                (void)zhe_subscribe(1, 100 /* don't actually need this much ... */, cid, shandler, &p);
+                zhe_subidx_t s = zhe_subscribe(1, 100 /* don't actually need this much ... */, cid, shandler, &p);
+                if (use_delivq && !zhe_set_delivery_queue(s, delivq_buf, sizeof(delivq_buf), ZHE_QUEUE_BLOCK)) {
+                    fprintf(stderr, "delivery queues not supported\n"); exit(1);
+                }
             }
             while ((mode != 0) || ZTIME_TO_SECu32(zhe_platform_time() - tstart) < 20) {
                 zhe_time_t tnow;
                 if (zhe_platform_wait(platform, 10)) {
-                    char inbuf[TRANSPORT_MTU];
-                    zhe_address_t insrc;
-                    int recvret;
+                    /* Process whatever is available in one go, so that zhe sends a single ACK
+                       for all of it (per peer and conduit) */
+                    struct zhe_inpkt pkts[INPUT_BATCH];
+                    const int n = zhe_platform_recv_batch(platform, pkts, INPUT_BATCH);
                     tnow = zhe_platform_time();
-                    if ((recvret = zhe_platform_recv(platform, inbuf, sizeof(inbuf), &insrc)) > 0) {
-                        zhe_input(inbuf, (size_t)recvret, &insrc, tnow);
+                    if (n < 0) {
+                        perror("recv"); exit(1);
                     }
+                    zhe_input_batch(pkts, (size_t)n, tnow);
                 } else {
                     tnow = zhe_platform_time();
                 }
+                (void)zhe_dispatch(~0u);
                 zhe_housekeeping(tnow);
             }
             break;
@@ -193,10 +234,15 @@ int main(int argc, char * const *argv)
         case 1: {
             struct data d = { .key = key, .seq = 0 };
             zhe_pubidx_t p = zhe_publish(1, cid, reliable);
+            if (!zhe_set_lifespan(p, lifespan)) {
+                fprintf(stderr, "lifespan not supported\n"); exit(1);
+            }
             zhe_pubidx_t p2 = zhe_publish(2, cid, 1);
             (void)zhe_subscribe(1, 0, 0, shandler, &p2);
             (void)zhe_subscribe(2, 0, 0, rhandler, 0);
             zhe_time_t tprint = zhe_platform_time();
+            int blocked = 0;
+            zhe_set_writable_handler(cid, whandler, &blocked);
             while (1) {
                 const int blocksize = 50;
                 zhe_time_t tnow = zhe_platform_time();
@@ -204,22 +250,30 @@ int main(int argc, char * const *argv)
                 zhe_housekeeping(tnow);
 
                 {
-                    char inbuf[TRANSPORT_MTU];
-                    zhe_address_t insrc;
-                    int recvret;
-                    while ((recvret = zhe_platform_recv(platform, inbuf, sizeof(inbuf), &insrc)) > 0) {
-                        zhe_input(inbuf, (size_t)recvret, &insrc, tnow);
+                    struct zhe_inpkt pkts[INPUT_BATCH];
+                    int n;
+                    while ((n = zhe_platform_recv_batch(platform, pkts, INPUT_BATCH)) > 0) {
+                        zhe_input_batch(pkts, (size_t)n, tnow);
+                    }
+                    if (n < 0) {
+                        perror("recv"); exit(1);
                     }
                 }
 
+                if (blocked) {
+                    /* Nothing to do but wait for the ACKs that will make the writable handler clear it */
+                    zhe_platform_wait(platform, 10);
+                    continue;
+                }
+
                 /* Loop means we don't call zhe_housekeeping for each sample, which dramatically reduces the
                    number of (non-blocking) recvfrom calls and speeds things up a fair bit */
                 for (int i = 0; i < blocksize; i++) {
                     if (zhe_write(p, &d, sizeof(d), tnow)) {
                         if ((d.seq % checkintv) == 0) {
                             if (ZTIME_TO_SECu32(tnow - tprint) >= 1) {
-                                extern unsigned zhe_synch_sent;
-                                printf ("%4"PRIu32".%03"PRIu32" %u [%u]\n", ZTIME_TO_SECu32(tnow), ZTIME_TO_MSECu32(tnow), d.seq, zhe_synch_sent);
+                                extern unsigned zhe_synch_sent, zhe_rexmit_sent;
+                                printf ("%4"PRIu32".%03"PRIu32" %u [%u,%u]\n", ZTIME_TO_SECu32(tnow), ZTIME_TO_MSECu32(tnow), d.seq, zhe_synch_sent, zhe_rexmit_sent);
                                 tprint = tnow;
 
                                 struct data d1 = { .key = key, .seq = UINT32_MAX };
@@ -229,8 +283,9 @@ int main(int argc, char * const *argv)
                         d.seq++;
                     } else {
                         /* zhe_write failed => no space in transmit window => must first process incoming
-                         packets or expire a lease to make further progress */
-                        zhe_platform_wait(platform, 10);
+                         packets or expire a lease to make further progress, the writable handler tells
+                         us when that has happened */
+                        blocked = 1;
                         break;
                     }
                 }
@@ -8,6 +8,9 @@
 /* Maximum number of peers one node can have (that is, the network may consist of at most MAX_PEERS+1 nodes). If MAX_PEERS is 0, it becomes a client rather than a peer, and scouts for a broker instead */
 #define MAX_PEERS 5
 
+/* Maximum number of distinct RIDs subscribed to by remote peers (only in peer mode, a client relies on the broker for this); subscriptions beyond this are rejected */
+#define ZHE_MAX_RSUBS 64
+
 /* Number of input conduits, that is, the highest conduit id for which it can receive data from any peer/broker is N_IN_CONDUITS-1. The input conduit state is per-peer, per-conduit id, and hence which ones are used and what those are used for is determined on the sending side. It also means that peers may have different configurations for the maximum number of conduits. Input conduits have very little state. */
 #define N_IN_CONDUITS 3
 
@@ -29,14 +32,41 @@
 /* Whether or not to maintain a index of samples in the transmit windows that maps sequence number to byte position */
 #define XMITW_SAMPLE_INDEX 1
 
+/* Whether or not to support a lifespan for reliable samples, after which they are dropped from the transmit window even if not yet acknowledged by all peers. Requires XMITW_SAMPLE_INDEX and costs an additional timestamp per sample in the transmit windows. */
+#define XMITW_SAMPLE_LIFESPAN 1
+
+/* Maximum number of subscriptions for which samples can be queued, to invoke the handler later from zhe_dispatch rather than while processing input (see zhe_set_delivery_queue); 0 disables it */
+#define ZHE_MAX_DELIVERY_QUEUES 4
+
+/* Forward error correction on multicast conduits: after every FEC_GROUP_SIZE consecutive reliable messages (aligned on sequence numbers), a parity message is sent that is the XOR of those messages, allowing a receiver to reconstruct any single lost message in the group without a retransmit request. FEC_GROUP_SIZE must be a power of 2 no larger than 32; 0 disables it. Groups containing a message larger than FEC_MAX_MSGSIZE bytes are not protected. Receivers buffer FEC_GROUP_SIZE * FEC_MAX_MSGSIZE bytes per peer, per input conduit. */
+#define FEC_GROUP_SIZE 8
+#define FEC_MAX_MSGSIZE 64
+
 /* Constraints on storing URIs -- if MAX_URISPACE is set to 0, no URIs will be stored and resource declarations will be ignored */
 #define ZHE_MAX_URISPACE 3072
 #define ZHE_MAX_RESOURCES 20
 #define ZHE_MAX_URILENGTH 100
 
+/* Resources with URIs containing the wildcards "?", "*" and "**" are patterns, kept in a trie of URI segments with at most MAX_URIPATTERN_NODES nodes (the root included); 0 disables patterns and treats those characters literally */
+#define ZHE_MAX_URIPATTERN_NODES 64
+
+/* Automatic binding of URIs to ids: a URI written using zhe_write_uri URIBIND_THRESHOLD times gets bound to one of the top URIBIND_RIDS resource ids (which the application must not use), after which data written to it is sent with that id instead of the URI. At most MAX_URIBINDINGS URIs are tracked and bound (0 disables it), each bound URI taking up a resource; MAX_RBINDINGS is the maximum number of bindings accepted from peers. */
+#define ZHE_MAX_URIBINDINGS 4
+#define ZHE_URIBIND_THRESHOLD 8
+#define ZHE_URIBIND_RIDS 32
+#define ZHE_MAX_RBINDINGS 16
+
+/* Selections: a subscription may carry a predicate on the contents of the samples (see zhe_set_selection), declared to peers as a selection so that publishers can drop samples no subscriber wants. MAX_SELECTIONS is the number of local selections, each using one of the resource ids just below those reserved for URI bindings as its selection id; MAX_RSELECTIONS the number of selections accepted from peers (peer mode only), beyond which a peer's selection is ignored and the subscription taken as plain, so MAX_PEERS * MAX_SELECTIONS (of the peers) avoids that; MAX_PREDICATE_CODE the maximum size of a compiled predicate (7 bytes per comparison, 1 per logical operator). Selections require storing URIs. */
+#define ZHE_MAX_SELECTIONS 4
+#define ZHE_MAX_RSELECTIONS 20
+#define ZHE_MAX_PREDICATE_CODE 48
+
 /* Whether or not to enable tracing */
 #define ENABLE_TRACING 1
 
+/* Whether or not subscription handlers can borrow the receive buffer holding a sample (see zhe_loan_retain), requires platform support and TRANSPORT_PACKET */
+#define ENABLE_LOANS 1
+
 /* Setting a latency budget globally for now, though it could be done per-publisher as well. Packets will go out when full or when LATENCY_BUDGET milliseconds passed since we started filling it. Setting it to 0 will disable packing of data messages, setting to INF only stops packing when the MTU is reached and generally requires explicit flushing. Both edge cases eliminate the latency budget handling and state from the code, saving a whopping 4 bytes of RAM!  */
 #define LATENCY_BUDGET_INF      (4294967295u)
 #define LATENCY_BUDGET         10 /* units, see ZHE_TIMEBASE */
@@ -45,11 +75,12 @@
 #define MSYNCH_INTERVAL        10 /* units, see ZHE_TIMEBASE */
 #define ROUNDTRIP_TIME_ESTIMATE 1 /* units, see ZHE_TIMEBASE */
 
-/* Scouts are sent periodically by a peer; by a client only when not connected to, or trying to connect to, a broker. The interval is configurable. Scouts are always multicasted (however implemented by the transport). */
+/* Scouts are sent periodically by a peer; by a client only when not connected to, or trying to connect to, a broker. The interval is configurable. Scouts are always multicasted (however implemented by the transport). The interval starts at SCOUT_INTERVAL_MIN at startup and after losing a session, and doubles with each scout until it reaches SCOUT_INTERVAL; setting both to the same value gives a fixed interval. */
 #define SCOUT_INTERVAL       3000 /* units, see ZHE_TIMEBASE */
+#define SCOUT_INTERVAL_MIN    100 /* units, see ZHE_TIMEBASE */
 #define SCOUT_COUNT             0 /* send 10 scouts then stop scouting (0: unlimited; MAX_PEERS == 0 requires 0) */
 
-/* Once new peer/a broker has been discovered, a number of attempts at establishing a connection take place. The interval between these attempts is OPEN_INTERVAL, the number of attempts before giving up and relying on scouting again is OPEN_RETRIES. */
+/* Once new peer/a broker has been discovered, a number of attempts at establishing a connection take place. The interval between these attempts backs off like scouting from SCOUT_INTERVAL_MIN to OPEN_INTERVAL, the number of attempts before giving up and relying on scouting again is OPEN_RETRIES (currently always 5), and the attempts take as long in total as that many times OPEN_INTERVAL. */
 #define OPEN_INTERVAL        1000 /* units, see ZHE_TIMEBASE */
 #define OPEN_RETRIES           10 /* limited by OPENING_MIN .. _MAX */
 
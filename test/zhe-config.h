@@ -4,13 +4,16 @@
 
 #include <stdint.h>
 
-/* Highest allowed RID (because of temporary direct mapping; also ignoring selection IDs for the moment); also at the moment there are no resource declarations. */
+/* Highest allowed RID (ignoring selection IDs for the moment), only determines the size of zhe_rid_t and the worst-case message sizes: subscriptions are located by hashing RIDs, so neither memory use nor lookup cost depends on it */
 #define ZHE_MAX_RID 553
 
 /* Maximum number of subscriptions, publications. Having multiple subscriptions per resource may well make sense becasue they have different associated callbacks/arguments, having more than a reliable and an unreliable publication for a single resource (currently) seems unnecessary as no state is (currently) maintained for a publication */
 #define ZHE_MAX_SUBSCRIPTIONS 69
 #define ZHE_MAX_PUBLICATIONS 93
 
+/* Maximum number of URIs prepared for writing using zhe_prepare_uri, 0 disables it; each takes up space for its URI in the URI store */
+#define ZHE_MAX_URIHANDLES 4
+
 /* Types for representing timestamps (with an arbitrary reference,
    no assumed time alignment, and roll-over perfectly acceptable),
    and the difference of two timestamps (which are, at least in